@@ -0,0 +1,692 @@
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_async.h"
+#include "fat_dir.h"
+#include "bench_suite.h"
+
+// Benchmarks for the mini filesystem. Build with 'make bench', run './minifs_bench',
+// or './minifs_bench --json' for the API sweep of bench_suite.cpp ('make bench-json').
+
+const char * fox = "The quick brown fox jumps over the lazy dog.\n";
+
+static double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Same writes as test_write_to_file1 in main.cpp, followed by a delete so
+// the workload can be repeated on the same 10-block disk.
+static int write_file1_workload(FAT_FILESYSTEM * fs) {
+	char buffer[4096] = "";
+	char num[5];
+	for (int i=0; i<50; ++i) {
+		num[0] = (i/10) + '0';
+		num[1] = (i%10) + '0';
+		num[2] = '.';
+		num[3] = ' ';
+		num[4] = 0;
+		strcat(buffer, num);
+		strcat(buffer, fox);
+	}
+
+	int written = 0;
+	FAT_OPEN_FILE * fd1 = mini_file_open(fs, "file1.txt", true);
+	written += mini_file_write(fs, fd1, strlen(fox), fox);
+	written += mini_file_write(fs, fd1, strlen(fox), fox);
+	written += mini_file_write(fs, fd1, strlen(fox), fox);
+	written += mini_file_write(fs, fd1, strlen(buffer), buffer);
+	written += mini_file_write(fs, fd1, strlen(fox), fox);
+	mini_file_close(fs, fd1);
+	mini_file_delete(fs, "file1.txt");
+	return written;
+}
+
+static void bench_write_to_file1(int iterations, const int cache_capacity) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 1024, 10);
+	mini_cache_set_capacity(fs, cache_capacity);
+
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		write_file1_workload(fs);
+		mini_fat_flush(fs);
+	}
+	double elapsed = now_seconds() - start;
+	double host_ios = (double)fs->host_io_calls / iterations;
+
+	printf("test_write_to_file1 workload, cache of %d blocks, %d iterations:\n", cache_capacity, iterations);
+	printf("\ttime per iteration:      %.2f us\n", elapsed / iterations * 1e6);
+	printf("\tpread/pwrite per iteration: %.1f\n", host_ios);
+	if (cache_capacity == 0) {
+		// Every block access is one pwrite; it used to be fopen+fseek+fwrite+fclose.
+		printf("\tsyscalls per iteration with fopen/fclose per block: %.1f\n", host_ios * 4);
+	} else {
+		mini_cache_dump(fs);
+		mini_stats_dump(fs);
+	}
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Reads a 32 KiB file front to back in 45-byte chunks, many times.
+static void bench_read_file(const int io_mode, int iterations, const int cache_capacity = 0) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 1024, 64, io_mode);
+	mini_cache_set_capacity(fs, cache_capacity);
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "data.txt", true);
+	for (int i = 0; i < 32 * 1024 / 45; i++) {
+		mini_file_write(fs, fd, strlen(fox), fox);
+	}
+	mini_file_close(fs, fd);
+	int size = mini_file_size(fs, "data.txt");
+
+	unsigned long calls_before = fs->host_io_calls;
+	char buffer[45];
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		fd = mini_file_open(fs, "data.txt", false);
+		for (int read = 0; read < size; read += 45) {
+			mini_file_read(fs, fd, 45, buffer);
+		}
+		mini_file_close(fs, fd);
+	}
+	double elapsed = now_seconds() - start;
+
+	printf("Sequential 45-byte reads of a %d byte file (%s, cache of %d blocks), %d iterations:\n", size,
+		fs->io_mode == FAT_IO_MMAP ? "mmap" : "pread", fs->cache.capacity, iterations);
+	printf("\ttime per iteration:      %.2f us\n", elapsed / iterations * 1e6);
+	printf("\thost syscalls per iteration: %.1f\n", (double)(fs->host_io_calls - calls_before) / iterations);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Appends 45-byte records to a log file through one write handle.
+static void bench_small_appends(const int cache_capacity, const int appends) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 4096, appends * 45 / 4096 + 64);
+	mini_cache_set_capacity(fs, cache_capacity);
+
+	unsigned long calls_before = fs->host_io_calls;
+	double start = now_seconds();
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "log.txt", true);
+	for (int i = 0; i < appends; i++) {
+		mini_file_write(fs, fd, strlen(fox), fox);
+	}
+	mini_file_close(fs, fd);
+	mini_fat_flush(fs);
+	double elapsed = now_seconds() - start;
+
+	printf("%d 45-byte appends on 4 KiB blocks (cache of %d blocks):\n", appends, fs->cache.capacity);
+	printf("\ttime per append:         %.1f ns\n", elapsed / appends * 1e9);
+	printf("\tpwrite per append:       %.3f\n", (double)(fs->host_io_calls - calls_before) / appends);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Writes then reads a file in 1 MiB requests on 4 KiB blocks.
+static void bench_large_io(const int cache_capacity, const int iterations) {
+	const int request = 1 << 20;
+	const int file_size = 16 * request;
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 4096, file_size / 4096 + 2048);
+	mini_cache_set_capacity(fs, cache_capacity);
+	std::vector<char> buffer(request, 'x');
+
+	unsigned long calls_before = fs->host_io_calls;
+	double start = now_seconds();
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "large.bin", true);
+	for (int i = 0; i < file_size / request; i++) {
+		mini_file_write(fs, fd, request, buffer.data());
+	}
+	mini_file_close(fs, fd);
+	double write_elapsed = now_seconds() - start;
+	double write_calls = (double)(fs->host_io_calls - calls_before) / (file_size / request);
+
+	calls_before = fs->host_io_calls;
+	start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		fd = mini_file_open(fs, "large.bin", false);
+		while (mini_file_read(fs, fd, request, buffer.data()) == request) {
+		}
+		mini_file_close(fs, fd);
+	}
+	double read_elapsed = now_seconds() - start;
+	double read_calls = (double)(fs->host_io_calls - calls_before) / iterations / (file_size / request);
+
+	printf("1 MiB requests on 4 KiB blocks (cache of %d blocks, %d blocks per request):\n", fs->cache.capacity, request / 4096);
+	printf("\twrite: %.1f MiB/s, %.1f syscalls per request\n", file_size / write_elapsed / (1 << 20), write_calls);
+	printf("\tread:  %.1f MiB/s, %.1f syscalls per request\n", (double)file_size * iterations / read_elapsed / (1 << 20), read_calls);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Scans a 16 MiB file on 4 KiB blocks, touching one byte per 64-byte line
+// as a stand-in for a parser, reading it into a buffer with mini_file_read,
+// then in place with mini_file_view.
+static void bench_scan(const int io_mode, const int cache_capacity, const int iterations) {
+	const int request = 64 << 10;
+	const int file_size = 16 << 20;
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 4096, file_size / 4096 + 2048, io_mode);
+	mini_cache_set_capacity(fs, cache_capacity);
+	std::vector<char> buffer(request);
+	for (int i = 0; i < request; i++) buffer[i] = (char)i;
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "scan.bin", true);
+	for (int i = 0; i < file_size / request; i++) {
+		if (mini_file_write(fs, fd, request, buffer.data()) != request) {
+			printf("Cannot write the file to scan.\n");
+			mini_file_close(fs, fd);
+			mini_fat_unmount(fs);
+			remove("bench.fat");
+			return;
+		}
+	}
+	mini_file_close(fs, fd);
+
+	unsigned long read_sum = 0;
+	double start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		fd = mini_file_open(fs, "scan.bin", false);
+		int n;
+		while ((n = mini_file_read(fs, fd, request, buffer.data())) > 0) {
+			for (int j = 0; j < n; j += 64) read_sum += (unsigned char)buffer[j];
+		}
+		mini_file_close(fs, fd);
+	}
+	double read_elapsed = now_seconds() - start;
+
+	unsigned long view_sum = 0;
+	FAT_FILE_VIEW view;
+	start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		fd = mini_file_open(fs, "scan.bin", false);
+		while (mini_file_view(fs, fd, request, &view) && view.size > 0) {
+			for (int j = 0; j < view.size; j += 64) view_sum += (unsigned char)view.data[j];
+			mini_file_release_view(fs, &view);
+		}
+		mini_file_release_view(fs, &view);
+		mini_file_close(fs, fd);
+	}
+	double view_elapsed = now_seconds() - start;
+
+	printf("Scanning a 16 MiB file in 64 KiB requests (%s, cache of %d blocks)%s:\n",
+		fs->io_mode == FAT_IO_MMAP ? "mmap" : "pread", fs->cache.capacity, read_sum == view_sum ? "" : " MISMATCH");
+	printf("\tmini_file_read: %.1f MiB/s\n", (double)file_size * iterations / read_elapsed / (1 << 20));
+	printf("\tmini_file_view: %.1f MiB/s\n", (double)file_size * iterations / view_elapsed / (1 << 20));
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// The block_map scan mini_fat_find_empty_block used before the free-block bitmap.
+static int linear_find_empty_block(const FAT_FILESYSTEM *fat) {
+	for (long unsigned int i = 0; i < fat->block_map.size(); i++) {
+		if (fat->block_map[i] == EMPTY_BLOCK) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Allocates every block of the image, one mini_fat_allocate_new_block at a time.
+static void bench_allocate_all(const int block_count, const bool linear) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 1024, block_count);
+
+	int allocated = 0;
+	double start = now_seconds();
+	if (linear) {
+		int block;
+		while ((block = linear_find_empty_block(fs)) != -1) {
+			mini_fat_set_block_type(fs, block, FILE_DATA_BLOCK);
+			allocated++;
+		}
+	} else {
+		while (mini_fat_find_empty_block(fs) != -1) {
+			mini_fat_allocate_new_block(fs, FILE_DATA_BLOCK);
+			allocated++;
+		}
+	}
+	double elapsed = now_seconds() - start;
+
+	printf("Allocating all %d blocks (%s):\n", block_count, linear ? "linear block_map scan" : "free-block bitmap");
+	printf("\ttotal time:              %.3f s\n", elapsed);
+	printf("\ttime per allocation:     %.1f ns\n", elapsed / allocated * 1e9);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// The strcmp scan over fs->files mini_file_find used before the name index.
+static FAT_FILE * linear_find(const FAT_FILESYSTEM *fs, const char *filename) {
+	for (long unsigned int i = 0; i < fs->files.size(); i++) {
+		if (strcmp(fs->files[i]->name.c_str(), filename) == 0)
+			return fs->files[i];
+	}
+	return NULL;
+}
+
+// Creates file_count empty files, then looks every one of them up.
+static void bench_many_files(const int file_count) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 128, file_count * 3);
+	char name[32];
+
+	double start = now_seconds();
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", i);
+		mini_file_close(fs, mini_file_open(fs, name, true));
+	}
+	double create_elapsed = now_seconds() - start;
+
+	start = now_seconds();
+	int found = 0;
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", (int)((i * 7919L) % file_count));
+		found += mini_file_find(fs, name) != NULL;
+	}
+	double find_elapsed = now_seconds() - start;
+
+	int linear_lookups = 200;
+	start = now_seconds();
+	for (int i = 0; i < linear_lookups; i++) {
+		sprintf(name, "file%d.txt", (int)((i * 7919L) % file_count));
+		found += linear_find(fs, name) != NULL;
+	}
+	double linear_elapsed = now_seconds() - start;
+
+	printf("%d files (%d found):\n", file_count, found);
+	printf("\tcreate (open+close) per file: %.1f ns\n", create_elapsed / file_count * 1e9);
+	printf("\tmini_file_find per lookup:    %.1f ns\n", find_elapsed / file_count * 1e9);
+	printf("\tlinear scan per lookup:       %.1f ns\n", linear_elapsed / linear_lookups * 1e9);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Puts file_count files in one directory three levels down, then looks them
+// up by path and lists the directory.
+static void bench_directories(const int file_count) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 128, file_count * 3);
+	mini_dir_create(fs, "a");
+	mini_dir_create(fs, "a/b");
+	mini_dir_create(fs, "a/b/c");
+	char name[48];
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "a/b/c/file%d.txt", i);
+		mini_file_close(fs, mini_file_open(fs, name, true));
+	}
+
+	double start = now_seconds();
+	int found = 0;
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "/a/b/c/file%d.txt", (int)((i * 7919L) % file_count));
+		found += mini_file_find(fs, name) != NULL;
+	}
+	double find_elapsed = now_seconds() - start;
+
+	start = now_seconds();
+	int listed = 0;
+	FAT_DIR * dir = mini_dir_open(fs, "a/b/c");
+	FAT_DIR_ENTRY entry;
+	while (mini_dir_read(fs, dir, &entry)) {
+		listed++;
+	}
+	mini_dir_close(fs, dir);
+	double list_elapsed = now_seconds() - start;
+
+	printf("%d files in a/b/c (%d found, %d listed):\n", file_count, found, listed);
+	printf("\tmini_file_find per lookup:    %.1f ns\n", find_elapsed / file_count * 1e9);
+	printf("\tmini_dir_read per entry:      %.1f ns\n", list_elapsed / file_count * 1e9);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Creates, saves and reloads a large image holding a few files.
+static void bench_large_image(const int block_size, const int block_count) {
+	double start = now_seconds();
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", block_size, block_count);
+	double create_elapsed = now_seconds() - start;
+
+	char name[32];
+	for (int i = 0; i < 100; i++) {
+		sprintf(name, "file%d.txt", i);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+	}
+
+	start = now_seconds();
+	mini_fat_save(fs);
+	double save_elapsed = now_seconds() - start;
+	int metadata_blocks = fs->metadata_blocks;
+	mini_fat_unmount(fs);
+
+	start = now_seconds();
+	fs = mini_fat_load("bench.fat");
+	double load_elapsed = now_seconds() - start;
+
+	printf("%.1f GiB image, %d blocks of %d bytes (%d metadata blocks, %d files):\n",
+		(double)block_size * block_count / (1 << 30), block_count, block_size, metadata_blocks, (int)fs->files.size());
+	printf("\tmini_fat_create: %.3f s\n", create_elapsed);
+	printf("\tmini_fat_save:   %.3f s\n", save_elapsed);
+	printf("\tmini_fat_load:   %.3f s\n", load_elapsed);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Checkpoints a filesystem with many files after each small change.
+static void bench_incremental_sync(const int file_count, const int iterations) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 1024, file_count * 3);
+	char name[32];
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", i);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+	}
+
+	unsigned long calls_before = fs->host_io_calls;
+	double start = now_seconds();
+	mini_fat_sync(fs);
+	double full_elapsed = now_seconds() - start;
+	unsigned long full_calls = fs->host_io_calls - calls_before;
+
+	calls_before = fs->host_io_calls;
+	start = now_seconds();
+	for (int i = 0; i < iterations; i++) {
+		sprintf(name, "file%d.txt", (int)((i * 7919L) % file_count));
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		mini_file_seek(fs, fd, mini_file_size(fs, name), true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+		mini_fat_sync(fs);
+	}
+	double elapsed = now_seconds() - start;
+
+	printf("mini_fat_sync with %d files:\n", file_count);
+	printf("\tfirst sync (everything dirty): %.3f ms, %lu pwrite\n", full_elapsed * 1e3, full_calls);
+	printf("\tsync after a 45-byte append:   %.3f ms, %.1f pwrite\n", elapsed / iterations * 1e3,
+		(double)(fs->host_io_calls - calls_before) / iterations);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Appends a line to one of 64 files per operation and makes it durable with
+// mini_fat_commit every group operations (group 1: every operation).
+static void bench_commit(const int group, const int operations) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 1024, operations / 16 + 4096);
+	char name[32];
+	unsigned long commits_before = fs->journal_commits;
+	unsigned long checkpoints_before = fs->journal_checkpoints;
+	double start = now_seconds();
+	for (int i = 0; i < operations; i++) {
+		sprintf(name, "log%d.txt", i % 64);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		mini_file_seek(fs, fd, fd->file->size, true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+		if ((i + 1) % group == 0) {
+			mini_fat_commit(fs);
+		}
+	}
+	mini_fat_commit(fs);
+	double elapsed = now_seconds() - start;
+
+	unsigned long commits = fs->journal_commits - commits_before;
+	printf("%d appends, mini_fat_commit every %d (%d journal blocks):\n", operations, group, fs->journal_blocks);
+	printf("\tdurable appends per second: %.0f\n", operations / elapsed);
+	printf("\tcommits per second:         %.0f\n", commits / elapsed);
+	printf("\tcommits, checkpoints:       %lu, %lu\n", commits, fs->journal_checkpoints - checkpoints_before);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Each thread reads a shared file through its own handle, then appends to
+// its own file, in 4 KiB requests; from 1 to max_threads threads.
+static void bench_threads(const int max_threads) {
+	const int request = 4096;
+	const int shared_size = 16 << 20;
+	const int own_size = 4 << 20;
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 4096, shared_size / 4096 + max_threads * (own_size / 4096 + 2) + 1024);
+	std::vector<char> data(request, 'x');
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "shared.bin", true);
+	for (int written = 0; written < shared_size; written += request) {
+		mini_file_write(fs, fd, request, data.data());
+	}
+	mini_file_close(fs, fd);
+
+	printf("Threads on one filesystem (%u hardware threads), 4 KiB requests:\n", std::thread::hardware_concurrency());
+	printf("\tthreads  read shared file  append own file\n");
+	for (int thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+		std::vector<std::thread> threads;
+		double start = now_seconds();
+		for (int t = 0; t < thread_count; t++) {
+			threads.push_back(std::thread([fs, request]() {
+				std::vector<char> buffer(request);
+				FAT_OPEN_FILE * reader = mini_file_open(fs, "shared.bin", false);
+				while (mini_file_read(fs, reader, request, buffer.data()) > 0) {
+				}
+				mini_file_close(fs, reader);
+			}));
+		}
+		for (int t = 0; t < thread_count; t++) {
+			threads[t].join();
+		}
+		double read_elapsed = now_seconds() - start;
+
+		threads.clear();
+		start = now_seconds();
+		for (int t = 0; t < thread_count; t++) {
+			threads.push_back(std::thread([fs, t, request, own_size]() {
+				std::vector<char> buffer(request, 'y');
+				char name[32];
+				sprintf(name, "own%d.bin", t);
+				FAT_OPEN_FILE * writer = mini_file_open(fs, name, true);
+				for (int written = 0; written < own_size; written += request) {
+					mini_file_write(fs, writer, request, buffer.data());
+				}
+				mini_file_close(fs, writer);
+			}));
+		}
+		for (int t = 0; t < thread_count; t++) {
+			threads[t].join();
+		}
+		double write_elapsed = now_seconds() - start;
+		for (int t = 0; t < thread_count; t++) {
+			char name[32];
+			sprintf(name, "own%d.bin", t);
+			mini_file_delete(fs, name);
+		}
+		mini_fat_sync(fs);
+
+		printf("\t%7d  %10.1f MiB/s  %10.1f MiB/s\n", thread_count,
+			(double)thread_count * shared_size / read_elapsed / (1 << 20), (double)thread_count * own_size / write_elapsed / (1 << 20));
+	}
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Random 4 KiB block reads with up to queue_depth of them in flight, on an
+// image in tmpfs so the disk does not dominate.
+static void bench_async_reads(const int reads) {
+	const int request = 4096;
+	const int file_size = 64 << 20;
+	//mini_fat_create exits when it cannot create the image
+	const char * image = access("/dev/shm", W_OK) == 0 ? "/dev/shm/minifs_bench.fat" : "bench.fat";
+	FAT_FILESYSTEM * fs = mini_fat_create(image, request, file_size / request + 1024);
+	mini_cache_set_capacity(fs, 0);
+	std::vector<char> data(1 << 20, 'x');
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "random.bin", true);
+	for (int written = 0; written < file_size; written += data.size()) {
+		mini_file_write(fs, fd, data.size(), data.data());
+	}
+	mini_file_close(fs, fd);
+	std::vector<int> positions(reads);
+	for (int i = 0; i < reads; i++) {
+		positions[i] = (rand() % (file_size / request)) * request;
+	}
+
+	printf("Random 4 KiB reads, %s:\n", image);
+	FAT_OPEN_FILE * reader = mini_file_open(fs, "random.bin", false);
+	std::vector<char> buffer(request);
+	unsigned long calls = fs->host_io_calls;
+	double start = now_seconds();
+	for (int i = 0; i < reads; i++) {
+		mini_file_seek(fs, reader, positions[i], true);
+		mini_file_read(fs, reader, request, buffer.data());
+	}
+	double elapsed = now_seconds() - start;
+	printf("	mini_file_read            %9.0f reads/s  %.2f host calls/read\n", reads / elapsed,
+		(double)(fs->host_io_calls - calls) / reads);
+
+	const int engines[] = { FAT_ASYNC_URING, FAT_ASYNC_THREADS };
+	const int depths[] = { 1, 8, 32 };
+	for (int e = 0; e < 2; e++) {
+		for (int d = 0; d < 3; d++) {
+			FAT_ASYNC * async = mini_async_open(fs, depths[d], engines[e]);
+			if (async->engine != engines[e]) {
+				printf("	io_uring not available\n");
+				mini_async_close(async);
+				break;
+			}
+			//One buffer and token per slot, refilled as soon as it completes
+			std::vector<char> buffers((size_t)depths[d] * request);
+			std::vector<int> tokens(depths[d]);
+			calls = fs->host_io_calls;
+			start = now_seconds();
+			for (int i = 0; i < reads; i++) {
+				int slot = i % depths[d];
+				if (i >= depths[d]) {
+					mini_async_wait(async, tokens[slot]);
+				}
+				mini_file_seek(fs, reader, positions[i], true);
+				tokens[slot] = mini_file_read_async(async, reader, request, &buffers[(size_t)slot * request]);
+			}
+			for (int i = reads - depths[d]; i < reads; i++) {
+				if (i >= 0) mini_async_wait(async, tokens[i % depths[d]]);
+			}
+			elapsed = now_seconds() - start;
+			printf("	%-8s queue depth %2d  %9.0f reads/s  %.2f host calls/read\n", e == 0 ? "io_uring" : "threads",
+				depths[d], reads / elapsed, (double)(fs->host_io_calls - calls) / reads);
+			mini_async_close(async);
+		}
+	}
+	mini_file_close(fs, reader);
+	mini_fat_unmount(fs);
+	remove(image);
+}
+
+// Mounts a saved filesystem with many files; inodes are read lazily,
+// so the cost of reading them all is reported separately.
+static void bench_mount(const int file_count) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 1024, file_count * 3);
+	char name[32];
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", i);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+	}
+	mini_fat_save(fs);
+	mini_fat_unmount(fs);
+
+	double start = now_seconds();
+	fs = mini_fat_load("bench.fat");
+	double mount_elapsed = now_seconds() - start;
+	unsigned long mount_calls = fs->host_io_calls;
+
+	sprintf(name, "file%d.txt", file_count / 2);
+	start = now_seconds();
+	FAT_OPEN_FILE * fd = mini_file_open(fs, name, false);
+	double open_elapsed = now_seconds() - start;
+	mini_file_close(fs, fd);
+
+	start = now_seconds();
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", i);
+		mini_file_size(fs, name);
+	}
+	double all_elapsed = now_seconds() - start;
+
+	printf("mini_fat_load with %d files:\n", file_count);
+	printf("\tmount:                   %.3f ms, %lu pread\n", mount_elapsed * 1e3, mount_calls);
+	printf("\tfirst mini_file_open:    %.3f ms\n", open_elapsed * 1e3);
+	printf("\tloading every entry:     %.3f ms\n", all_elapsed * 1e3);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+// Writes many 45-byte files, then reads each back after a mount with the
+// cache off: their data is inline in the inode, 32 of which share a block,
+// so reading a file takes one pread.
+static void bench_small_files(const int file_count) {
+	FAT_FILESYSTEM * fs = mini_fat_create("bench.fat", 4096, file_count * 3);
+	char name[32];
+	double start = now_seconds();
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "small%d.txt", i);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+	}
+	mini_fat_save(fs);
+	double write_elapsed = now_seconds() - start;
+	int used = 0;
+	for (int i = 0; i < fs->block_count; i++) {
+		if (fs->block_map[i] == INODE_TABLE_BLOCK || fs->block_map[i] == FILE_DATA_BLOCK) used++;
+	}
+	mini_fat_unmount(fs);
+
+	fs = mini_fat_load("bench.fat");
+	mini_cache_set_capacity(fs, 0);
+	char buffer[64];
+	unsigned long calls_before = fs->host_io_calls;
+	start = now_seconds();
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "small%d.txt", i);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, false);
+		mini_file_read(fs, fd, sizeof(buffer), buffer);
+		mini_file_close(fs, fd);
+	}
+	double read_elapsed = now_seconds() - start;
+
+	printf("%d files of 45 bytes on 4 KiB blocks:\n", file_count);
+	printf("\tcreate+write per file:   %.2f us\n", write_elapsed / file_count * 1e6);
+	printf("\tblocks per file:         %.2f\n", (double)used / file_count);
+	printf("\topen+read per file:      %.2f us, %.2f pread (no cache)\n", read_elapsed / file_count * 1e6,
+		(double)(fs->host_io_calls - calls_before) / file_count);
+	mini_fat_unmount(fs);
+	remove("bench.fat");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "--json") == 0) {
+		bench_suite_json(stdout);
+		return 0;
+	}
+	bench_write_to_file1(20000, 0);
+	bench_write_to_file1(20000, DEFAULT_CACHE_CAPACITY);
+	bench_read_file(FAT_IO_PREAD, 500);
+	bench_read_file(FAT_IO_PREAD, 500, DEFAULT_CACHE_CAPACITY);
+	bench_read_file(FAT_IO_MMAP, 500);
+	bench_small_appends(0, 100000);
+	bench_small_appends(DEFAULT_CACHE_CAPACITY, 100000);
+	bench_large_io(0, 20);
+	bench_large_io(DEFAULT_CACHE_CAPACITY, 20);
+	bench_scan(FAT_IO_PREAD, 4096 + 64, 20);
+	bench_scan(FAT_IO_MMAP, 0, 20);
+	bench_allocate_all(1 << 14, true);
+	bench_allocate_all(1 << 14, false);
+	bench_allocate_all(1 << 20, false);
+	bench_many_files(100000);
+	bench_directories(100000);
+	bench_large_image(4096, 1 << 20);
+	bench_incremental_sync(5000, 200);
+	bench_commit(1, 1000);
+	bench_commit(64, 64000);
+	bench_threads(8);
+	bench_async_reads(50000);
+	bench_mount(10000);
+	bench_mount(100000);
+	bench_small_files(20000);
+	return 0;
+}
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "fat.h"
+#include "fat_file.h"
+#include "bench_suite.h"
+
+const int SUITE_BLOCK_SIZES[] = { 512, 1024, 4096 };
+const int SUITE_IO_SIZES[] = { 64, 4096, 65536 };
+const int SUITE_FILE_COUNTS[] = { 100, 1000, 10000 };
+const int SUITE_FILE_SIZE = 4 << 20; // Bytes written and read by the I/O runs.
+const int SUITE_RANDOM_OPS = 2000;
+const int SUITE_SEEKS = 20000;
+const char * SUITE_IMAGE = "bench.fat";
+
+// Timings of one API in one configuration.
+typedef struct t_BENCH_RESULT {
+	const char * op;
+	int block_size;
+	int file_count;
+	int io_size; // 0 when the API moves no data.
+	std::vector<double> latencies; // Seconds, one per call.
+	long bytes;
+	double seconds; // Whole run, including the loop around the calls.
+} BENCH_RESULT;
+
+static double suite_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void suite_begin(BENCH_RESULT *result, const char *op, const int block_size, const int file_count, const int io_size) {
+	result->op = op;
+	result->block_size = block_size;
+	result->file_count = file_count;
+	result->io_size = io_size;
+	result->latencies.clear();
+	result->bytes = 0;
+	result->seconds = suite_now();
+}
+
+/**
+ * Close the run started by suite_begin and write it as one element of the
+ * "results" array.
+ */
+static void suite_emit(FILE *out, BENCH_RESULT *result, bool *first) {
+	result->seconds = suite_now() - result->seconds;
+	std::vector<double> &latencies = result->latencies;
+	std::sort(latencies.begin(), latencies.end());
+	double total = 0;
+	for (long unsigned int i = 0; i < latencies.size(); i++) {
+		total += latencies[i];
+	}
+	long unsigned int count = latencies.size();
+	double mean = count > 0 ? total / count : 0;
+	double p50 = count > 0 ? latencies[count / 2] : 0;
+	double p99 = count > 0 ? latencies[std::min(count - 1, count * 99 / 100)] : 0;
+	double max = count > 0 ? latencies[count - 1] : 0;
+
+	fprintf(out, "%s\n    {\"op\": \"%s\", \"block_size\": %d, \"file_count\": %d, \"io_size\": %d, \"ops\": %lu, \"bytes\": %ld,",
+		*first ? "" : ",", result->op, result->block_size, result->file_count, result->io_size, count, result->bytes);
+	fprintf(out, " \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mib_per_sec\": %.2f,",
+		result->seconds, count / result->seconds, result->bytes / result->seconds / (1 << 20));
+	fprintf(out, " \"latency_ns\": {\"mean\": %.0f, \"p50\": %.0f, \"p99\": %.0f, \"max\": %.0f}}",
+		mean * 1e9, p50 * 1e9, p99 * 1e9, max * 1e9);
+	*first = false;
+}
+
+/**
+ * Sequential and random reads and writes of io_size bytes on one file of
+ * SUITE_FILE_SIZE bytes, and random seeks.
+ */
+static void suite_io(FILE *out, bool *first, const int block_size, const int io_size) {
+	FAT_FILESYSTEM * fs = mini_fat_create(SUITE_IMAGE, block_size, SUITE_FILE_SIZE / block_size + 2048);
+	std::vector<char> buffer(io_size, 'x');
+	BENCH_RESULT result;
+	int chunks = SUITE_FILE_SIZE / io_size;
+
+	suite_begin(&result, "seq_write", block_size, 1, io_size);
+	FAT_OPEN_FILE * writer = mini_file_open(fs, "suite.bin", true);
+	for (int i = 0; i < chunks; i++) {
+		double start = suite_now();
+		result.bytes += mini_file_write(fs, writer, io_size, buffer.data());
+		result.latencies.push_back(suite_now() - start);
+	}
+	mini_file_flush(fs, writer);
+	suite_emit(out, &result, first);
+
+	suite_begin(&result, "seq_read", block_size, 1, io_size);
+	FAT_OPEN_FILE * reader = mini_file_open(fs, "suite.bin", false);
+	for (int i = 0; i < chunks; i++) {
+		double start = suite_now();
+		result.bytes += mini_file_read(fs, reader, io_size, buffer.data());
+		result.latencies.push_back(suite_now() - start);
+	}
+	suite_emit(out, &result, first);
+
+	//Random positions are io_size aligned, as a record store would use them
+	std::vector<int> positions(SUITE_RANDOM_OPS);
+	for (int i = 0; i < SUITE_RANDOM_OPS; i++) {
+		positions[i] = (rand() % chunks) * io_size;
+	}
+	suite_begin(&result, "random_read", block_size, 1, io_size);
+	for (int i = 0; i < SUITE_RANDOM_OPS; i++) {
+		double start = suite_now();
+		mini_file_seek(fs, reader, positions[i], true);
+		result.bytes += mini_file_read(fs, reader, io_size, buffer.data());
+		result.latencies.push_back(suite_now() - start);
+	}
+	suite_emit(out, &result, first);
+
+	suite_begin(&result, "random_write", block_size, 1, io_size);
+	for (int i = 0; i < SUITE_RANDOM_OPS; i++) {
+		double start = suite_now();
+		mini_file_seek(fs, writer, positions[i], true);
+		result.bytes += mini_file_write(fs, writer, io_size, buffer.data());
+		result.latencies.push_back(suite_now() - start);
+	}
+	mini_file_flush(fs, writer);
+	suite_emit(out, &result, first);
+
+	if (io_size == SUITE_IO_SIZES[0]) {
+		suite_begin(&result, "seek", block_size, 1, 0);
+		for (int i = 0; i < SUITE_SEEKS; i++) {
+			int offset = rand() % SUITE_FILE_SIZE;
+			double start = suite_now();
+			mini_file_seek(fs, reader, offset, true);
+			result.latencies.push_back(suite_now() - start);
+		}
+		suite_emit(out, &result, first);
+	}
+
+	mini_file_close(fs, reader);
+	mini_file_close(fs, writer);
+	mini_fat_unmount(fs);
+	remove(SUITE_IMAGE);
+}
+
+/**
+ * Creating, opening, closing and deleting file_count small files, and
+ * saving and loading the filesystem holding them.
+ */
+static void suite_files(FILE *out, bool *first, const int block_size, const int file_count) {
+	FAT_FILESYSTEM * fs = mini_fat_create(SUITE_IMAGE, block_size, file_count * 3 + 2048);
+	const char * data = "The quick brown fox jumps over the lazy dog.\n";
+	char name[32];
+	BENCH_RESULT result;
+
+	suite_begin(&result, "create", block_size, file_count, 0);
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", i);
+		double start = suite_now();
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+		result.latencies.push_back(suite_now() - start);
+		mini_file_write(fs, fd, strlen(data), data);
+		mini_file_close(fs, fd);
+	}
+	suite_emit(out, &result, first);
+
+	suite_begin(&result, "save", block_size, file_count, 0);
+	double start = suite_now();
+	mini_fat_save(fs);
+	result.latencies.push_back(suite_now() - start);
+	suite_emit(out, &result, first);
+	mini_fat_unmount(fs);
+
+	suite_begin(&result, "load", block_size, file_count, 0);
+	start = suite_now();
+	fs = mini_fat_load(SUITE_IMAGE);
+	result.latencies.push_back(suite_now() - start);
+	suite_emit(out, &result, first);
+
+	//Open and close are timed apart, on files picked at random
+	std::vector<FAT_OPEN_FILE*> handles;
+	suite_begin(&result, "open", block_size, file_count, 0);
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", rand() % file_count);
+		start = suite_now();
+		handles.push_back(mini_file_open(fs, name, false));
+		result.latencies.push_back(suite_now() - start);
+	}
+	suite_emit(out, &result, first);
+
+	suite_begin(&result, "close", block_size, file_count, 0);
+	for (long unsigned int i = 0; i < handles.size(); i++) {
+		start = suite_now();
+		mini_file_close(fs, handles[i]);
+		result.latencies.push_back(suite_now() - start);
+	}
+	suite_emit(out, &result, first);
+
+	suite_begin(&result, "delete", block_size, file_count, 0);
+	for (int i = 0; i < file_count; i++) {
+		sprintf(name, "file%d.txt", i);
+		start = suite_now();
+		mini_file_delete(fs, name);
+		result.latencies.push_back(suite_now() - start);
+	}
+	suite_emit(out, &result, first);
+
+	mini_fat_unmount(fs);
+	remove(SUITE_IMAGE);
+}
+
+/**
+ * Run every configuration of the sweep and write the results to out:
+ * {"suite": ..., "version": ..., "results": [{"op", "block_size",
+ * "file_count", "io_size", "ops", "bytes", "seconds", "ops_per_sec",
+ * "mib_per_sec", "latency_ns": {"mean", "p50", "p99", "max"}}, ...]}
+ */
+void bench_suite_json(FILE *out) {
+	srand(304);
+	bool first = true;
+	fprintf(out, "{\n  \"suite\": \"mini_filesystem\",\n  \"version\": %d,\n  \"results\": [", BENCH_SUITE_VERSION);
+	for (int b = 0; b < 3; b++) {
+		for (int s = 0; s < 3; s++) {
+			suite_io(out, &first, SUITE_BLOCK_SIZES[b], SUITE_IO_SIZES[s]);
+		}
+		for (int f = 0; f < 3; f++) {
+			suite_files(out, &first, SUITE_BLOCK_SIZES[b], SUITE_FILE_COUNTS[f]);
+		}
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,13 @@
+#ifndef BENCH_SUITE_H
+#define BENCH_SUITE_H
+
+#include <cstdio>
+
+// Sweep of the public file APIs over block sizes, file counts and I/O sizes,
+// written as JSON for tracking regressions. Run './minifs_bench --json'.
+
+const int BENCH_SUITE_VERSION = 1; // Bumped when the JSON layout changes.
+
+void bench_suite_json(FILE *out);
+
+#endif // BENCH_SUITE_H
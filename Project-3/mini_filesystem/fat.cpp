@@ -3,13 +3,142 @@
 #include <stddef.h>
 #include <cassert>
 #include <list>
+#include <map>
 #include <cstdlib>
+#include <algorithm>
 #include "fat.h"
 #include "fat_file.h"
+#include "fat_format.h"
+#include "fat_journal.h"
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 
+/**
+ * Write directly to the virtual disk file, bypassing the block cache.
+ * @param  position byte offset in the virtual disk
+ * @return          written byte count
+ */
+int mini_fat_disk_write(FAT_FILESYSTEM *fs, const off_t position, const int size, const void * buffer) {
+	int written = 0;
+	while (written < size) {
+		ssize_t n = pwrite(fs->fd, (const char*)buffer + written, size - written, position + written);
+		fs->host_io_calls++;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("Cannot write block to file");
+			return written;
+		}
+		written += n;
+	}
+	mini_stats_count(&fs->stats, STAT_BYTES_WRITTEN, written);
+	return written;
+}
+
+/**
+ * Read directly from the virtual disk file, bypassing the block cache.
+ * @param  position byte offset in the virtual disk
+ * @return          read byte count
+ */
+int mini_fat_disk_read(FAT_FILESYSTEM *fs, const off_t position, const int size, void * buffer) {
+	int read = 0;
+	while (read < size) {
+		ssize_t n = pread(fs->fd, (char*)buffer + read, size - read, position + read);
+		fs->host_io_calls++;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("Cannot read block from file");
+			return read;
+		}
+		if (n == 0) break; // Past the end of the virtual disk.
+		read += n;
+	}
+	mini_stats_count(&fs->stats, STAT_BYTES_READ, read);
+	return read;
+}
+
+/**
+ * Vectored write directly to the virtual disk file: the count buffers of iov
+ * go to consecutive bytes starting at position. iov is consumed (advanced
+ * past what was written).
+ * @return written byte count
+ */
+int mini_fat_disk_writev(FAT_FILESYSTEM *fs, const off_t position, struct iovec *iov, int count) {
+	int written = 0;
+	while (count > 0) {
+		ssize_t n = pwritev(fs->fd, iov, count < IOV_MAX ? count : IOV_MAX, position + written);
+		fs->host_io_calls++;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("Cannot write blocks to file");
+			return written;
+		}
+		written += n;
+		mini_stats_count(&fs->stats, STAT_BYTES_WRITTEN, n);
+		//Skip the buffers done, resume inside a partly written one
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return written;
+}
+
+/**
+ * Vectored read directly from the virtual disk file, see mini_fat_disk_writev.
+ * @return read byte count
+ */
+int mini_fat_disk_readv(FAT_FILESYSTEM *fs, const off_t position, struct iovec *iov, int count) {
+	int read = 0;
+	while (count > 0) {
+		ssize_t n = preadv(fs->fd, iov, count < IOV_MAX ? count : IOV_MAX, position + read);
+		fs->host_io_calls++;
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("Cannot read blocks from file");
+			return read;
+		}
+		if (n == 0) break; // Past the end of the virtual disk.
+		read += n;
+		mini_stats_count(&fs->stats, STAT_BYTES_READ, n);
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return read;
+}
+
+/**
+ * Wait until everything written to the virtual disk file is on stable storage
+ * (fdatasync; it also covers pages written through the mapping).
+ * @return true on success
+ */
+bool mini_fat_disk_sync(FAT_FILESYSTEM *fs) {
+	fs->host_io_calls++;
+	if (fdatasync(fs->fd) != 0) {
+		perror("Cannot sync the virtual disk");
+		return false;
+	}
+	return true;
+}
+
 /**
  * Write inside one block in the filesystem.
  * @param  fs           filesystem
@@ -23,23 +152,15 @@ int mini_fat_write_in_block(FAT_FILESYSTEM *fs, const int block_id, const int bl
 	assert(block_offset >= 0);
 	assert(block_offset < fs->block_size);
 	assert(size + block_offset <= fs->block_size);
+	FAT_STATS_TIMER timer(&fs->stats, STAT_WRITE_IN_BLOCK);
 
-	int written = 0;
-
-	//Open the file system file
-	FILE* fat_fd = fopen(fs->filename, "rb+");
-	if (fat_fd == NULL) {
-		perror("Cannot write block to file");
-		return false;
+	//Write through the mapping, the block cache or the mounted descriptor
+	if (fs->mapping != NULL) {
+		memcpy(fs->mapping + (size_t)block_id * fs->block_size + block_offset, buffer, size);
+		mini_stats_count(&fs->stats, STAT_BYTES_WRITTEN, size);
+		return size;
 	}
-	
-	//Determine seek position	
-	int position = (block_id * fs->block_size) + block_offset;
-	fseek(fat_fd, position, SEEK_SET);	
-        fwrite(buffer, size, 1, fat_fd);
-        written = size;
-	fclose(fat_fd);
-	return written;
+	return mini_cache_write(fs, block_id, block_offset, size, buffer);
 }
 
 /**
@@ -55,45 +176,242 @@ int mini_fat_read_in_block(FAT_FILESYSTEM *fs, const int block_id, const int blo
 	assert(block_offset >= 0);
 	assert(block_offset < fs->block_size);
 	assert(size + block_offset <= fs->block_size);
+	FAT_STATS_TIMER timer(&fs->stats, STAT_READ_IN_BLOCK);
 
-	int read = 0;
+	//Read through the mapping, the block cache or the mounted descriptor
+	if (fs->mapping != NULL) {
+		memcpy(buffer, fs->mapping + (size_t)block_id * fs->block_size + block_offset, size);
+		mini_stats_count(&fs->stats, STAT_BYTES_READ, size);
+		return size;
+	}
+	return mini_cache_read(fs, block_id, block_offset, size, buffer);
+}
 
-	//Open the file system file
-	FILE * fat_fd = fopen(fs->filename, "rb");
-	if (fat_fd == NULL) {
-		perror("Cannot read block to file");
-		return false;
-	}	
-	//Determine seek position
-	int position = (block_id * fs->block_size) + block_offset;
-	fseek(fat_fd, position, SEEK_SET);
-        fread(buffer,size,1, fat_fd);
-        read = size;
-	fclose(fat_fd);
+/**
+ * Whether a segment must go through the block cache, see mini_cache_wants.
+ * Other segments go straight to the disk with preadv/pwritev.
+ */
+bool mini_fat_segment_cached(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segment) {
+	return mini_cache_wants(fs, segment->block_id, segment->size < fs->block_size);
+}
+
+off_t mini_fat_segment_position(const FAT_FILESYSTEM *fs, const FAT_SEGMENT *segment) {
+	return (off_t)segment->block_id * fs->block_size + segment->block_offset;
+}
+
+/**
+ * Collect the run of segments starting at first that are contiguous on the
+ * disk and bypass the cache into iov, merging buffers that are contiguous in
+ * memory too. A run holds at most MAX_SEGMENT_RUN_BYTES.
+ * @return number of segments in the run
+ */
+int mini_fat_segment_run(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segments, const int first, const int count,
+	std::vector<struct iovec> &iov, int *size) {
+	iov.clear();
+	*size = 0;
+	int i = first;
+	while (i < count && !mini_fat_segment_cached(fs, &segments[i])) {
+		if (i > first && *size > MAX_SEGMENT_RUN_BYTES - segments[i].size) {
+			break;
+		}
+		if (i > first) {
+			const FAT_SEGMENT * previous = &segments[i - 1];
+			if (mini_fat_segment_position(fs, &segments[i]) != mini_fat_segment_position(fs, previous) + previous->size) {
+				break;
+			}
+		}
+		if (!iov.empty() && (char*)iov.back().iov_base + iov.back().iov_len == segments[i].buffer) {
+			iov.back().iov_len += segments[i].size;
+		} else {
+			struct iovec buffer = { segments[i].buffer, (size_t)segments[i].size };
+			iov.push_back(buffer);
+		}
+		*size += segments[i].size;
+		i++;
+	}
+	return i - first;
+}
+
+/**
+ * Read a list of block segments (e.g. every block a file read touches).
+ * Segments that are adjacent on the disk and not served by the block cache
+ * are read with one preadv, instead of one read per block.
+ * @return read byte count, short if a read failed
+ */
+long mini_fat_read_segments(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segments, const int count) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_READ_SEGMENTS);
+	long read = 0;
+	std::vector<struct iovec> iov;
+	int i = 0;
+	while (i < count) {
+		const FAT_SEGMENT * segment = &segments[i];
+		if (fs->mapping != NULL || mini_fat_segment_cached(fs, segment)) {
+			int n = mini_fat_read_in_block(fs, segment->block_id, segment->block_offset, segment->size, segment->buffer);
+			read += n;
+			if (n != segment->size) return read;
+			i++;
+			continue;
+		}
+		int size;
+		int run = mini_fat_segment_run(fs, segments, i, count, iov, &size);
+		int n = mini_fat_disk_readv(fs, mini_fat_segment_position(fs, segment), iov.data(), iov.size());
+		read += n;
+		if (n != size) return read;
+		i += run;
+	}
 	return read;
+}
 
+/**
+ * Write a list of block segments, see mini_fat_read_segments.
+ * @return written byte count, short if a write failed
+ */
+long mini_fat_write_segments(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segments, const int count) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_WRITE_SEGMENTS);
+	long written = 0;
+	std::vector<struct iovec> iov;
+	int i = 0;
+	while (i < count) {
+		const FAT_SEGMENT * segment = &segments[i];
+		if (fs->mapping != NULL || mini_fat_segment_cached(fs, segment)) {
+			int n = mini_fat_write_in_block(fs, segment->block_id, segment->block_offset, segment->size, segment->buffer);
+			written += n;
+			if (n != segment->size) return written;
+			i++;
+			continue;
+		}
+		int size;
+		int run = mini_fat_segment_run(fs, segments, i, count, iov, &size);
+		int n = mini_fat_disk_writev(fs, mini_fat_segment_position(fs, segment), iov.data(), iov.size());
+		written += n;
+		if (n != size) return written;
+		i += run;
+	}
+	return written;
 }
 
+/**
+ * Read count whole consecutive blocks starting at first_block into buffer.
+ * Cached blocks come from the block cache, the others with as few reads as
+ * possible.
+ * @return read byte count
+ */
+long mini_fat_read_blocks(FAT_FILESYSTEM *fs, const int first_block, const int count, void * buffer) {
+	std::vector<FAT_SEGMENT> segments(count);
+	for (int i = 0; i < count; i++) {
+		segments[i].block_id = first_block + i;
+		segments[i].block_offset = 0;
+		segments[i].size = fs->block_size;
+		segments[i].buffer = (char*)buffer + (size_t)i * fs->block_size;
+	}
+	return mini_fat_read_segments(fs, segments.data(), count);
+}
 
 /**
- * Find the first empty block in filesystem.
- * @return -1 on failure, index of block on success
+ * Write count whole consecutive blocks starting at first_block from buffer.
+ * Cached blocks are updated in the block cache, the others written with as
+ * few writes as possible.
+ * @return written byte count
  */
-int mini_fat_find_empty_block(const FAT_FILESYSTEM *fat) {
-	// TODO: find an empty block in fat and return its index.	
-	if(!fat->block_map.empty()) {
-		for(long unsigned int i = 0; i < fat->block_map.size(); i++) {
-			if(fat->block_map[i] == EMPTY_BLOCK) {
-				return i;
+long mini_fat_write_blocks(FAT_FILESYSTEM *fs, const int first_block, const int count, const void * buffer) {
+	std::vector<FAT_SEGMENT> segments(count);
+	for (int i = 0; i < count; i++) {
+		segments[i].block_id = first_block + i;
+		segments[i].block_offset = 0;
+		segments[i].size = fs->block_size;
+		segments[i].buffer = (char*)buffer + (size_t)i * fs->block_size;
+	}
+	return mini_fat_write_segments(fs, segments.data(), count);
+}
+
+/**
+ * Queue a block of the metadata region (superblock and block map) to be
+ * written by the next mini_fat_sync.
+ */
+void mini_fat_mark_metadata_dirty(FAT_FILESYSTEM *fs, const int metadata_block) {
+	if (fs->metadata_dirty[metadata_block]) return;
+	fs->metadata_dirty[metadata_block] = true;
+	fs->dirty_metadata.push_back(metadata_block);
+}
+
+/**
+ * Set the type of a block in block_map and keep the free-block bitmap in sync.
+ * Every change to block_map must go through here.
+ * With a journal, a freed block stays out of the bitmap until the record
+ * freeing it is durable (see mini_journal_release_freed), so a crash cannot
+ * leave it both reused and owned by the replayed file.
+ */
+void mini_fat_set_block_type(FAT_FILESYSTEM *fs, const int block_id, const unsigned char block_type) {
+	assert(block_id >= 0 && block_id < fs->block_count);
+	unsigned char old_type = fs->block_map[block_id];
+	if (old_type != block_type) {
+		mini_fat_mark_metadata_dirty(fs, (SUPERBLOCK_SIZE + block_id / 2) / fs->block_size);
+		//Blocks typed while creating, loading or replaying are not counted
+		if (!fs->journal_suspended && (old_type == EMPTY_BLOCK || block_type == EMPTY_BLOCK)) {
+			mini_stats_count(&fs->stats, block_type == EMPTY_BLOCK ? STAT_BLOCKS_FREED : STAT_BLOCKS_ALLOCATED, 1);
+		}
+	}
+	fs->block_map[block_id] = block_type;
+	uint64_t bit = 1ULL << (block_id % 64);
+	if (block_type == EMPTY_BLOCK) {
+		if (old_type != EMPTY_BLOCK && fs->journal_blocks > 0 && !fs->journal_suspended) {
+			if (old_type == FILE_DATA_BLOCK) {
+				fs->journal_freed.push_back(block_id);
+			} else {
+				fs->journal_freed_metadata.push_back(block_id);
 			}
+			return;
 		}
+		fs->free_bitmap[block_id / 64] |= bit;
+	} else {
+		fs->free_bitmap[block_id / 64] &= ~bit;
+	}
+}
+
+/**
+ * Find an empty block in filesystem, scanning the free-block bitmap a word
+ * at a time starting from the roving free_hint (next fit) and wrapping around.
+ * @return -1 on failure, index of block on success
+ */
+int mini_fat_find_empty_block(const FAT_FILESYSTEM *fat) {
+	int words = fat->free_bitmap.size();
+	if (words == 0) {
+		return -1;
+	}
+	int hint = fat->free_hint < fat->block_count ? fat->free_hint : 0;
+	int start = hint / 64;
 
+	//Bits at or after the hint in its own word
+	uint64_t word = fat->free_bitmap[start] & (~0ULL << (hint % 64));
+	if (word != 0) {
+		return start * 64 + __builtin_ctzll(word);
+	}
+	//Then every other word, wrapping back around to the hint's word
+	for (int i = 1; i <= words; i++) {
+		int index = (start + i) % words;
+		word = fat->free_bitmap[index];
+		if (word != 0) {
+			return index * 64 + __builtin_ctzll(word);
+		}
 	}
 	return -1;
 }
 
 /**
- * Find the first empty block in filesystem, and allocate it to a type,
+ * When the filesystem is full but blocks freed since the last checkpoint
+ * wait for it, checkpoint to make them allocatable. Operations call it
+ * before they change anything, like mini_journal_reserve.
+ * @return false if the checkpoint failed.
+ */
+bool mini_fat_reclaim_freed(FAT_FILESYSTEM *fs) {
+	if ((fs->journal_freed.empty() && fs->journal_freed_metadata.empty()) || mini_fat_find_empty_block(fs) != -1) {
+		return true;
+	}
+	return mini_fat_checkpoint(fs);
+}
+
+/**
+ * Find an empty block in filesystem, and allocate it to a type,
  * i.e., set block_map[new_block_index] to the specified type.
  * @return -1 on failure, new_block_index on success
  */
@@ -104,11 +422,111 @@ int mini_fat_allocate_new_block(FAT_FILESYSTEM *fs, const unsigned char block_ty
 		fprintf(stderr, "Cannot allocate block: filesystem is full.\n");
 		return -1;
 	}
-	fs->block_map[new_block_index] = block_type;
+	mini_fat_set_block_type(fs, new_block_index, block_type);
+	fs->free_hint = new_block_index + 1;
 	return new_block_index;
 }
 
+/**
+ * Allocate the preferred block if it is empty (e.g. the block right after a
+ * file's last extent), otherwise any empty block.
+ * @return -1 on failure, new_block_index on success
+ */
+int mini_fat_allocate_block_near(FAT_FILESYSTEM *fs, const unsigned char block_type, const int preferred) {
+	if (preferred >= 0 && preferred < fs->block_count && (fs->free_bitmap[preferred / 64] >> (preferred % 64) & 1)) {
+		mini_fat_set_block_type(fs, preferred, block_type);
+		fs->free_hint = preferred + 1;
+		return preferred;
+	}
+	return mini_fat_allocate_new_block(fs, block_type);
+}
+
+/**
+ * Number of empty blocks in a row starting at block, counting at most limit.
+ * Scans the free bitmap 64 blocks at a time.
+ */
+static int mini_fat_free_run(const FAT_FILESYSTEM *fat, const int block, const int limit) {
+	int length = 0;
+	while (length < limit && block + length < fat->block_count) {
+		int index = block + length;
+		uint64_t used = ~fat->free_bitmap[index / 64] >> (index % 64);
+		if (used != 0) {
+			length += __builtin_ctzll(used);
+			break;
+		}
+		length += 64 - index % 64;
+	}
+	if (block + length > fat->block_count) {
+		length = fat->block_count - block;
+	}
+	return length < limit ? length : limit;
+}
+
+/**
+ * First empty block in [from, to) starting a run of count empty blocks.
+ * @return -1 if there is none.
+ */
+static int mini_fat_find_run_in(const FAT_FILESYSTEM *fat, const int from, const int to, const int count) {
+	int block = from;
+	while (block < to) {
+		//Skip to the next empty block
+		uint64_t word = fat->free_bitmap[block / 64] & (~0ULL << (block % 64));
+		if (word == 0) {
+			block = (block / 64 + 1) * 64;
+			continue;
+		}
+		block = (block / 64) * 64 + __builtin_ctzll(word);
+		if (block >= to) {
+			break;
+		}
+		int length = mini_fat_free_run(fat, block, count);
+		if (length == count) {
+			return block;
+		}
+		block += length;
+	}
+	return -1;
+}
+
+/**
+ * Find count empty blocks in a row, from the roving free_hint (next fit) and
+ * wrapping around.
+ * @return the first block of the run, -1 if there is none.
+ */
+int mini_fat_find_empty_run(const FAT_FILESYSTEM *fat, const int count) {
+	int hint = fat->free_hint < fat->block_count ? fat->free_hint : 0;
+	int block = mini_fat_find_run_in(fat, hint, fat->block_count, count);
+	if (block == -1) {
+		block = mini_fat_find_run_in(fat, 0, hint, count);
+	}
+	return block;
+}
+
+/**
+ * Allocate count blocks in a row to a type: the run starting at preferred if
+ * it is empty (e.g. the blocks right after a file's last extent), otherwise
+ * the next empty run that is long enough.
+ * @return the first block of the run, -1 if no run of count empty blocks exists.
+ */
+int mini_fat_allocate_run(FAT_FILESYSTEM *fs, const unsigned char block_type, const int preferred, const int count) {
+	int block = -1;
+	if (preferred >= 0 && preferred < fs->block_count && mini_fat_free_run(fs, preferred, count) == count) {
+		block = preferred;
+	} else {
+		block = mini_fat_find_empty_run(fs, count);
+	}
+	if (block == -1) {
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		mini_fat_set_block_type(fs, block + i, block_type);
+	}
+	fs->free_hint = block + count;
+	return block;
+}
+
 void mini_fat_dump(const FAT_FILESYSTEM *fat) {
+	std::lock_guard<std::mutex> guard(((FAT_FILESYSTEM*)fat)->lock);
 	printf("Dumping fat with %d blocks of size %d:\n", fat->block_count, fat->block_size);
 	for (int i=0; i<fat->block_count;++i) {
 		printf("%d ", (int)fat->block_map[i]);
@@ -120,16 +538,66 @@ void mini_fat_dump(const FAT_FILESYSTEM *fat) {
 	}
 }
 
+/**
+ * Number of blocks reserved at the start of the disk for the superblock, the
+ * block map (4 bits per block) and at least the header of the first name
+ * index segment.
+ */
+static int mini_fat_metadata_blocks(const int block_size, const int block_count) {
+	long bytes = SUPERBLOCK_SIZE + ((long)block_count + 1) / 2 + NAME_SEGMENT_HEADER;
+	return (bytes + block_size - 1) / block_size;
+}
+
 static FAT_FILESYSTEM * mini_fat_create_internal(const char * filename, const int block_size, const int block_count) {
 	FAT_FILESYSTEM * fat = new FAT_FILESYSTEM;
 	fat->filename = filename;
 	fat->block_size = block_size;
 	fat->block_count = block_count;
 	fat->block_map.resize(fat->block_count, EMPTY_BLOCK); // Set all blocks to empty.
-	fat->block_map[0] = METADATA_BLOCK;
+	fat->free_bitmap.assign((block_count + 63) / 64, ~0ULL);
+	if (block_count % 64 != 0) {
+		fat->free_bitmap.back() = (1ULL << (block_count % 64)) - 1; // No blocks past the end.
+	}
+	fat->free_hint = 0;
+	fat->root = mini_file_create("");
+	fat->root->is_directory = true;
+	fat->root->inode = 0; // Block 0 is never an inode table, so it names the root in name records.
+	fat->inodes_per_block = block_size / INODE_SIZE;
+	fat->dirty_indirect_blocks = 0;
+	fat->directories_listed = true; // Until mini_fat_load fills files.
+	fat->name_index_used = 0;
+	fat->metadata_blocks = mini_fat_metadata_blocks(block_size, block_count);
+	fat->metadata_dirty.assign(fat->metadata_blocks, false);
+	mini_journal_init(fat);
+	for (int i = 0; i < fat->metadata_blocks && i < block_count; i++) {
+		mini_fat_set_block_type(fat, i, METADATA_BLOCK);
+	}
+	fat->fd = -1;
+	fat->io_mode = FAT_IO_PREAD;
+	fat->mapping = NULL;
+	mini_names_init(fat);
+	mini_cache_init(&fat->cache, DEFAULT_CACHE_CAPACITY);
+	fat->host_io_calls = 0;
+	mini_stats_init(&fat->stats);
 	return fat;
 }
 
+/**
+ * Map the whole virtual disk for FAT_IO_MMAP mode.
+ * Falls back to pread/pwrite if the image cannot be mapped.
+ */
+static void mini_fat_map(FAT_FILESYSTEM *fat, const int io_mode) {
+	if (io_mode != FAT_IO_MMAP) return;
+	void * mapping = mmap(NULL, (size_t)fat->block_size * fat->block_count, PROT_READ | PROT_WRITE, MAP_SHARED, fat->fd, 0);
+	if (mapping == MAP_FAILED) {
+		perror("Cannot map the virtual disk, using pread/pwrite");
+		return;
+	}
+	fat->mapping = (unsigned char*)mapping;
+	fat->io_mode = FAT_IO_MMAP;
+	fat->cache.capacity = 0; // The mapping is the cache.
+}
+
 /**
  * Create a new virtual disk file.
  * The file should be of the exact size block_size * block_count bytes.
@@ -137,147 +605,389 @@ static FAT_FILESYSTEM * mini_fat_create_internal(const char * filename, const in
  * @param  filename    name of the file on real disk
  * @param  block_size  size of each block
  * @param  block_count number of blocks
- * @return             FAT_FILESYSTEM pointer with parameters set.
+ * @param  io_mode     FAT_IO_PREAD or FAT_IO_MMAP
+ * @return             FAT_FILESYSTEM pointer with parameters set, NULL if the geometry is not valid.
  */
-FAT_FILESYSTEM * mini_fat_create(const char * filename, const int block_size, const int block_count) {
+FAT_FILESYSTEM * mini_fat_create(const char * filename, const int block_size, const int block_count, const int io_mode) {
+	if (block_size < INODE_SIZE || block_size > MAX_BLOCK_SIZE || block_count < 1) {
+		fprintf(stderr, "Cannot create the virtual disk: bad geometry %d x %d.\n", block_count, block_size);
+		return NULL;
+	}
+	//The metadata region and the journal must leave blocks for the files
+	int metadata_blocks = mini_fat_metadata_blocks(block_size, block_count);
+	if (metadata_blocks + mini_journal_size(block_size, block_count, metadata_blocks) >= block_count) {
+		fprintf(stderr, "Cannot create the virtual disk: %d blocks of %d bytes leave no room for files.\n", block_count, block_size);
+		return NULL;
+	}
 
 	FAT_FILESYSTEM * fat = mini_fat_create_internal(filename, block_size, block_count);
 
-	//Create/open the virtual disk
-	FILE* virtual_disk = fopen(filename, "wb+");
+	//Create/open the virtual disk, it stays open until mini_fat_unmount
+	fat->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
 
-	if(virtual_disk == 0) {
+	if(fat->fd < 0) {
 		printf("Cannot create the virtual disk!\n");
 		exit(-1);
 	}
 	//Fix the size of virtual disk
-	ftruncate(fileno(virtual_disk), block_size * block_count);
-	fclose(virtual_disk);
+	if (ftruncate(fat->fd, (off_t)block_size * block_count) != 0) {
+		perror("Cannot resize the virtual disk");
+	}
+	mini_fat_map(fat, io_mode);
+	//Nothing is on disk yet, the whole metadata region has to be written
+	for (int i = 0; i < fat->metadata_blocks; i++) {
+		mini_fat_mark_metadata_dirty(fat, i);
+	}
+	//Journaled changes need a checkpoint on disk to be replayed on
+	fat->journal_suspended = false;
+	if (fat->journal_blocks > 0 && !mini_fat_checkpoint(fat)) {
+		fprintf(stderr, "Cannot write the initial checkpoint.\n");
+	}
 	return fat;
 }
 
 /**
- * Save a virtual disk (filesystem) to file on real disk.
- * Stores filesystem metadata (e.g., block_size, block_count, block_map, etc.)
- * in block 0.
- * Stores file metadata (name, size, block map) in their corresponding blocks.
- * Does not store file data (they are written directly via write API).
- * @param  fat virtual disk filesystem
- * @return     true on success
+ * Serialize one block of the metadata region: the superblock (block 0) and
+ * the part of the block map (4 bits per block) that falls in this block.
+ * @param  buffer block_size bytes
  */
-bool mini_fat_save(const FAT_FILESYSTEM *fat) {
-	//Open the file system
-	FILE * fat_fd = fopen(fat->filename, "rb+");
-	if (fat_fd == NULL) {
-		perror("Cannot save fat to file");
+static void mini_fat_pack_metadata_block(const FAT_FILESYSTEM *fat, const int metadata_block, unsigned char *buffer) {
+	memset(buffer, 0, fat->block_size);
+	//Byte range of the region held by this block
+	long first_byte = (long)metadata_block * fat->block_size;
+	if (metadata_block == 0) {
+		put_u32(&buffer[SB_MAGIC], FAT_MAGIC);
+		put_u32(&buffer[SB_VERSION], FAT_FORMAT_VERSION);
+		put_u32(&buffer[SB_BLOCK_SIZE], fat->block_size);
+		put_u32(&buffer[SB_BLOCK_COUNT], fat->block_count);
+		put_u32(&buffer[SB_FILE_COUNT], fat->files.size());
+		put_u32(&buffer[SB_METADATA_BLOCKS], fat->metadata_blocks);
+		put_u32(&buffer[SB_JOURNAL_BLOCKS], fat->journal_blocks);
+		put_u32(&buffer[SB_JOURNAL_EPOCH], fat->journal_epoch);
+	}
+	long first_entry = first_byte <= SUPERBLOCK_SIZE ? 0 : (first_byte - SUPERBLOCK_SIZE) * 2;
+	long last_entry = (first_byte + fat->block_size - SUPERBLOCK_SIZE) * 2;
+	if (last_entry > fat->block_count) last_entry = fat->block_count;
+	for (long i = first_entry; i < last_entry; i++) {
+		put_nibble(buffer + (SUPERBLOCK_SIZE + i / 2 - first_byte), i % 2, fat->block_map[i]);
+	}
+	if (metadata_block == fat->metadata_blocks - 1) {
+		const FAT_NAME_BLOCK * names = fat->name_blocks[0];
+		mini_names_pack(fat, names, buffer + names->offset);
+	}
+}
+
+static bool mini_fat_segment_before(const FAT_SEGMENT &a, const FAT_SEGMENT &b) {
+	return a.block_id < b.block_id;
+}
+
+/**
+ * Checkpoint: write the data still buffered in write handles and the block
+ * cache, then the metadata that changed since the last sync: the inode
+ * tables and indirect blocks of dirty files, dirty name index blocks and
+ * dirty blocks of the metadata region, in block order so neighbours go out
+ * with one write. With a journal
+ * their images are logged first and the journal is emptied afterwards (see
+ * fat_journal.h). Costs time proportional to the change, not to the
+ * filesystem size. The caller holds fs->lock.
+ * @return true on success
+ */
+bool mini_fat_checkpoint(FAT_FILESYSTEM *fs) {
+	if (fs->fd < 0) {
+		fprintf(stderr, "Cannot sync fat: filesystem is not mounted.\n");
 		return false;
 	}
-	//Check if the file system is empty	
-	if(fat->block_map.empty()) {
 
+	//File data first, the metadata must not point to unwritten blocks
+	if (!mini_file_flush_buffers(fs) || !mini_cache_flush(fs)) {
 		return false;
 	}
-	//For every metadata and file entry block convert the data to string and write it to corresponding block	
-	for(long unsigned int i = 0; i < fat->block_map.size(); i++) {
-		char buffer[1024] = "";
-		if(fat->block_map[i] == METADATA_BLOCK) {
 
-			sprintf(buffer,"%d %d ", fat->block_count, fat->block_size);
+	//Indirect blocks to match the extents, then the dirty inodes by table
+	std::map<int, std::vector<FAT_FILE*> > tables;
+	int indirect_count = 0;
+	for (long unsigned int i = 0; i < fs->dirty_files.size(); i++) {
+		FAT_FILE * fat_file = fs->dirty_files[i];
+		if (!mini_file_fit_indirect(fs, fat_file)) {
+			return false;
+		}
+		tables[mini_inode_block(fs, fat_file->inode)].push_back(fat_file);
+		indirect_count += fat_file->indirect_blocks.size();
+	}
 
-			for(long unsigned int j = 0; j < fat->block_map.size(); j++) {			
-				char block = fat->block_map[j] + '0';	
-				strncat(buffer,&block, 1);
-				strcat(buffer," ");	
+	//Images of the dirty blocks
+	int count = tables.size() + indirect_count + fs->dirty_name_blocks.size() + fs->dirty_metadata.size();
+	std::vector<unsigned char> images((size_t)count * fs->block_size, 0);
+	std::vector<FAT_SEGMENT> segments;
+	for (std::map<int, std::vector<FAT_FILE*> >::iterator it = tables.begin(); it != tables.end(); ++it) {
+		FAT_SEGMENT segment = { it->first, 0, fs->block_size, &images[segments.size() * fs->block_size] };
+		unsigned char * image = (unsigned char*)segment.buffer;
+		//The other inodes of a table already on disk are kept
+		if (!fs->inode_tables[it->first]->fresh
+			&& mini_fat_read_in_block(fs, it->first, 0, fs->block_size, image) != fs->block_size) {
+			return false;
+		}
+		for (long unsigned int i = 0; i < it->second.size(); i++) {
+			if (!mini_file_pack_entry(fs, it->second[i], image + mini_inode_offset(fs, it->second[i]->inode))) {
+				return false;
 			}
-			mini_fat_write_in_block((FAT_FILESYSTEM*)fat, 0, 0, strlen(buffer),buffer); 
 		}
+		segments.push_back(segment);
+	}
+	for (long unsigned int i = 0; i < fs->dirty_files.size(); i++) {
+		FAT_FILE * fat_file = fs->dirty_files[i];
+		for (long unsigned int j = 0; j < fat_file->indirect_blocks.size(); j++) {
+			FAT_SEGMENT segment = { fat_file->indirect_blocks[j], 0, fs->block_size, &images[segments.size() * fs->block_size] };
+			mini_file_pack_indirect(fs, fat_file, j, (unsigned char*)segment.buffer);
+			segments.push_back(segment);
+		}
+	}
+	for (long unsigned int i = 0; i < fs->dirty_name_blocks.size(); i++) {
+		FAT_NAME_BLOCK * names = fs->dirty_name_blocks[i];
+		FAT_SEGMENT segment = { names->block_id, 0, fs->block_size, &images[segments.size() * fs->block_size] };
+		mini_names_pack(fs, names, (unsigned char*)segment.buffer);
+		segments.push_back(segment);
+	}
+	for (long unsigned int i = 0; i < fs->dirty_metadata.size(); i++) {
+		FAT_SEGMENT segment = { fs->dirty_metadata[i], 0, fs->block_size, &images[segments.size() * fs->block_size] };
+		mini_fat_pack_metadata_block(fs, fs->dirty_metadata[i], (unsigned char*)segment.buffer);
+		segments.push_back(segment);
+	}
+	std::sort(segments.begin(), segments.end(), mini_fat_segment_before);
 
-		else if(fat->block_map[i] == FILE_ENTRY_BLOCK) {
-			
-			for(long unsigned int k = 0; k < fat->files.size(); k++) {
-
-				FAT_FILE * fat_file = mini_file_find(fat, fat->files[k]->name);
-				if (!fat_file) {
-					fprintf(stderr, "File '%s' does not exist.\n", fat_file->name);
-					return false;
-				}		
-				
-				if(fat_file->metadata_block_id  == (int)i) {
+	if (!mini_journal_checkpoint_begin(fs, segments.data(), count)) {
+		return false;
+	}
+	if (mini_fat_write_segments(fs, segments.data(), count) != (long)count * fs->block_size) {
+		return false;
+	}
+	for (long unsigned int i = 0; i < fs->dirty_files.size(); i++) {
+		fs->dirty_files[i]->dirty = false;
+	}
+	fs->dirty_files.clear();
+	fs->dirty_indirect_blocks = 0;
+	for (std::map<int, std::vector<FAT_FILE*> >::iterator it = tables.begin(); it != tables.end(); ++it) {
+		fs->inode_tables[it->first]->fresh = false;
+	}
+	for (long unsigned int i = 0; i < fs->dirty_inode_tables.size(); i++) {
+		fs->inode_tables[fs->dirty_inode_tables[i]]->dirty = false;
+	}
+	fs->dirty_inode_tables.clear();
+	for (long unsigned int i = 0; i < fs->dirty_name_blocks.size(); i++) {
+		fs->dirty_name_blocks[i]->dirty = false;
+	}
+	fs->dirty_name_blocks.clear();
+	for (long unsigned int i = 0; i < fs->dirty_metadata.size(); i++) {
+		fs->metadata_dirty[fs->dirty_metadata[i]] = false;
+	}
+	fs->dirty_metadata.clear();
 
-					sprintf(buffer, "%d %ld %s ",fat_file->size, strlen(fat_file->name), fat_file->name);
-					for (long unsigned int j=0; j<fat_file->block_ids.size(); ++j) {
+	return mini_cache_flush(fs) && mini_journal_checkpoint_end(fs);
+}
 
-						char blok_id = fat_file->block_ids[j] + '0';	
-                				strncat(buffer, &blok_id,1);
-						strcat(buffer, " ");
-					}
-					mini_fat_write_in_block((FAT_FILESYSTEM*)fat, i, 0, sizeof(buffer),buffer);
+/**
+ * Write every metadata change to the disk, see mini_fat_checkpoint.
+ * @return true on success
+ */
+bool mini_fat_sync(FAT_FILESYSTEM *fs) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FAT_SYNC);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	return mini_fat_checkpoint(fs);
+}
 
-				}
-			}
+/**
+ * mini_fat_flush for callers holding fs->lock.
+ */
+static bool mini_fat_flush_image(FAT_FILESYSTEM *fs) {
+	if (!mini_file_flush_buffers(fs) || !mini_cache_flush(fs)) {
+		perror("Cannot flush the block cache");
+		return false;
+	}
+	if (fs->mapping != NULL) {
+		if (msync(fs->mapping, (size_t)fs->block_size * fs->block_count, MS_SYNC) != 0) {
+			perror("Cannot flush the virtual disk");
+			return false;
 		}
+		fs->host_io_calls++;
 	}
-	fclose(fat_fd);	
 	return true;
 }
 
-FAT_FILESYSTEM * mini_fat_load(const char *filename) {
-	//Open the file system
-	FILE * fat_fd = fopen(filename, "rb+");
-	if (fat_fd == NULL) {
+/**
+ * Save a virtual disk (filesystem) to file on real disk.
+ * Stores filesystem metadata (e.g., block_size, block_count, block_map, etc.)
+ * in the metadata blocks at the start of the disk (block 0 and, for large
+ * disks, the following ones).
+ * Stores file metadata (name, size, extents) in their corresponding blocks.
+ * Only what changed since the last save or sync is written (mini_fat_sync),
+ * then the image is flushed.
+ * Does not store file data (they are written directly via write API).
+ * @param  fat virtual disk filesystem
+ * @return     true on success
+ */
+bool mini_fat_save(const FAT_FILESYSTEM *fat) {
+	FAT_FILESYSTEM * fs = (FAT_FILESYSTEM*)fat;
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FAT_SAVE);
+	//Check if the file system is empty	
+	if(fat->block_map.empty()) {
+
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(fs->lock);
+	return mini_fat_checkpoint(fs) && mini_fat_flush_image(fs);
+}
+
+/**
+ * Load a filesystem saved by mini_fat_save.
+ * Reads the superblock for the geometry, then the block map and the name
+ * index. Inodes (sizes and extents) are read when a file is first
+ * opened, sized or deleted, so mount time does not grow with the file count.
+ * @param  filename name of the file on real disk
+ * @param  io_mode  FAT_IO_PREAD or FAT_IO_MMAP
+ * @return          FAT_FILESYSTEM pointer, NULL if the file is not a saved filesystem.
+ */
+FAT_FILESYSTEM * mini_fat_load(const char *filename, const int io_mode) {
+	uint64_t start = mini_stats_now();
+	//Open the file system, it stays open until mini_fat_unmount
+	int fd = open(filename, O_RDWR);
+	if (fd < 0) {
 		perror("Cannot load fat from file");
 		exit(-1);
 	}
-	int block_size = 1024, block_count = 10;
+	unsigned char superblock[SUPERBLOCK_SIZE];
+	if (pread(fd, superblock, SUPERBLOCK_SIZE, 0) != SUPERBLOCK_SIZE
+		|| get_u32(superblock + SB_MAGIC) != FAT_MAGIC
+		|| get_u32(superblock + SB_VERSION) != FAT_FORMAT_VERSION) {
+		fprintf(stderr, "Cannot load fat from file: '%s' is not a saved filesystem.\n", filename);
+		close(fd);
+		return NULL;
+	}
+	int block_size = get_u32(superblock + SB_BLOCK_SIZE);
+	int block_count = get_u32(superblock + SB_BLOCK_COUNT);
+	int metadata_blocks = get_u32(superblock + SB_METADATA_BLOCKS);
+	int journal_blocks = get_u32(superblock + SB_JOURNAL_BLOCKS);
+	if (block_size < INODE_SIZE || block_size > MAX_BLOCK_SIZE || block_count < 1
+		|| metadata_blocks != mini_fat_metadata_blocks(block_size, block_count) || metadata_blocks >= block_count
+		|| journal_blocks != mini_journal_size(block_size, block_count, metadata_blocks)) {
+		fprintf(stderr, "Cannot load fat from file: bad geometry %d x %d.\n", block_count, block_size);
+		close(fd);
+		return NULL;
+	}
+	//A short image would fault (SIGBUS) on the first access to its mapped tail
+	struct stat image;
+	if (fstat(fd, &image) != 0 || image.st_size < (off_t)block_size * block_count) {
+		fprintf(stderr, "Cannot load fat from file: '%s' is shorter than %d x %d bytes.\n", filename, block_count, block_size);
+		close(fd);
+		return NULL;
+	}
 	FAT_FILESYSTEM * fat = mini_fat_create_internal(filename, block_size, block_count);
+	fat->fd = fd;
+	fat->journal_epoch = get_u32(superblock + SB_JOURNAL_EPOCH);
+	mini_fat_map(fat, io_mode);
+	fat->host_io_calls++;
+
+	//Redo an interrupted checkpoint, or keep the committed records for later
+	if (!mini_journal_recover(fat)) {
+		fprintf(stderr, "Cannot load fat from file: cannot recover the journal.\n");
+		mini_fat_unmount(fat);
+		return NULL;
+	}
 
+	//Block map, with one read of the metadata blocks
+	std::vector<unsigned char> buffer((size_t)metadata_blocks * block_size);
+	mini_fat_read_blocks(fat, 0, metadata_blocks, buffer.data());
+	for (int i = 0; i < block_count; i++) {
+		mini_fat_set_block_type(fat, i, get_nibble(&buffer[SUPERBLOCK_SIZE], i));
+	}
+	mini_inode_load_tables(fat);
+
+	//Names and inodes of the files; the inodes are read on first use, the
+	//sorted directory entries on the first mini_dir_open
+	fat->directories_listed = false;
+	if (!mini_names_load(fat, &buffer[(size_t)(metadata_blocks - 1) * block_size])) {
+		fprintf(stderr, "Cannot load fat from file: corrupt name index.\n");
+		mini_fat_unmount(fat);
+		return NULL;
+	}
+	//Everything loaded matches the disk
+	fat->metadata_dirty.assign(fat->metadata_blocks, false);
+	fat->dirty_metadata.clear();
+
+	//Changes committed after the last checkpoint
+	if (!mini_journal_replay(fat)) {
+		fprintf(stderr, "Cannot load fat from file: corrupt journal.\n");
+		mini_fat_unmount(fat);
+		return NULL;
+	}
+	//Blocks freed by the replay are free on disk only after a checkpoint
+	fat->journal_suspended = false;
+	if (fat->journal_head > 0 && !mini_fat_checkpoint(fat)) {
+		fprintf(stderr, "Cannot checkpoint the replayed journal.\n");
+	}
+	FAT_STATS_API * counters = &mini_stats_shard(&fat->stats)->api[STAT_FAT_LOAD];
+	mini_stats_bump(counters->calls, 1);
+	mini_stats_record(counters, mini_stats_now() - start);
+	return fat;
+}
 
-	int metadata_size_to_load = block_size;
-	char buffer[1024];
-	mini_fat_read_in_block(fat, 0, 0, metadata_size_to_load, buffer);
-
-
-	//block_size
-	char* token = strtok(buffer, " ");
-	//block_count
-	token = strtok(NULL, " ");
-
-	token = strtok(NULL, " ");
-	int index = 0;
-	while(token != NULL) {
-		fat->block_map[index] = token[0] - '0';
-		index++;
-		token = strtok(NULL, " ");
-	}
-	//For every file entry block write the data to corresponing blocks
-	for(unsigned long int i = 0; i < fat->block_map.size(); i++) {
-
-		if(fat->block_map[i] == FILE_ENTRY_BLOCK) {
-	
-			FAT_FILE* fat_file = new FAT_FILE;
-			fat_file->metadata_block_id = i;
-			mini_fat_read_in_block(fat, i, 0, fat->block_size, buffer);
-
-			//file_size
-			char* token = strtok(buffer, " ");
-			fat_file->size = atoi(token);
-
-			//name_size
-			token = strtok(NULL, " ");
-
-			//name
-			token = strtok(NULL, " ");
-			strcpy(fat_file->name, token);
-			
-			token = strtok(NULL, " ");
-			while(token != NULL) {
-				fat_file->block_ids.push_back(token[0] - '0');
-				printf("-%d\n",token[0] - '0');
-				token = strtok(NULL, " ");
-			}
-			fat->files.push_back(fat_file);	
+/**
+ * Make every change so far durable. With a journal this is a group commit:
+ * the operations since the last commit cost one journal write and one
+ * fdatasync, and survive a crash (see fat_journal.h). Filesystems too small
+ * for a journal are saved instead.
+ * @return true on success
+ */
+bool mini_fat_commit(FAT_FILESYSTEM *fs) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FAT_COMMIT);
+	if (fs->fd < 0) {
+		fprintf(stderr, "Cannot commit fat: filesystem is not mounted.\n");
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(fs->lock);
+	if (fs->journal_blocks == 0) {
+		return mini_fat_checkpoint(fs) && mini_fat_flush_image(fs) && mini_fat_disk_sync(fs);
+	}
+	return mini_journal_commit(fs);
+}
+
+/**
+ * Push everything written so far to the virtual disk file.
+ * In FAT_IO_MMAP mode this is the only place (besides save) the mapping is
+ * msync'ed; in FAT_IO_PREAD mode the dirty blocks of the cache are written back.
+ * @return true on success
+ */
+bool mini_fat_flush(FAT_FILESYSTEM *fs) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FAT_FLUSH);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	return mini_fat_flush_image(fs);
+}
+
+
+/**
+ * Release a mounted filesystem: writes back the block cache, closes the
+ * virtual disk descriptor and frees the in-memory structures. Does not save
+ * metadata; call mini_fat_save (or mini_fat_commit) first.
+ * Open file handles of the filesystem become invalid.
+ */
+void mini_fat_unmount(FAT_FILESYSTEM *fs) {
+	if (fs == NULL) return;
+	mini_file_flush_buffers(fs);
+	mini_cache_flush(fs);
+	if (fs->mapping != NULL) {
+		munmap(fs->mapping, (size_t)fs->block_size * fs->block_count);
+	}
+	if (fs->fd >= 0) {
+		close(fs->fd);
+	}
+	for (long unsigned int i = 0; i < fs->files.size(); i++) {
+		for (long unsigned int j = 0; j < fs->files[i]->open_handles.size(); j++) {
+			delete fs->files[i]->open_handles[j];
 		}
-	}	
-	fclose(fat_fd);
-	return fat;
+		delete fs->files[i];
+	}
+	delete fs->root;
+	mini_names_free(fs);
+	mini_inode_free_tables(fs);
+	mini_stats_free(&fs->stats);
+	delete fs;
 }
@@ -1,39 +1,142 @@
 #ifndef FAT_H
 #define FAT_H
 
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <unordered_map>
 #include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "fat_cache.h"
+#include "fat_inode.h"
+#include "fat_names.h"
+#include "fat_stats.h"
 
 typedef struct t_FAT_FILE FAT_FILE; // Forward definition.
+typedef struct t_FAT_OPEN_FILE FAT_OPEN_FILE; // Forward definition.
 
 const unsigned char EMPTY_BLOCK = 0;
-const unsigned char FILE_ENTRY_BLOCK = 1;
+const unsigned char INODE_TABLE_BLOCK = 1; // Inodes of files and directories, see fat_inode.h.
 const unsigned char FILE_DATA_BLOCK = 2;
-const unsigned char METADATA_BLOCK = 3; // Only for the first block.
+const unsigned char METADATA_BLOCK = 3; // Superblock and block map, the first metadata_blocks blocks.
+const unsigned char NAME_INDEX_BLOCK = 4; // Name index segment, see fat_names.h.
+const unsigned char JOURNAL_BLOCK = 5; // Redo journal, the journal_blocks blocks after the metadata region.
+const unsigned char INDIRECT_BLOCK = 6; // Extents of a file that do not fit in its inode.
+// Block types are stored in 4 bits on disk, see fat_format.h.
 
+const int MAX_BLOCK_SIZE = 1 << 24; // 16 MiB; file sizes and positions are 64-bit, see fat_file.h.
+const int MAX_SEGMENT_RUN_BYTES = 1 << 30; // Largest preadv/pwritev of mini_fat_segment_run.
+
+// How block helpers reach the virtual disk, chosen at create/load time.
+const int FAT_IO_PREAD = 0; // pread/pwrite on the open descriptor.
+const int FAT_IO_MMAP = 1; // Whole image mapped, block access is a memcpy.
+
+// A byte range inside one block and the memory it is read into / written from.
+typedef struct t_FAT_SEGMENT {
+	int block_id;
+	int block_offset;
+	int size; // block_offset + size <= block_size.
+	void * buffer;
+} FAT_SEGMENT;
+
+// Thread safety: the public APIs may be called from several threads, each
+// using its own open file handles. lock guards the structure of the
+// filesystem (files and directories, name index, inode tables, block_map and
+// free_bitmap, the dirty lists, the journal and the handle write buffers) and
+// is only held for short updates. Each FAT_FILE has a reader/writer lock for
+// its data: reads share it, a write holds it exclusively, so writers only
+// block their own file. A thread holding fs->lock never waits for a file lock.
+// mini_fat_create, mini_fat_load and mini_fat_unmount must not run
+// concurrently with anything.
 // Feel free to modify this structure.
 typedef struct t_FAT_FILESYSTEM {
+	std::mutex lock; // See above.
 	const char * filename;
+	int fd; // Virtual disk descriptor, open from create/load until unmount.
+	int io_mode; // FAT_IO_PREAD or FAT_IO_MMAP.
+	unsigned char * mapping; // Mapped image in FAT_IO_MMAP mode, NULL otherwise.
 	int block_count;
 	int block_size;
+	int metadata_blocks; // Blocks reserved for the superblock and block map, sized from block_count.
+	std::vector<bool> metadata_dirty; // Per metadata block, changed since the last mini_fat_sync.
+	std::vector<int> dirty_metadata; // Indexes set in metadata_dirty.
 	std::vector<unsigned char> block_map;
+	std::vector<uint64_t> free_bitmap; // One bit per block, set when block_map says EMPTY_BLOCK.
+	int free_hint; // Next-fit start for mini_fat_find_empty_block.
+
+	FAT_FILE * root; // Root directory: inode 0, not in files and has no name index record.
+	std::vector<FAT_FILE*> files; // Files and directories, in no particular order (deletes swap in the last one).
+	bool directories_listed; // FAT_FILE::children are filled, see mini_dir_list_all.
+	std::vector<FAT_FILE*> name_index; // Open-addressing hash table over files by directory and name, see mini_file_lookup.
+	long unsigned int name_index_used; // Slots holding a file or a tombstone.
+	std::vector<FAT_FILE*> dirty_files; // Files whose inode must be rewritten.
+	int inodes_per_block; // block_size / INODE_SIZE.
+	std::unordered_map<int, FAT_INODE_TABLE*> inode_tables; // INODE_TABLE_BLOCK -> its slots.
+	std::set<int> inode_tables_free; // Tables with a free slot, the lowest block is filled first.
+	std::vector<int> dirty_inode_tables; // Tables holding a dirty file, one image each at the next checkpoint.
+	int dirty_indirect_blocks; // Bound on the blocks the dirty files' INDIRECT_BLOCKs add to the next checkpoint.
+	std::vector<FAT_NAME_BLOCK*> name_blocks; // On-disk name index segments, in chain order.
+	std::vector<FAT_NAME_BLOCK*> dirty_name_blocks; // NAME_INDEX_BLOCK segments to rewrite.
+	std::vector<FAT_OPEN_FILE*> buffered_handles; // Handles holding unwritten data, see mini_file_flush.
+
+	int journal_start; // First JOURNAL_BLOCK, see fat_journal.h.
+	int journal_blocks; // 0 when the filesystem is too small for a journal.
+	uint32_t journal_epoch; // Bumped by each checkpoint, older transactions are stale.
+	long journal_head; // Journal bytes used by committed transactions.
+	std::vector<unsigned char> journal_pending; // Records of the next transaction.
+	long journal_last_record; // Offset of the last record in journal_pending, -1 if none.
+	std::vector<int> journal_freed; // Data blocks freed by pending records, reusable after the commit.
+	std::vector<int> journal_freed_metadata; // Inode table, indirect and name index blocks, reusable after the checkpoint (replay reads them).
+	std::vector<unsigned char> journal_replay; // Committed records read at mount, applied after the name index.
+	bool journal_suspended; // While mounting and replaying: nothing is logged, frees are immediate.
+	unsigned long journal_commits;
+	unsigned long journal_checkpoints;
 
-	std::vector<FAT_FILE*> files;
+	FAT_CACHE cache; // Block cache used in FAT_IO_PREAD mode.
+	std::atomic<unsigned long> host_io_calls; // pread/pwrite/preadv/pwritev syscalls issued on fd.
+	FAT_STATS stats; // Bytes, blocks and API latencies, see mini_stats_dump.
 } FAT_FILESYSTEM;
 
 
 /// Public APIs
 // DO NOT MODIFY THE FOLLOWING:
-FAT_FILESYSTEM * mini_fat_create(const char * filename, const int block_size, const int block_count);
+FAT_FILESYSTEM * mini_fat_create(const char * filename, const int block_size, const int block_count, const int io_mode = FAT_IO_PREAD);
 bool mini_fat_save(const FAT_FILESYSTEM *fat);
-FAT_FILESYSTEM * mini_fat_load(const char *filename);
+FAT_FILESYSTEM * mini_fat_load(const char *filename, const int io_mode = FAT_IO_PREAD);
 void mini_fat_dump(const FAT_FILESYSTEM *fat);
+bool mini_fat_sync(FAT_FILESYSTEM *fs);
+bool mini_fat_commit(FAT_FILESYSTEM *fs);
+bool mini_fat_flush(FAT_FILESYSTEM *fs);
+void mini_fat_unmount(FAT_FILESYSTEM *fs);
 
 
 // Helpers (not mandatory):
+bool mini_fat_checkpoint(FAT_FILESYSTEM *fs);
+void mini_fat_set_block_type(FAT_FILESYSTEM *fs, const int block_id, const unsigned char block_type);
+void mini_fat_mark_metadata_dirty(FAT_FILESYSTEM *fs, const int metadata_block);
 int mini_fat_find_empty_block(const FAT_FILESYSTEM *fat);
+bool mini_fat_reclaim_freed(FAT_FILESYSTEM *fs);
 int mini_fat_allocate_new_block(FAT_FILESYSTEM *fs, const unsigned char block_type);
+int mini_fat_allocate_block_near(FAT_FILESYSTEM *fs, const unsigned char block_type, const int preferred);
+int mini_fat_find_empty_run(const FAT_FILESYSTEM *fat, const int count);
+int mini_fat_allocate_run(FAT_FILESYSTEM *fs, const unsigned char block_type, const int preferred, const int count);
 int mini_fat_write_in_block(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, const void * buffer);
 int mini_fat_read_in_block(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, void * buffer);
+long mini_fat_read_blocks(FAT_FILESYSTEM *fs, const int first_block, const int count, void * buffer);
+long mini_fat_write_blocks(FAT_FILESYSTEM *fs, const int first_block, const int count, const void * buffer);
+bool mini_fat_segment_cached(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segment);
+off_t mini_fat_segment_position(const FAT_FILESYSTEM *fs, const FAT_SEGMENT *segment);
+int mini_fat_segment_run(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segments, const int first, const int count,
+	std::vector<struct iovec> &iov, int *size);
+long mini_fat_read_segments(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segments, const int count);
+long mini_fat_write_segments(FAT_FILESYSTEM *fs, const FAT_SEGMENT *segments, const int count);
+int mini_fat_disk_write(FAT_FILESYSTEM *fs, const off_t position, const int size, const void * buffer);
+int mini_fat_disk_read(FAT_FILESYSTEM *fs, const off_t position, const int size, void * buffer);
+int mini_fat_disk_writev(FAT_FILESYSTEM *fs, const off_t position, struct iovec *iov, int count);
+int mini_fat_disk_readv(FAT_FILESYSTEM *fs, const off_t position, struct iovec *iov, int count);
+bool mini_fat_disk_sync(FAT_FILESYSTEM *fs);
 
 
 #endif //FAT_H
\ No newline at end of file
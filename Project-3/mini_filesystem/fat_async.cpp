@@ -0,0 +1,454 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_async.h"
+
+// No liburing: the ring is set up and driven with the raw system calls.
+#ifdef __NR_io_uring_setup
+static int io_uring_setup(const unsigned entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+static int io_uring_enter(const int ring_fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags) {
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+#endif
+
+/**
+ * Set up the io_uring ring: the submission and completion rings and the
+ * submission entries are shared with the kernel through mmap.
+ * @return false if io_uring is not available (old kernel, seccomp, ...).
+ */
+static bool mini_async_uring_init(FAT_ASYNC *async) {
+#ifdef __NR_io_uring_setup
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring_fd = io_uring_setup(async->queue_depth, &params);
+	if (ring_fd < 0) {
+		return false;
+	}
+	async->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	async->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && async->cq_ring_size > async->sq_ring_size) {
+		async->sq_ring_size = async->cq_ring_size;
+	}
+	async->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	async->sq_ring = mmap(NULL, async->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	async->cq_ring = async->sq_ring;
+	if (async->sq_ring != MAP_FAILED && !single_mmap) {
+		async->cq_ring = mmap(NULL, async->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	}
+	void * sqes = mmap(NULL, async->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (async->sq_ring == MAP_FAILED || async->cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+		perror("Cannot map the io_uring rings");
+		if (sqes != MAP_FAILED) munmap(sqes, async->sqes_size);
+		if (async->cq_ring != MAP_FAILED && async->cq_ring != async->sq_ring) munmap(async->cq_ring, async->cq_ring_size);
+		if (async->sq_ring != MAP_FAILED) munmap(async->sq_ring, async->sq_ring_size);
+		close(ring_fd);
+		return false;
+	}
+	async->sqes = (struct io_uring_sqe*)sqes;
+
+	char * sq = (char*)async->sq_ring;
+	char * cq = (char*)async->cq_ring;
+	async->sq_head = (unsigned*)(sq + params.sq_off.head);
+	async->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	async->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	async->sq_array = (unsigned*)(sq + params.sq_off.array);
+	async->cq_head = (unsigned*)(cq + params.cq_off.head);
+	async->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	async->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	async->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	async->ring_fd = ring_fd;
+	//The completion ring holds twice the entries, it cannot overflow
+	if (async->queue_depth > (int)params.sq_entries) {
+		async->queue_depth = params.sq_entries;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Thread engine: run queued ops with preadv/pwritev until the queue is
+ * stopped.
+ */
+static void mini_async_worker(FAT_ASYNC *async) {
+	std::unique_lock<std::mutex> guard(async->lock);
+	while (true) {
+		async->work_ready.wait(guard, [async] { return async->stopping || !async->queue.empty(); });
+		if (async->queue.empty()) {
+			return;
+		}
+		FAT_ASYNC_OP * op = async->queue.front();
+		async->queue.pop_front();
+		guard.unlock();
+		if (op->write) {
+			op->result = mini_fat_disk_writev(async->fs, op->position, op->iov.data(), op->iov.size());
+		} else {
+			op->result = mini_fat_disk_readv(async->fs, op->position, op->iov.data(), op->iov.size());
+		}
+		guard.lock();
+		async->completed.push_back(op);
+		async->work_done.notify_one();
+	}
+}
+
+/**
+ * Create a submission queue on fs keeping up to queue_depth host I/Os in
+ * flight. engine FAT_ASYNC_URING falls back to FAT_ASYNC_THREADS when
+ * io_uring cannot be set up; async->engine tells which one is used.
+ * @return NULL on failure.
+ */
+FAT_ASYNC * mini_async_open(FAT_FILESYSTEM *fs, const int queue_depth, const int engine) {
+	if (queue_depth < 1) {
+		fprintf(stderr, "Queue depth must be at least 1.\n");
+		return NULL;
+	}
+	FAT_ASYNC * async = new FAT_ASYNC;
+	async->fs = fs;
+	async->queue_depth = queue_depth < 4096 ? queue_depth : 4096;
+	async->in_flight = 0;
+	async->ring_error = 0;
+	async->next_token = 0;
+	async->ring_fd = -1;
+	async->stopping = false;
+	async->engine = FAT_ASYNC_THREADS;
+	if (engine == FAT_ASYNC_URING && mini_async_uring_init(async)) {
+		async->engine = FAT_ASYNC_URING;
+	} else {
+		int workers = async->queue_depth < MAX_ASYNC_WORKERS ? async->queue_depth : MAX_ASYNC_WORKERS;
+		for (int i = 0; i < workers; i++) {
+			async->workers.push_back(std::thread(mini_async_worker, async));
+		}
+	}
+	return async;
+}
+
+/**
+ * Account a finished op to its request. io_uring may transfer less than
+ * asked; the rest is done with preadv/pwritev.
+ */
+static void mini_async_complete(FAT_ASYNC *async, FAT_ASYNC_OP *op) {
+	async->in_flight--;
+	FAT_ASYNC_REQUEST &request = async->requests[op->token];
+	int done = op->result;
+	//The thread engine's preadv/pwritev count themselves
+	if (done > 0 && async->engine == FAT_ASYNC_URING) {
+		mini_stats_count(&async->fs->stats, op->write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, done);
+	}
+	if (done < 0) {
+		errno = -done;
+		perror(op->write ? "Cannot write blocks to file" : "Cannot read blocks from file");
+		done = 0;
+	} else if (done < op->size && async->engine == FAT_ASYNC_URING) {
+		//Skip the buffers done, resume inside a partly transferred one
+		struct iovec * iov = op->iov.data();
+		int count = op->iov.size();
+		int n = done;
+		while (count > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+		if (op->write) {
+			done += mini_fat_disk_writev(async->fs, op->position + done, iov, count);
+		} else {
+			done += mini_fat_disk_readv(async->fs, op->position + done, iov, count);
+		}
+	}
+	request.bytes += done;
+	if (done != op->size) {
+		request.failed = true;
+	}
+	request.pending--;
+	delete op;
+}
+
+/**
+ * Hand the ops of the backlog to the engine while fewer than queue_depth are
+ * in flight. With io_uring they are submitted with one io_uring_enter; the
+ * ops it refuses fail with its errno.
+ */
+static void mini_async_start(FAT_ASYNC *async) {
+	int count = 0;
+	if (async->engine == FAT_ASYNC_URING && async->ring_error != 0) {
+		while (!async->backlog.empty()) {
+			FAT_ASYNC_OP * op = async->backlog.front();
+			async->backlog.pop_front();
+			op->result = -async->ring_error;
+			async->in_flight++;
+			mini_async_complete(async, op);
+		}
+		return;
+	}
+	if (async->engine == FAT_ASYNC_URING) {
+		unsigned tail = *async->sq_tail;
+		std::vector<FAT_ASYNC_OP*> ops;
+		while (!async->backlog.empty() && async->in_flight + count < async->queue_depth) {
+			FAT_ASYNC_OP * op = async->backlog.front();
+			ops.push_back(op);
+			async->backlog.pop_front();
+			unsigned index = tail & *async->sq_mask;
+			struct io_uring_sqe * sqe = &async->sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = async->fs->fd;
+			sqe->addr = (unsigned long)op->iov.data();
+			sqe->len = op->iov.size();
+			sqe->off = op->position;
+			sqe->user_data = (unsigned long)op;
+			async->sq_array[index] = index;
+			tail++;
+			count++;
+		}
+		if (count == 0) return;
+		//The kernel must see the entries before the new tail
+		__atomic_store_n(async->sq_tail, tail, __ATOMIC_RELEASE);
+		int submitted = 0;
+		int error = 0;
+		while (submitted < count) {
+			int n = io_uring_enter(async->ring_fd, count - submitted, 0, 0);
+			async->fs->host_io_calls++;
+			if (n < 0) {
+				if (errno == EINTR || errno == EAGAIN) continue;
+				error = errno;
+				perror("Cannot submit to io_uring");
+				break;
+			}
+			submitted += n;
+		}
+		if (submitted < count) {
+			//Take back the entries the kernel did not consume and fail their ops
+			__atomic_store_n(async->sq_tail, tail - (count - submitted), __ATOMIC_RELEASE);
+			async->in_flight += count;
+			for (int i = submitted; i < count; i++) {
+				ops[i]->result = -error;
+				mini_async_complete(async, ops[i]);
+			}
+			return;
+		}
+	} else {
+		std::lock_guard<std::mutex> guard(async->lock);
+		while (!async->backlog.empty() && async->in_flight + count < async->queue_depth) {
+			async->queue.push_back(async->backlog.front());
+			async->backlog.pop_front();
+			count++;
+		}
+		async->work_ready.notify_all();
+	}
+	async->in_flight += count;
+}
+
+/**
+ * The ring cannot be waited on any more: fail the requests of the ops in
+ * flight and, from now on, every op queued. The ops in flight, and the
+ * blocks they write, are not freed: the kernel may still complete them.
+ */
+static void mini_async_fail_ring(FAT_ASYNC *async, const int error) {
+	std::unordered_map<int, int> queued; // Token -> ops in the backlog.
+	for (long unsigned int i = 0; i < async->backlog.size(); i++) {
+		queued[async->backlog[i]->token]++;
+	}
+	for (std::unordered_map<int, FAT_ASYNC_REQUEST>::iterator it = async->requests.begin(); it != async->requests.end(); ++it) {
+		int lost = it->second.pending - queued[it->first];
+		if (lost > 0) {
+			it->second.failed = true;
+			it->second.pending -= lost;
+			it->second.end_block = it->second.first_block; // Blocks the kernel may still write are kept.
+		}
+	}
+	async->in_flight = 0;
+	async->ring_error = error;
+}
+
+/**
+ * Collect finished ops, waiting for at least one if wait is set and some are
+ * in flight, then refill the engine from the backlog.
+ */
+static void mini_async_reap(FAT_ASYNC *async, const bool wait) {
+	std::vector<FAT_ASYNC_OP*> finished;
+	if (async->engine == FAT_ASYNC_URING && async->ring_error == 0) {
+		unsigned head = *async->cq_head;
+		unsigned tail = __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE);
+		while (head == tail && wait && async->in_flight > 0) {
+			int n = io_uring_enter(async->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+			async->fs->host_io_calls++;
+			if (n < 0 && errno != EINTR) {
+				int error = errno;
+				perror("Cannot wait for io_uring");
+				mini_async_fail_ring(async, error);
+				break;
+			}
+			tail = __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE);
+		}
+		while (head != tail && async->ring_error == 0) {
+			struct io_uring_cqe * cqe = &async->cqes[head & *async->cq_mask];
+			FAT_ASYNC_OP * op = (FAT_ASYNC_OP*)cqe->user_data;
+			op->result = cqe->res;
+			finished.push_back(op);
+			head++;
+		}
+		__atomic_store_n(async->cq_head, head, __ATOMIC_RELEASE);
+	} else if (async->engine == FAT_ASYNC_THREADS) {
+		std::unique_lock<std::mutex> guard(async->lock);
+		if (wait && async->in_flight > 0) {
+			async->work_done.wait(guard, [async] { return !async->completed.empty(); });
+		}
+		finished.assign(async->completed.begin(), async->completed.end());
+		async->completed.clear();
+	}
+	for (long unsigned int i = 0; i < finished.size(); i++) {
+		mini_async_complete(async, finished[i]);
+	}
+	mini_async_start(async);
+}
+
+/**
+ * Queue the segments of a file read or write. Segments that go through the
+ * block cache (or the mapping) are done now; runs of adjacent uncached
+ * blocks become host I/Os done in the background.
+ * @param open_file, position  for a write, the handle and file position it
+ *                             writes at: the file grows when it is collected.
+ * @param done_bytes           bytes the caller already transferred (holes
+ *                             it zeroed, inline data it copied), counted in
+ *                             the result.
+ * @return token of the request.
+ */
+int mini_async_submit(FAT_ASYNC *async, const FAT_SEGMENT *segments, const int count, const bool write,
+	FAT_OPEN_FILE *open_file, const int64_t position, const int done_bytes) {
+	FAT_FILESYSTEM * fs = async->fs;
+	int token = async->next_token++;
+	FAT_ASYNC_REQUEST &request = async->requests[token];
+	request.pending = 0;
+	request.bytes = done_bytes;
+	request.failed = false;
+	request.open_file = open_file;
+	request.position = position;
+	request.first_block = 0;
+	request.end_block = 0;
+	request.written_end = 0;
+	request.generation = 0;
+
+	int i = 0;
+	while (i < count) {
+		const FAT_SEGMENT * segment = &segments[i];
+		if (fs->mapping != NULL || mini_fat_segment_cached(fs, segment)) {
+			int n;
+			if (write) {
+				n = mini_fat_write_in_block(fs, segment->block_id, segment->block_offset, segment->size, segment->buffer);
+			} else {
+				n = mini_fat_read_in_block(fs, segment->block_id, segment->block_offset, segment->size, segment->buffer);
+			}
+			request.bytes += n;
+			if (n != segment->size) {
+				request.failed = true;
+			}
+			i++;
+			continue;
+		}
+		FAT_ASYNC_OP * op = new FAT_ASYNC_OP;
+		op->token = token;
+		op->write = write;
+		op->position = mini_fat_segment_position(fs, segment);
+		i += mini_fat_segment_run(fs, segments, i, count, op->iov, &op->size);
+		async->backlog.push_back(op);
+		request.pending++;
+	}
+	mini_async_start(async);
+	return token;
+}
+
+/**
+ * Hand a finished request's result to the caller and forget the token.
+ * @return transferred byte count, -1 if part of the request failed.
+ */
+static int mini_async_collect(FAT_ASYNC *async, std::unordered_map<int, FAT_ASYNC_REQUEST>::iterator it) {
+	FAT_ASYNC_REQUEST request = it->second;
+	async->requests.erase(it);
+	if (request.open_file != NULL) {
+		mini_file_write_done(async->fs, &request);
+	}
+	return request.failed ? -1 : request.bytes;
+}
+
+/**
+ * Check whether the request of token finished, without blocking.
+ * @param result  set to its byte count (-1 on error) once it finished.
+ * @return true if it finished; the token is then no longer valid.
+ */
+bool mini_async_poll(FAT_ASYNC *async, const int token, int *result) {
+	mini_async_reap(async, false);
+	std::unordered_map<int, FAT_ASYNC_REQUEST>::iterator it = async->requests.find(token);
+	if (it == async->requests.end()) {
+		fprintf(stderr, "Unknown async request %d.\n", token);
+		*result = -1;
+		return true;
+	}
+	if (it->second.pending > 0) {
+		return false;
+	}
+	*result = mini_async_collect(async, it);
+	return true;
+}
+
+/**
+ * Block until the request of token finishes.
+ * @return its byte count, -1 on error.
+ */
+int mini_async_wait(FAT_ASYNC *async, const int token) {
+	while (true) {
+		std::unordered_map<int, FAT_ASYNC_REQUEST>::iterator it = async->requests.find(token);
+		if (it == async->requests.end()) {
+			fprintf(stderr, "Unknown async request %d.\n", token);
+			return -1;
+		}
+		if (it->second.pending == 0) {
+			return mini_async_collect(async, it);
+		}
+		mini_async_reap(async, true);
+	}
+}
+
+/**
+ * Wait for every request still queued (writes not collected yet take effect)
+ * and free the queue.
+ */
+void mini_async_close(FAT_ASYNC *async) {
+	while (async->in_flight > 0 || !async->backlog.empty()) {
+		mini_async_reap(async, true);
+	}
+	while (!async->requests.empty()) {
+		mini_async_collect(async, async->requests.begin());
+	}
+	if (async->engine == FAT_ASYNC_URING) {
+		munmap(async->sqes, async->sqes_size);
+		if (async->cq_ring != async->sq_ring) {
+			munmap(async->cq_ring, async->cq_ring_size);
+		}
+		munmap(async->sq_ring, async->sq_ring_size);
+		close(async->ring_fd);
+	} else {
+		{
+			std::lock_guard<std::mutex> guard(async->lock);
+			async->stopping = true;
+		}
+		async->work_ready.notify_all();
+		for (long unsigned int i = 0; i < async->workers.size(); i++) {
+			async->workers[i].join();
+		}
+	}
+	delete async;
+}
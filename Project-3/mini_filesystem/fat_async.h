@@ -0,0 +1,99 @@
+#ifndef FAT_ASYNC_H
+#define FAT_ASYNC_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Asynchronous block I/O. A FAT_ASYNC is a submission queue owned by one
+// thread: mini_file_read_async / mini_file_write_async plan the request like
+// mini_file_read / mini_file_write, hand its blocks to the queue and return a
+// token at once; mini_async_poll / mini_async_wait collect the result. Runs of
+// adjacent uncached blocks go to an io_uring ring (raw syscalls, one
+// io_uring_enter per request) or, where io_uring is not available, to a pool
+// of threads doing preadv/pwritev. Parts of blocks and cached blocks go
+// through the block cache during the submission.
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+typedef struct t_FAT_OPEN_FILE FAT_OPEN_FILE; // Forward definition.
+typedef struct t_FAT_SEGMENT FAT_SEGMENT; // Forward definition.
+
+const int FAT_ASYNC_URING = 0;
+const int FAT_ASYNC_THREADS = 1;
+const int MAX_ASYNC_WORKERS = 16; // Threads of the fallback engine.
+
+// One host I/O: a run of adjacent blocks.
+typedef struct t_FAT_ASYNC_OP {
+	int token; // Request it belongs to.
+	bool write;
+	off_t position;
+	int size;
+	std::vector<struct iovec> iov;
+	int result; // Bytes transferred, or -errno.
+} FAT_ASYNC_OP;
+
+typedef struct t_FAT_ASYNC_REQUEST {
+	int pending; // Ops not completed yet.
+	int bytes; // Transferred so far.
+	bool failed;
+	FAT_OPEN_FILE * open_file; // Write requests: the file grows when they complete.
+	int64_t position; // File position of a write request.
+	int first_block; // File blocks [first_block, end_block) it appended, freed if it fails.
+	int end_block;
+	int64_t written_end; // The file's written_end before the request.
+	unsigned long generation; // The file's generation once the request was planned.
+} FAT_ASYNC_REQUEST;
+
+typedef struct t_FAT_ASYNC {
+	FAT_FILESYSTEM * fs;
+	int engine; // FAT_ASYNC_URING, or FAT_ASYNC_THREADS when io_uring is not available.
+	int queue_depth; // Ops in flight at most.
+	int in_flight;
+	int ring_error; // errno that made the io_uring ring unusable, 0 if none.
+	std::deque<FAT_ASYNC_OP*> backlog; // Ops waiting for a free slot.
+	std::unordered_map<int, FAT_ASYNC_REQUEST> requests; // Token -> request, until its result is collected.
+	int next_token;
+
+	// io_uring engine
+	int ring_fd;
+	void * sq_ring;
+	void * cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe * sqes;
+	size_t sqes_size;
+	unsigned * sq_head;
+	unsigned * sq_tail;
+	unsigned * sq_mask;
+	unsigned * sq_array;
+	unsigned * cq_head;
+	unsigned * cq_tail;
+	unsigned * cq_mask;
+	struct io_uring_cqe * cqes;
+
+	// Thread engine
+	std::vector<std::thread> workers;
+	std::mutex lock; // Guards queue, completed and stopping.
+	std::condition_variable work_ready;
+	std::condition_variable work_done;
+	std::deque<FAT_ASYNC_OP*> queue;
+	std::deque<FAT_ASYNC_OP*> completed;
+	bool stopping;
+} FAT_ASYNC;
+
+
+FAT_ASYNC * mini_async_open(FAT_FILESYSTEM *fs, const int queue_depth, const int engine = FAT_ASYNC_URING);
+void mini_async_close(FAT_ASYNC *async);
+bool mini_async_poll(FAT_ASYNC *async, const int token, int *result);
+int mini_async_wait(FAT_ASYNC *async, const int token);
+
+// Helper used by mini_file_read_async / mini_file_write_async:
+int mini_async_submit(FAT_ASYNC *async, const FAT_SEGMENT *segments, const int count, const bool write,
+	FAT_OPEN_FILE *open_file, const int64_t position, const int done_bytes = 0);
+
+#endif // FAT_ASYNC_H
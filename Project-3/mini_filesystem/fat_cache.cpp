@@ -0,0 +1,226 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "fat.h"
+#include "fat_cache.h"
+
+void mini_cache_init(FAT_CACHE *cache, const int capacity) {
+	cache->capacity = capacity;
+	cache->lru.clear();
+	cache->blocks.clear();
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->evictions = 0;
+	cache->writebacks = 0;
+}
+
+/**
+ * Write a dirty cached block back to the virtual disk.
+ * @return false if the block could not be written.
+ */
+static bool mini_cache_write_back(FAT_FILESYSTEM *fs, FAT_CACHE_BLOCK *block) {
+	if (!block->dirty) return true;
+	off_t position = (off_t)block->block_id * fs->block_size;
+	if (mini_fat_disk_write(fs, position, fs->block_size, block->data.data()) != fs->block_size) {
+		return false;
+	}
+	block->dirty = false;
+	fs->cache.writebacks++;
+	return true;
+}
+
+/**
+ * Drop least recently used blocks until the cache holds at most capacity
+ * blocks. Pinned blocks are skipped, so the cache may stay above capacity
+ * until they are unpinned.
+ */
+static bool mini_cache_evict(FAT_FILESYSTEM *fs, const int capacity) {
+	FAT_CACHE *cache = &fs->cache;
+	std::list<FAT_CACHE_BLOCK>::iterator victim = cache->lru.end();
+	while ((int)cache->lru.size() > capacity && victim != cache->lru.begin()) {
+		--victim;
+		if (victim->pins > 0) continue;
+		if (!mini_cache_write_back(fs, &*victim)) {
+			return false;
+		}
+		cache->blocks.erase(victim->block_id);
+		victim = cache->lru.erase(victim);
+		cache->evictions++;
+	}
+	return true;
+}
+
+/**
+ * Find block_id in the cache and mark it most recently used. On a miss the
+ * block is loaded from the virtual disk, unless the caller will overwrite it
+ * completely.
+ * @return cached block, NULL on I/O failure.
+ */
+static FAT_CACHE_BLOCK * mini_cache_get(FAT_FILESYSTEM *fs, const int block_id, const bool overwrite) {
+	FAT_CACHE *cache = &fs->cache;
+	std::unordered_map<int, std::list<FAT_CACHE_BLOCK>::iterator>::iterator found = cache->blocks.find(block_id);
+	if (found != cache->blocks.end()) {
+		cache->hits++;
+		cache->lru.splice(cache->lru.begin(), cache->lru, found->second);
+		return &cache->lru.front();
+	}
+
+	cache->misses++;
+	if (!mini_cache_evict(fs, cache->capacity - 1)) {
+		return NULL;
+	}
+	FAT_CACHE_BLOCK block;
+	block.block_id = block_id;
+	block.dirty = false;
+	block.pins = 0;
+	block.data.resize(fs->block_size);
+	if (!overwrite) {
+		off_t position = (off_t)block_id * fs->block_size;
+		if (mini_fat_disk_read(fs, position, fs->block_size, block.data.data()) != fs->block_size) {
+			return NULL;
+		}
+	}
+	cache->lru.push_front(block);
+	cache->blocks[block_id] = cache->lru.begin();
+	return &cache->lru.front();
+}
+
+/**
+ * Read size bytes at block_offset of block_id through the cache, or from the
+ * virtual disk when the cache is off (it is then empty).
+ * @return read byte count.
+ */
+int mini_cache_read(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, void * buffer) {
+	std::unique_lock<std::mutex> guard(fs->cache.lock);
+	if (fs->cache.capacity == 0) {
+		guard.unlock();
+		return mini_fat_disk_read(fs, (off_t)block_id * fs->block_size + block_offset, size, buffer);
+	}
+	FAT_CACHE_BLOCK *block = mini_cache_get(fs, block_id, false);
+	if (block == NULL) return 0;
+	memcpy(buffer, block->data.data() + block_offset, size);
+	return size;
+}
+
+/**
+ * Write size bytes at block_offset of block_id into the cache (written back
+ * later), or to the virtual disk when the cache is off.
+ * @return written byte count.
+ */
+int mini_cache_write(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, const void * buffer) {
+	std::unique_lock<std::mutex> guard(fs->cache.lock);
+	if (fs->cache.capacity == 0) {
+		guard.unlock();
+		return mini_fat_disk_write(fs, (off_t)block_id * fs->block_size + block_offset, size, buffer);
+	}
+	FAT_CACHE_BLOCK *block = mini_cache_get(fs, block_id, size == fs->block_size);
+	if (block == NULL) return 0;
+	memcpy(block->data.data() + block_offset, buffer, size);
+	block->dirty = true;
+	return size;
+}
+
+/**
+ * Whether block_id is cached (then reads and writes of it must go through
+ * the cache).
+ */
+bool mini_cache_contains(FAT_FILESYSTEM *fs, const int block_id) {
+	std::lock_guard<std::mutex> guard(fs->cache.lock);
+	return fs->cache.blocks.count(block_id) > 0;
+}
+
+/**
+ * Whether an access to block_id must go through the cache: the cache is on
+ * and the block is cached, or the access covers only part of the block (so
+ * small accesses keep being coalesced).
+ */
+bool mini_cache_wants(FAT_FILESYSTEM *fs, const int block_id, const bool partial) {
+	std::lock_guard<std::mutex> guard(fs->cache.lock);
+	return fs->cache.capacity > 0 && (partial || fs->cache.blocks.count(block_id) > 0);
+}
+
+/**
+ * Keep block_id in the cache until mini_cache_unpin, loading it on a miss.
+ * @return its block_size bytes, NULL if the cache is off or on I/O failure.
+ */
+const unsigned char * mini_cache_pin(FAT_FILESYSTEM *fs, const int block_id) {
+	std::lock_guard<std::mutex> guard(fs->cache.lock);
+	if (fs->cache.capacity == 0) return NULL;
+	FAT_CACHE_BLOCK *block = mini_cache_get(fs, block_id, false);
+	if (block == NULL) return NULL;
+	block->pins++;
+	return block->data.data();
+}
+
+/**
+ * Undo one mini_cache_pin; the block may then be evicted if the cache is
+ * over capacity.
+ */
+void mini_cache_unpin(FAT_FILESYSTEM *fs, const int block_id) {
+	std::lock_guard<std::mutex> guard(fs->cache.lock);
+	std::unordered_map<int, std::list<FAT_CACHE_BLOCK>::iterator>::iterator found = fs->cache.blocks.find(block_id);
+	if (found == fs->cache.blocks.end()) return;
+	found->second->pins--;
+	mini_cache_evict(fs, fs->cache.capacity);
+}
+
+static bool block_id_less(const FAT_CACHE_BLOCK *a, const FAT_CACHE_BLOCK *b) {
+	return a->block_id < b->block_id;
+}
+
+/**
+ * Write every dirty block back to the virtual disk, in block order.
+ * Blocks stay cached (clean).
+ * @return true on success
+ */
+bool mini_cache_flush(FAT_FILESYSTEM *fs) {
+	std::lock_guard<std::mutex> guard(fs->cache.lock);
+	std::vector<FAT_CACHE_BLOCK*> dirty;
+	for (std::list<FAT_CACHE_BLOCK>::iterator it = fs->cache.lru.begin(); it != fs->cache.lru.end(); ++it) {
+		if (it->dirty) dirty.push_back(&*it);
+	}
+	std::sort(dirty.begin(), dirty.end(), block_id_less);
+	for (long unsigned int i = 0; i < dirty.size(); i++) {
+		if (!mini_cache_write_back(fs, dirty[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Change how many blocks the cache may hold. Shrinking writes back and
+ * drops the least recently used blocks, 0 disables the cache. Blocks pinned
+ * by views cannot be dropped: the cache refuses to shrink below them.
+ * @return false if the capacity is negative, the pinned blocks do not fit
+ *         or a dirty block cannot be written back; the capacity is unchanged.
+ */
+bool mini_cache_set_capacity(FAT_FILESYSTEM *fs, const int capacity) {
+	if (capacity < 0) return false;
+	std::lock_guard<std::mutex> guard(fs->cache.lock);
+	int pinned = 0;
+	for (std::list<FAT_CACHE_BLOCK>::iterator it = fs->cache.lru.begin(); it != fs->cache.lru.end(); ++it) {
+		pinned += it->pins > 0;
+	}
+	if (pinned > capacity) {
+		fprintf(stderr, "Cannot shrink the block cache to %d blocks: %d are pinned by views.\n", capacity, pinned);
+		return false;
+	}
+	if (!mini_cache_evict(fs, capacity) || (int)fs->cache.lru.size() > capacity) {
+		return false;
+	}
+	fs->cache.capacity = capacity;
+	return true;
+}
+
+void mini_cache_dump(const FAT_FILESYSTEM *fs) {
+	FAT_CACHE *cache = (FAT_CACHE*)&fs->cache;
+	std::lock_guard<std::mutex> guard(cache->lock);
+	int dirty = 0;
+	for (std::list<FAT_CACHE_BLOCK>::const_iterator it = cache->lru.begin(); it != cache->lru.end(); ++it) {
+		dirty += it->dirty;
+	}
+	printf("Block cache: %d/%d blocks (%d dirty)\n", (int)cache->lru.size(), cache->capacity, dirty);
+	printf("\tHits: %lu\tMisses: %lu\tEvictions: %lu\tWritebacks: %lu\n",
+		cache->hits, cache->misses, cache->evictions, cache->writebacks);
+}
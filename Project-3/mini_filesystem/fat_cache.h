@@ -0,0 +1,51 @@
+#ifndef FAT_CACHE_H
+#define FAT_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+const int DEFAULT_CACHE_CAPACITY = 64; // Blocks.
+
+// One cached block of the virtual disk.
+typedef struct t_FAT_CACHE_BLOCK {
+	int block_id;
+	bool dirty; // Modified since it was read, must be written back.
+	int pins; // FAT_FILE_VIEWs pointing into data: not evicted while positive.
+	std::vector<unsigned char> data; // block_size bytes.
+} FAT_CACHE_BLOCK;
+
+// Write-back LRU block cache in front of the block helpers. Shared by every
+// thread: the mini_cache_* functions take its lock.
+typedef struct t_FAT_CACHE {
+	std::mutex lock; // Guards everything below.
+	int capacity; // In blocks, 0 disables the cache (it is then empty).
+	std::list<FAT_CACHE_BLOCK> lru; // Most recently used first.
+	std::unordered_map<int, std::list<FAT_CACHE_BLOCK>::iterator> blocks; // block_id -> entry in lru.
+
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long writebacks; // Dirty blocks written to the virtual disk.
+} FAT_CACHE;
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+
+void mini_cache_init(FAT_CACHE *cache, const int capacity);
+bool mini_cache_set_capacity(FAT_FILESYSTEM *fs, const int capacity);
+bool mini_cache_flush(FAT_FILESYSTEM *fs);
+void mini_cache_dump(const FAT_FILESYSTEM *fs);
+
+// Helpers used by mini_fat_read_in_block / mini_fat_write_in_block:
+int mini_cache_read(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, void * buffer);
+int mini_cache_write(FAT_FILESYSTEM *fs, const int block_id, const int block_offset, const int size, const void * buffer);
+bool mini_cache_contains(FAT_FILESYSTEM *fs, const int block_id);
+bool mini_cache_wants(FAT_FILESYSTEM *fs, const int block_id, const bool partial);
+
+// Helpers used by mini_file_view / mini_file_release_view:
+const unsigned char * mini_cache_pin(FAT_FILESYSTEM *fs, const int block_id);
+void mini_cache_unpin(FAT_FILESYSTEM *fs, const int block_id);
+
+#endif // FAT_CACHE_H
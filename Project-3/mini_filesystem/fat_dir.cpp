@@ -0,0 +1,125 @@
+#include <cstdio>
+#include <cstring>
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_dir.h"
+
+/**
+ * Find a directory by path; "" and "/" are the root.
+ * @return the directory, NULL if it does not exist or is a file.
+ */
+FAT_FILE * mini_dir_find(const FAT_FILESYSTEM *fs, const char *dirname) {
+	const char * rest = dirname;
+	while (*rest == '/') rest++;
+	if (*rest == 0) {
+		return fs->root;
+	}
+	FAT_FILE * directory = mini_file_find(fs, dirname);
+	if (directory == NULL || !directory->is_directory) {
+		return NULL;
+	}
+	return directory;
+}
+
+/**
+ * Fill the sorted entries of every directory. Mount only counts them, so
+ * that filesystems never listed do not pay for sorting the names; from now
+ * on mini_file_link and mini_file_delete_entry keep them up to date.
+ */
+void mini_dir_list_all(FAT_FILESYSTEM *fs) {
+	if (fs->directories_listed) return;
+	for (long unsigned int i = 0; i < fs->files.size(); i++) {
+		fs->files[i]->parent->children.insert(fs->files[i]);
+	}
+	fs->directories_listed = true;
+}
+
+/**
+ * Create an empty directory. The directories above it must exist.
+ * @return true on success, false if the path exists or cannot be created.
+ */
+bool mini_dir_create(FAT_FILESYSTEM *fs, const char *dirname) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_DIR_CREATE);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	if (mini_file_find(fs, dirname) != NULL) {
+		fprintf(stderr, "Cannot create directory '%s': it exists.\n", dirname);
+		return false;
+	}
+	return mini_file_create_file(fs, dirname, true) != NULL;
+}
+
+/**
+ * Delete an empty directory that is not open.
+ * @return true on success
+ */
+bool mini_dir_delete(FAT_FILESYSTEM *fs, const char *dirname) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_DIR_DELETE);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	FAT_FILE * directory = mini_dir_find(fs, dirname);
+	if (directory == NULL || directory == fs->root) {
+		fprintf(stderr, "Cannot delete directory '%s': no such directory.\n", dirname);
+		return false;
+	}
+	if (directory->child_count > 0) {
+		fprintf(stderr, "Cannot delete directory '%s': it is not empty.\n", dirname);
+		return false;
+	}
+	if (directory->open_dirs > 0) {
+		fprintf(stderr, "Cannot delete directory '%s': it is open.\n", dirname);
+		return false;
+	}
+	return mini_file_delete_entry(fs, directory);
+}
+
+/**
+ * Open a directory to list it with mini_dir_read.
+ * @return the handle, to release with mini_dir_close; NULL if there is no
+ *         such directory.
+ */
+FAT_DIR * mini_dir_open(FAT_FILESYSTEM *fs, const char *dirname) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_DIR_OPEN);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	FAT_FILE * directory = mini_dir_find(fs, dirname);
+	if (directory == NULL) {
+		return NULL;
+	}
+	mini_dir_list_all(fs);
+	FAT_DIR * dir = new FAT_DIR;
+	dir->directory = directory;
+	dir->last_name[0] = 0;
+	directory->open_dirs++;
+	return dir;
+}
+
+/**
+ * Read the next entry of an open directory, in name order.
+ * @return false when every entry has been read.
+ */
+bool mini_dir_read(FAT_FILESYSTEM *fs, FAT_DIR *dir, FAT_DIR_ENTRY *entry) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_DIR_READ);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	//Names are never empty, so "" sorts before all of them
+	std::set<FAT_FILE*, FAT_NAME_ORDER>::const_iterator next = dir->directory->children.upper_bound(dir->last_name);
+	if (next == dir->directory->children.end()) {
+		return false;
+	}
+	strcpy(entry->name, (*next)->name.c_str());
+	entry->is_directory = (*next)->is_directory;
+	strcpy(dir->last_name, (*next)->name.c_str());
+	return true;
+}
+
+/**
+ * Release a handle returned by mini_dir_open.
+ * @return true on success
+ */
+bool mini_dir_close(FAT_FILESYSTEM *fs, FAT_DIR *dir) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_DIR_CLOSE);
+	if (dir == NULL) {
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(fs->lock);
+	dir->directory->open_dirs--;
+	delete dir;
+	return true;
+}
@@ -0,0 +1,40 @@
+#ifndef FAT_DIR_H
+#define FAT_DIR_H
+
+#include "fat.h"
+#include "fat_file.h"
+
+// Directories are FAT_FILEs with is_directory set: an inode (size 0, no
+// extents) and a name index record like a file. Paths are resolved one
+// component at a time through the name index, which is keyed by directory and
+// name, so a lookup costs the same in a directory of 10 or 100000 entries and
+// reads no block. For mini_dir_read each directory also keeps its entries
+// sorted by name (FAT_FILE::children), built by the first mini_dir_open.
+
+// One entry returned by mini_dir_read.
+typedef struct t_FAT_DIR_ENTRY {
+	char name[MAX_FILENAME_LENGTH];
+	bool is_directory;
+} FAT_DIR_ENTRY;
+
+// An open directory. Entries are returned in name order; each read resumes
+// after the last name returned, so entries created or deleted meanwhile are
+// seen or skipped but none is returned twice.
+typedef struct t_FAT_DIR {
+	FAT_FILE * directory;
+	char last_name[MAX_FILENAME_LENGTH]; // Last name returned, empty before the first read.
+} FAT_DIR;
+
+
+/// Public APIs
+bool mini_dir_create(FAT_FILESYSTEM *fs, const char *dirname);
+bool mini_dir_delete(FAT_FILESYSTEM *fs, const char *dirname);
+FAT_DIR * mini_dir_open(FAT_FILESYSTEM *fs, const char *dirname);
+bool mini_dir_read(FAT_FILESYSTEM *fs, FAT_DIR *dir, FAT_DIR_ENTRY *entry);
+bool mini_dir_close(FAT_FILESYSTEM *fs, FAT_DIR *dir);
+
+// Helpers:
+FAT_FILE * mini_dir_find(const FAT_FILESYSTEM *fs, const char *dirname);
+void mini_dir_list_all(FAT_FILESYSTEM *fs);
+
+#endif // FAT_DIR_H
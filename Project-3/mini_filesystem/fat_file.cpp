@@ -1,10 +1,15 @@
 #include "fat.h"
 #include "fat_file.h"
+#include "fat_format.h"
+#include "fat_names.h"
+#include "fat_journal.h"
+#include "fat_async.h"
 #include <cassert>
 #include <cstdarg>
 #include <cstring>
 #include <cstdio>
 #include <math.h>
+#include <fcntl.h>
 
 // Little helper to show debug messages. Set 1 to 0 to silence.
 #define DEBUG 1
@@ -37,332 +42,1722 @@ static bool vector_delete_value(std::vector<T> &vector, const T var) {
 
 void mini_file_dump(const FAT_FILESYSTEM *fs, const FAT_FILE *file)
 {
-	printf("Filename: %s\tFilesize: %d\tBlock count: %d\n", file->name, file->size, (int)file->block_ids.size());
-	printf("\tMetadata block: %d\n", file->metadata_block_id);
-	printf("\tBlock list: ");
-	for (long unsigned int i=0; i<file->block_ids.size(); ++i) { //Changed the template code to get rid of warning (int to long int)
-		printf("%d ", file->block_ids[i]);
+	mini_file_load_entry((FAT_FILESYSTEM*)fs, (FAT_FILE*)file);
+	printf("Filename: %s\tFilesize: %lld\tBlock count: %d\n", file->name.c_str(), (long long)file->size, file->block_count);
+	printf("\tInode: %d (block %d)\n", file->inode, mini_inode_block(fs, file->inode));
+	if (file->is_inline) {
+		printf("\tData: inline in the inode\n");
+	} else {
+		printf("\tExtents (start+length): ");
+		for (long unsigned int i=0; i<file->extents.size(); ++i) {
+			printf("%d+%d ", file->extents[i].start, file->extents[i].length);
+		}
+		printf("\n");
 	}
-	printf("\n");
 
 	printf("\tOpen handles: \n");
 	for (long unsigned int i=0; i<file->open_handles.size(); ++i) { //Changed the template code to get rid of warning (int to long int)
-		printf("\t\t%ld) Position: %d (Block %d, Byte %d), Is Write: %d\n", i,
-			file->open_handles[i]->position,
+		printf("\t\t%ld) Position: %lld (Block %d, Byte %d), Is Write: %d\n", i,
+			(long long)file->open_handles[i]->position,
 			position_to_block_index(fs, file->open_handles[i]->position),
 			position_to_byte_index(fs, file->open_handles[i]->position),
 			file->open_handles[i]->is_write);
 	}
 }
 
-
+
+// Marks a deleted slot of the name index, so probing continues past it.
+static char name_index_tombstone;
+#define NAME_INDEX_TOMBSTONE ((FAT_FILE*)&name_index_tombstone)
+
+// FNV-1a hash of a name inside a directory, seeded with the directory's inode.
+static uint32_t name_hash(const FAT_FILE *directory, const char *name)
+{
+	uint32_t hash = (2166136261u ^ (uint32_t)directory->inode) * 16777619u;
+	for (const unsigned char *c = (const unsigned char*)name; *c; ++c) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Rebuild the name index with at least capacity slots, dropping tombstones.
+static void name_index_resize(FAT_FILESYSTEM *fs, long unsigned int capacity)
+{
+	long unsigned int slots = 16;
+	while (slots < capacity) slots *= 2;
+	fs->name_index.assign(slots, NULL);
+	fs->name_index_used = 0;
+	for (long unsigned int i=0; i<fs->files.size(); ++i) {
+		mini_file_index_insert(fs, fs->files[i]);
+	}
+}
+
+/**
+ * Rebuild the name index from fs->files in one pass, sized for all of them
+ * (mount, once every file is linked to its directory).
+ */
+void mini_file_index_rebuild(FAT_FILESYSTEM *fs)
+{
+	name_index_resize(fs, fs->files.size() * 2);
+}
+
+/**
+ * Add a file to the open-addressing name index (linear probing).
+ * The table is kept at most 3/4 full, counting tombstones.
+ */
+void mini_file_index_insert(FAT_FILESYSTEM *fs, FAT_FILE *file)
+{
+	if ((fs->name_index_used + 1) * 4 > fs->name_index.size() * 3) {
+		name_index_resize(fs, fs->files.size() * 2);
+		if (mini_file_lookup(fs, file->parent, file->name.c_str()) == file) return; // Already re-inserted from fs->files.
+	}
+	long unsigned int mask = fs->name_index.size() - 1;
+	long unsigned int slot = name_hash(file->parent, file->name.c_str()) & mask;
+	while (fs->name_index[slot] != NULL && fs->name_index[slot] != NAME_INDEX_TOMBSTONE) {
+		slot = (slot + 1) & mask;
+	}
+	if (fs->name_index[slot] == NULL) {
+		fs->name_index_used++;
+	}
+	fs->name_index[slot] = file;
+}
+
+/**
+ * Remove a file from the name index, leaving a tombstone in its slot.
+ */
+void mini_file_index_remove(FAT_FILESYSTEM *fs, const FAT_FILE *file)
+{
+	if (fs->name_index.empty()) return;
+	long unsigned int mask = fs->name_index.size() - 1;
+	long unsigned int slot = name_hash(file->parent, file->name.c_str()) & mask;
+	while (fs->name_index[slot] != NULL) {
+		if (fs->name_index[slot] == file) {
+			fs->name_index[slot] = NAME_INDEX_TOMBSTONE;
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+}
+
+/**
+ * Find the file or directory called name (one path component) in a
+ * directory, or return NULL.
+ */
+FAT_FILE * mini_file_lookup(const FAT_FILESYSTEM *fs, const FAT_FILE *directory, const char *name)
+{
+	if (fs->name_index.empty()) return NULL;
+	long unsigned int mask = fs->name_index.size() - 1;
+	long unsigned int slot = name_hash(directory, name) & mask;
+	while (fs->name_index[slot] != NULL) {
+		FAT_FILE *file = fs->name_index[slot];
+		if (file != NAME_INDEX_TOMBSTONE && file->parent == directory && strcmp(file->name.c_str(), name) == 0) // Match
+			return file;
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+/**
+ * Resolve every component of a path but the last one. Components are
+ * separated by '/'; leading, trailing and repeated slashes are ignored, so
+ * "a.txt" and "/a.txt" are both in the root directory.
+ * @param  name receives the last component, MAX_FILENAME_LENGTH bytes
+ * @return the directory that should hold the last component, NULL if a
+ *         directory on the way does not exist or the path has no component.
+ */
+FAT_FILE * mini_file_find_parent(const FAT_FILESYSTEM *fs, const char *filename, char *name)
+{
+	FAT_FILE * directory = fs->root;
+	const char * c = filename;
+	while (*c == '/') c++;
+	while (true) {
+		int length = 0;
+		while (*c != '/' && *c != 0) {
+			if (length == MAX_FILENAME_LENGTH - 1) {
+				return NULL;
+			}
+			name[length++] = *c++;
+		}
+		name[length] = 0;
+		if (length == 0) {
+			return NULL;
+		}
+		while (*c == '/') c++;
+		if (*c == 0) {
+			return directory;
+		}
+		directory = mini_file_lookup(fs, directory, name);
+		if (directory == NULL || !directory->is_directory) {
+			return NULL;
+		}
+	}
+}
+
+/**
+ * Find a file or directory by path in loaded filesystem, or return NULL.
+ */
+FAT_FILE * mini_file_find(const FAT_FILESYSTEM *fs, const char *filename)
+{
+	char name[MAX_FILENAME_LENGTH];
+	FAT_FILE * directory = mini_file_find_parent(fs, filename, name);
+	return directory == NULL ? NULL : mini_file_lookup(fs, directory, name);
+}
+
+/**
+ * Make file an entry of the directory parent.
+ */
+void mini_file_link(FAT_FILESYSTEM *fs, FAT_FILE *parent, FAT_FILE *file)
+{
+	file->parent = parent;
+	parent->child_count++;
+	if (fs->directories_listed) {
+		parent->children.insert(file);
+	}
+}
+
+/**
+ * Create a FAT_FILE struct and set its name.
+ */
+FAT_FILE * mini_file_create(const char * filename)
+{
+	FAT_FILE * file = new FAT_FILE;
+	file->size = 0;
+	file->written_end = 0;
+	file->block_count = 0;
+	file->is_inline = false;
+	file->dirty = false;
+	file->dirty_index = 0;
+	file->dirty_indirect_blocks = 0;
+	file->loaded = true;
+	file->name_block = NULL;
+	file->files_index = 0;
+	file->parent = NULL;
+	file->is_directory = false;
+	file->child_count = 0;
+	file->open_dirs = 0;
+	file->generation = 0;
+	file->buffered_count = 0;
+	file->name = filename;
+	return file;
+}
+
+/**
+ * Queue the file's inode to be written by the next mini_fat_sync, and count
+ * what that checkpoint will log for it (see mini_journal_fits): its inode
+ * table, and its INDIRECT_BLOCKs with the block map blocks changed when they
+ * are allocated or freed. Called again after each change of the extents.
+ */
+void mini_file_mark_dirty(FAT_FILESYSTEM *fs, FAT_FILE *file)
+{
+	int indirect = 2 * std::max(mini_file_indirect_count(fs, file), (int)file->indirect_blocks.size());
+	if (!file->dirty) {
+		file->dirty = true;
+		file->dirty_indirect_blocks = 0;
+		file->dirty_index = fs->dirty_files.size();
+		fs->dirty_files.push_back(file);
+		FAT_INODE_TABLE * table = mini_inode_table(fs, file->inode);
+		if (table != NULL && !table->dirty) {
+			table->dirty = true;
+			fs->dirty_inode_tables.push_back(table->block_id);
+		}
+	}
+	if (indirect > file->dirty_indirect_blocks) {
+		fs->dirty_indirect_blocks += indirect - file->dirty_indirect_blocks;
+		file->dirty_indirect_blocks = indirect;
+	}
+}
+
+/**
+ * INDIRECT_BLOCKs needed for the extents that do not fit in the inode.
+ */
+int mini_file_indirect_count(const FAT_FILESYSTEM *fs, const FAT_FILE *file)
+{
+	int extra = (int)file->extents.size() - INODE_EXTENTS;
+	int per_block = (fs->block_size - INDIRECT_HEADER) / FILE_EXTENT_SIZE;
+	return extra <= 0 || file->is_inline ? 0 : (extra + per_block - 1) / per_block;
+}
+
+/**
+ * Allocate or free INDIRECT_BLOCKs until the file has as many as its extents
+ * need (mini_fat_sync, before it packs the inodes). Takes empty blocks as
+ * they are: the running checkpoint is the one that would free more.
+ * @return false if the filesystem is full.
+ */
+bool mini_file_fit_indirect(FAT_FILESYSTEM *fs, FAT_FILE *file)
+{
+	int needed = mini_file_indirect_count(fs, file);
+	while ((int)file->indirect_blocks.size() > needed) {
+		mini_fat_set_block_type(fs, file->indirect_blocks.back(), EMPTY_BLOCK);
+		file->indirect_blocks.pop_back();
+	}
+	while ((int)file->indirect_blocks.size() < needed) {
+		int block = mini_fat_find_empty_block(fs);
+		if (block == -1) {
+			fprintf(stderr, "Cannot store the extents of '%s': filesystem is full.\n", file->name.c_str());
+			return false;
+		}
+		mini_fat_set_block_type(fs, block, INDIRECT_BLOCK);
+		file->indirect_blocks.push_back(block);
+	}
+	return true;
+}
+
+static void mini_file_pack_extents(const FAT_FILE *file, const int first, const int count, unsigned char *extent)
+{
+	for (int i=first; i<first + count; ++i) {
+		put_u32(extent, file->extents[i].file_block);
+		put_u32(extent + 4, file->extents[i].start);
+		put_u32(extent + 8, file->extents[i].length);
+		extent += FILE_EXTENT_SIZE;
+	}
+}
+
+/**
+ * Serialize the file's inode (size, flags, the first extents or the inline
+ * data) into its slot of an inode table image, in the layout of fat_format.h.
+ * @param  inode INODE_SIZE bytes
+ * @return       false if file->indirect_blocks cannot hold the other extents.
+ */
+bool mini_file_pack_entry(const FAT_FILESYSTEM *fs, const FAT_FILE *file, unsigned char *inode)
+{
+	if ((int)file->indirect_blocks.size() != mini_file_indirect_count(fs, file)) {
+		fprintf(stderr, "File '%s' has no room for its extents.\n", file->name.c_str());
+		return false;
+	}
+	memset(inode, 0, INODE_SIZE);
+	put_u32(inode + IN_MAGIC, FAT_INODE_MAGIC);
+	put_u64(inode + IN_SIZE, file->size);
+	put_u32(inode + IN_EXTENT_COUNT, file->extents.size());
+	put_u16(inode + IN_FLAGS, file->is_inline ? IN_INLINE_DATA : 0);
+	put_u32(inode + IN_INDIRECT, file->indirect_blocks.empty() ? 0 : file->indirect_blocks[0]);
+	if (file->is_inline) {
+		if (!file->inline_data.empty()) {
+			memcpy(inode + IN_DATA, file->inline_data.data(), file->inline_data.size());
+		}
+		return true;
+	}
+	mini_file_pack_extents(file, 0, std::min((int)file->extents.size(), INODE_EXTENTS), inode + IN_DATA);
+	return true;
+}
+
+/**
+ * Serialize the index-th INDIRECT_BLOCK of the file: the next one and its
+ * share of the extents past the inode.
+ * @param block block_size bytes
+ */
+void mini_file_pack_indirect(const FAT_FILESYSTEM *fs, const FAT_FILE *file, const int index, unsigned char *block)
+{
+	int per_block = (fs->block_size - INDIRECT_HEADER) / FILE_EXTENT_SIZE;
+	int first = INODE_EXTENTS + index * per_block;
+	int count = std::min((int)file->extents.size() - first, per_block);
+	memset(block, 0, fs->block_size);
+	put_u32(block + IB_NEXT, index + 1 < (int)file->indirect_blocks.size() ? file->indirect_blocks[index + 1] : 0);
+	put_u32(block + IB_EXTENT_COUNT, count);
+	mini_file_pack_extents(file, first, count, block + INDIRECT_HEADER);
+}
+
+/**
+ * Append count serialized extents to the file.
+ * @return false if they are not sorted, overlap or are empty.
+ */
+static bool mini_file_unpack_extents(FAT_FILE *file, const unsigned char *extent_data, const int count)
+{
+	int next_file_block = file->extents.empty() ? 0 : file->extents.back().file_block + file->extents.back().length;
+	for (int i=0; i<count; ++i) {
+		FAT_EXTENT extent;
+		extent.file_block = get_u32(extent_data);
+		extent.start = get_u32(extent_data + 4);
+		extent.length = get_u32(extent_data + 8);
+		//Sorted and not overlapping, holes in between
+		if (extent.file_block < next_file_block || extent.length <= 0) {
+			return false;
+		}
+		next_file_block = extent.file_block + extent.length;
+		file->extents.push_back(extent);
+		file->block_count += extent.length;
+		extent_data += FILE_EXTENT_SIZE;
+	}
+	return true;
+}
+
+/**
+ * Fill a FAT_FILE from an inode written by mini_file_pack_entry, reading the
+ * INDIRECT_BLOCK chain for the extents that did not fit.
+ * @return false if the inode or the chain is not valid.
+ */
+bool mini_file_unpack_entry(FAT_FILESYSTEM *fs, FAT_FILE *file, const unsigned char *inode)
+{
+	if (get_u32(inode + IN_MAGIC) != FAT_INODE_MAGIC) return false;
+	int extent_count = get_u32(inode + IN_EXTENT_COUNT);
+	if (extent_count < 0) return false;
+	file->size = get_u64(inode + IN_SIZE);
+	file->written_end = file->size;
+	file->extents.clear();
+	file->indirect_blocks.clear();
+	file->block_count = 0;
+	file->is_inline = (get_u16(inode + IN_FLAGS) & IN_INLINE_DATA) != 0;
+	file->inline_data.clear();
+	if (file->is_inline) {
+		if (extent_count != 0 || file->size < 0 || file->size > INODE_INLINE_BYTES) {
+			return false;
+		}
+		file->inline_data.assign(inode + IN_DATA, inode + IN_DATA + file->size);
+		return true;
+	}
+	if (!mini_file_unpack_extents(file, inode + IN_DATA, std::min(extent_count, INODE_EXTENTS))) {
+		return false;
+	}
+	int next = get_u32(inode + IN_INDIRECT);
+	std::vector<unsigned char> block(fs->block_size);
+	while ((int)file->extents.size() < extent_count) {
+		if (next <= 0 || next >= fs->block_count || fs->block_map[next] != INDIRECT_BLOCK
+			|| mini_fat_read_in_block(fs, next, 0, fs->block_size, block.data()) != fs->block_size) {
+			return false;
+		}
+		int count = get_u32(block.data() + IB_EXTENT_COUNT);
+		if (count <= 0 || count > extent_count - (int)file->extents.size()
+			|| INDIRECT_HEADER + (long)count * FILE_EXTENT_SIZE > fs->block_size
+			|| !mini_file_unpack_extents(file, block.data() + INDIRECT_HEADER, count)) {
+			return false;
+		}
+		file->indirect_blocks.push_back(next);
+		next = get_u32(block.data() + IB_NEXT);
+	}
+	return next == 0 && (int)file->indirect_blocks.size() == mini_file_indirect_count(fs, file);
+}
+
+/**
+ * Read the inode of a file known only by name and inode (after
+ * mini_fat_load), filling its size and extents. Does nothing if it is loaded.
+ * @return false if the inode cannot be read or is not valid.
+ */
+bool mini_file_load_entry(FAT_FILESYSTEM *fs, FAT_FILE *file)
+{
+	if (file->loaded) return true;
+	unsigned char inode[INODE_SIZE];
+	if (mini_fat_read_in_block(fs, mini_inode_block(fs, file->inode), mini_inode_offset(fs, file->inode), INODE_SIZE, inode) != INODE_SIZE
+		|| !mini_file_unpack_entry(fs, file, inode)) {
+		fprintf(stderr, "Inode %d of file '%s' is not valid.\n", file->inode, file->name.c_str());
+		return false;
+	}
+	file->loaded = true;
+	return true;
+}
+
+/**
+ * Index of the last extent starting at or before file_block, -1 if none.
+ */
+static int mini_file_extent_before(const FAT_FILE *file, const int file_block)
+{
+	int low = 0, high = (int)file->extents.size() - 1, found = -1;
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		if (file->extents[middle].file_block <= file_block) {
+			found = middle;
+			low = middle + 1;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return found;
+}
+
+/**
+ * Map a block index inside the file to its block on disk.
+ * @return disk block index, or -1 if the file has no such block (a hole).
+ */
+int mini_file_block_at(const FAT_FILE *file, const int file_block)
+{
+	int found = mini_file_extent_before(file, file_block);
+	if (found == -1) return -1;
+	const FAT_EXTENT &extent = file->extents[found];
+	if (file_block >= extent.file_block + extent.length) return -1;
+	return extent.start + (file_block - extent.file_block);
+}
+
+/**
+ * Map the file block file_block, which must be a hole, to the disk block
+ * block. An extent ending right before it in the file and on disk grows
+ * (and is merged with the next one when block closes the gap), otherwise
+ * block starts a new extent.
+ */
+void mini_file_add_block(FAT_FILESYSTEM *fs, FAT_FILE *file, const int file_block, const int block)
+{
+	int before = mini_file_extent_before(file, file_block);
+	std::vector<FAT_EXTENT> &extents = file->extents;
+	if (before != -1 && extents[before].file_block + extents[before].length == file_block
+		&& extents[before].start + extents[before].length == block) {
+		extents[before].length++;
+	} else {
+		FAT_EXTENT extent;
+		extent.file_block = file_block;
+		extent.start = block;
+		extent.length = 1;
+		extents.insert(extents.begin() + before + 1, extent);
+		before++;
+	}
+	//Filling the hole between two extents joins them
+	if (before + 1 < (int)extents.size() && extents[before].file_block + extents[before].length == extents[before + 1].file_block
+		&& extents[before].start + extents[before].length == extents[before + 1].start) {
+		extents[before].length += extents[before + 1].length;
+		extents.erase(extents.begin() + before + 1);
+	}
+	file->block_count++;
+	mini_file_mark_dirty(fs, file);
+}
+
+/**
+ * The disk block that would extend the extent before file_block up to it,
+ * -1 if no extent starts before it.
+ */
+static int mini_file_preferred_block(const FAT_FILE *file, const int file_block)
+{
+	int before = mini_file_extent_before(file, file_block);
+	if (before == -1) {
+		return -1;
+	}
+	const FAT_EXTENT &extent = file->extents[before];
+	return extent.start + (file_block - extent.file_block);
+}
+
+/**
+ * Free the data blocks of the file from file block first on, trimming or
+ * dropping the extents holding them. The caller holds fs->lock.
+ */
+void mini_file_remove_blocks(FAT_FILESYSTEM *fs, FAT_FILE *file, const int first)
+{
+	while (!file->extents.empty()) {
+		FAT_EXTENT &extent = file->extents.back();
+		if (extent.file_block + extent.length <= first) {
+			break;
+		}
+		int keep = first > extent.file_block ? first - extent.file_block : 0;
+		for (int i = keep; i < extent.length; i++) {
+			mini_fat_set_block_type(fs, extent.start + i, EMPTY_BLOCK);
+		}
+		file->block_count -= extent.length - keep;
+		if (keep == 0) {
+			file->extents.pop_back();
+		} else {
+			extent.length = keep;
+		}
+	}
+	mini_file_mark_dirty(fs, file);
+}
+
+/**
+ * Metadata blocks mini_file_remove_blocks(fs, file, first) may dirty: the
+ * block map and the superblock.
+ */
+static int mini_file_remove_cost(const FAT_FILESYSTEM *fs, const FAT_FILE *file, const int first)
+{
+	int metadata_blocks = 4;
+	for (long unsigned int i = 0; i < file->extents.size() && metadata_blocks < fs->metadata_blocks; i++) {
+		if (file->extents[i].file_block + file->extents[i].length > first) {
+			metadata_blocks += file->extents[i].length / (2 * fs->block_size) + 2;
+		}
+	}
+	return metadata_blocks;
+}
+
+/**
+ * Metadata blocks allocating blocks data blocks for a file may dirty: a
+ * block of the block map each at most, its indirect blocks, its inode table
+ * and the superblock.
+ */
+static int mini_file_allocate_cost(const FAT_FILESYSTEM *fs, const int blocks)
+{
+	int block_map = blocks < fs->metadata_blocks ? blocks : fs->metadata_blocks;
+	return block_map + blocks / ((fs->block_size - INDIRECT_HEADER) / FILE_EXTENT_SIZE) + 4;
+}
+
+/**
+ * The file block past the last data block of the file.
+ */
+static int mini_file_end_block(const FAT_FILE *file)
+{
+	return file->extents.empty() ? 0 : file->extents.back().file_block + file->extents.back().length;
+}
+
+/**
+ * Allocate a data block for the file block file_block, which must be a hole.
+ * The disk block following the extent before it is preferred, so appends and
+ * writes just past a run of blocks grow that extent.
+ * @return disk block index, or -1 if the filesystem is full.
+ */
+int mini_file_allocate_block(FAT_FILESYSTEM *fs, FAT_FILE *file, const int file_block)
+{
+	int block = mini_fat_allocate_block_near(fs, FILE_DATA_BLOCK, mini_file_preferred_block(file, file_block));
+	if (block == -1) {
+		return -1;
+	}
+	mini_file_add_block(fs, file, file_block, block);
+	mini_journal_log_blocks(fs, file, file_block, block);
+	return block;
+}
+
+/**
+ * Attach a new, empty file or directory called name with the given (already
+ * allocated) inode to the directory parent.
+ * @param  name_block name index segment block to record it in (journal
+ *                    replay), or -1 for the current last segment.
+ * @return the file, NULL if its name cannot be indexed.
+ */
+FAT_FILE * mini_file_create_entry(FAT_FILESYSTEM *fs, FAT_FILE *parent, const char *name, const bool is_directory,
+	const int inode, const int name_block)
+{
+	FAT_FILE *fd = mini_file_create(name);
+	fd->inode = inode;
+	fd->parent = parent;
+	fd->is_directory = is_directory;
+	fd->is_inline = !is_directory; // Files start empty in their inode.
+	bool indexed = name_block == -1 ? mini_names_add(fs, fd) : mini_names_add_at(fs, fd, name_block);
+	if (!indexed) {
+		delete fd;
+		return NULL;
+	}
+	mini_file_link(fs, parent, fd);
+	fd->files_index = fs->files.size();
+	fs->files.push_back(fd); // Add to filesystem.
+	mini_file_index_insert(fs, fd);
+	mini_file_mark_dirty(fs, fd);
+	mini_fat_mark_metadata_dirty(fs, 0); // File count in the superblock.
+	return fd;
+}
+
+/**
+ * Create a file (or a directory) at a path that does not exist yet and
+ * attach it to filesystem. The directories on the path must exist.
+ * @return FAT_OPEN_FILE pointer on success, NULL on failure
+ */
+FAT_FILE * mini_file_create_file(FAT_FILESYSTEM *fs, const char *filename, const bool is_directory)
+{
+	char name[MAX_FILENAME_LENGTH];
+	FAT_FILE *parent = mini_file_find_parent(fs, filename, name);
+	if (parent == NULL) {
+		fprintf(stderr, "Cannot create '%s': no such directory or name too long.\n", filename);
+		return NULL;
+	}
+	if (!mini_journal_reserve(fs, 0, JR_CREATE_HEADER + MAX_FILENAME_LENGTH) || !mini_fat_reclaim_freed(fs)) {
+		return NULL;
+	}
+
+	int inode = mini_inode_allocate(fs);
+	if (inode == -1)
+	{
+		fprintf(stderr, "Cannot create new file '%s': filesystem is full.\n", filename);
+		return NULL;
+	}
+	FAT_FILE *fd = mini_file_create_entry(fs, parent, name, is_directory, inode, -1);
+	if (fd == NULL) {
+		fprintf(stderr, "Cannot create new file '%s': filesystem is full.\n", filename);
+		mini_inode_release(fs, inode);
+		return NULL;
+	}
+	mini_journal_log_create(fs, fd);
+	return fd;
+}
+
+/**
+ * Return filesize of a file.
+ * @param  fs       filesystem
+ * @param  filename name of file
+ * @return          file size in bytes, or zero if file does not exist.
+ */
+int64_t mini_file_size(FAT_FILESYSTEM *fs, const char *filename) {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_SIZE);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	FAT_FILE * fd = mini_file_find(fs, filename);
+	if (!fd || !mini_file_load_entry(fs, fd)) {
+		fprintf(stderr, "File '%s' does not exist.\n", filename);
+		return 0;
+	}
+	return fd->size;
+}
+
+
+/**
+ * Opens a file in filesystem.
+ * If the file does not exist, returns NULL, unless it is write mode, where
+ * the file is created.
+ * Adds the opened file to file's open handles.
+ * @param  is_write whether it is opened in write (append) mode or read.
+ * @return FAT_OPEN_FILE pointer on success, NULL on failure
+ */
+FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const bool is_write)
+{
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_OPEN);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	FAT_FILE * fd = mini_file_find(fs, filename);
+	if (!fd) {
+		//Check if it's write mode, and if so create it. Otherwise return NULL.
+		if(is_write) {
+			if((fd =mini_file_create_file(fs, filename)));
+			else return NULL;
+		}
+		else {
+			return NULL;
+		}
+	}
+	if (fd->is_directory) {
+		fprintf(stderr, "Cannot open '%s': it is a directory.\n", filename);
+		return NULL;
+	}
+	if (!mini_file_load_entry(fs, fd)) {
+		return NULL;
+	}
+	if (is_write) {
+		//Check if other write handles are open.
+		for(long unsigned int i = 0; i < fd->open_handles.size(); i++) {
+			if(fd->open_handles[i]->is_write) {
+				return NULL;
+			}
+		}
+	}
+	//Create new open handle
+	FAT_OPEN_FILE * open_file = new FAT_OPEN_FILE;
+
+	//Assign open_file fields.	
+	open_file->file = fd;
+	open_file->position = 0;
+	open_file->is_write = is_write;
+	open_file->next_position = 0;
+	open_file->readahead_blocks = 0;
+	open_file->readahead_position = 0;
+	open_file->readahead_generation = 0;
+	open_file->write_block = -1;
+	open_file->write_start = 0;
+	open_file->write_end = 0;
+	open_file->write_fresh = false;
+
+	//Add to list of open handles for fd:
+	fd->open_handles.push_back(open_file);
+	return open_file;
+}
+
+/**
+ * Close an existing open file handle.
+ * @return false on failure (no open file handle), true on success.
+ */
+bool mini_file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file)
+{
+	if (open_file == NULL) return false;
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_CLOSE);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	FAT_FILE * fd = open_file->file;
+	if (vector_delete_value(fd->open_handles, open_file)) {
+		return mini_file_flush_handle(fs, (FAT_OPEN_FILE*)open_file);
+	}
+
+	fprintf(stderr, "Attempting to close file that is not open.\n");
+	return false;
+}
+
+/**
+ * Write the bytes buffered in a write handle to the disk.
+ * @return false if they could not all be written.
+ */
+bool mini_file_flush(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file)
+{
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_FLUSH);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	return mini_file_flush_handle(fs, open_file);
+}
+
+/**
+ * mini_file_flush for callers holding fs->lock, which guards the buffers.
+ */
+bool mini_file_flush_handle(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file)
+{
+	if (open_file->write_block == -1) {
+		return true;
+	}
+	int end = open_file->write_fresh ? fs->block_size : open_file->write_end;
+	int length = end - open_file->write_start;
+	int written = mini_fat_write_in_block(fs, open_file->write_block, open_file->write_start, length,
+		&open_file->write_data[open_file->write_start]);
+	open_file->write_block = -1;
+	open_file->file->buffered_count--;
+	vector_delete_value(fs->buffered_handles, open_file);
+	return written == length;
+}
+
+/**
+ * Flush the write buffers of every handle, before a sync or unmount.
+ */
+bool mini_file_flush_buffers(FAT_FILESYSTEM *fs)
+{
+	bool flushed = true;
+	while (!fs->buffered_handles.empty()) {
+		flushed = mini_file_flush_handle(fs, fs->buffered_handles.back()) && flushed;
+	}
+	return flushed;
+}
+
+/**
+ * Flush the write buffers of the handles on the file other than except, so
+ * a read sees them and a later flush cannot overwrite newer data.
+ */
+static void mini_file_flush_file(FAT_FILESYSTEM *fs, const FAT_FILE * fd, const FAT_OPEN_FILE * except)
+{
+	if (fd->buffered_count == 0) return;
+	for (long unsigned int i = 0; i < fd->open_handles.size(); i++) {
+		if (fd->open_handles[i] != except) {
+			mini_file_flush_handle(fs, (FAT_OPEN_FILE*)fd->open_handles[i]);
+		}
+	}
+}
+
+/**
+ * Keep a write of part of a block in the handle's buffer. Writes touching the
+ * buffered range are merged, others flush it first; the buffer is flushed
+ * as soon as it reaches the end of the block.
+ * @param  fresh  block was just allocated: the rest of it is zeroed by the
+ *                flush, with no extra write.
+ * @return false if a flush failed.
+ */
+static bool mini_file_buffer_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int block, const int block_offset,
+	const int size, const char * buffer, const bool fresh)
+{
+	if (open_file->write_block != -1 && (open_file->write_block != block
+		|| block_offset > open_file->write_end || block_offset + size < open_file->write_start)) {
+		if (!mini_file_flush_handle(fs, open_file)) {
+			return false;
+		}
+	}
+	if (open_file->write_block == -1) {
+		open_file->write_data.resize(fs->block_size);
+		open_file->write_block = block;
+		open_file->write_start = fresh ? 0 : block_offset;
+		open_file->write_end = block_offset + size;
+		open_file->write_fresh = fresh;
+		if (fresh) {
+			memset(open_file->write_data.data(), 0, fs->block_size);
+		}
+		open_file->file->buffered_count++;
+		fs->buffered_handles.push_back(open_file);
+	}
+	memcpy(&open_file->write_data[block_offset], buffer, size);
+	if (block_offset < open_file->write_start) {
+		open_file->write_start = block_offset;
+	}
+	if (block_offset + size > open_file->write_end) {
+		open_file->write_end = block_offset + size;
+	}
+	if (open_file->write_end == fs->block_size) {
+		return mini_file_flush_handle(fs, open_file);
+	}
+	return true;
+}
+
+/**
+ * Zero the bytes around [block_offset, block_offset + size) of a block just
+ * allocated for a write covering only that range, so the rest (a hole inside
+ * the block, or bytes past the end of the file that a later write may bring
+ * inside it) reads as zeros and not as the data of a deleted file.
+ * @return true on success
+ */
+static bool mini_file_zero_around(FAT_FILESYSTEM *fs, const int block, const int block_offset, const int size)
+{
+	int end = block_offset + size;
+	std::vector<char> zeros(block_offset > fs->block_size - end ? block_offset : fs->block_size - end, 0);
+	if (block_offset > 0 && mini_fat_write_in_block(fs, block, 0, block_offset, zeros.data()) != block_offset) {
+		return false;
+	}
+	return end == fs->block_size || mini_fat_write_in_block(fs, block, end, fs->block_size - end, zeros.data()) == fs->block_size - end;
+}
+
+/**
+ * Zero the reserved blocks (past written_end) that the range [written_end,
+ * end) brings inside the file, e.g. skipped by a write past the end. The
+ * block holding written_end needs nothing: past the written bytes it is zero
+ * already (see mini_file_zero_around). The caller holds the file lock
+ * exclusively.
+ * @return true on success
+ */
+static bool mini_file_zero_reserved(FAT_FILESYSTEM *fs, const FAT_FILE *fd, const int64_t end)
+{
+	int64_t first = (fd->written_end + fs->block_size - 1) / fs->block_size;
+	int64_t last = (end + fs->block_size - 1) / fs->block_size;
+	std::vector<char> zeros;
+	std::vector<FAT_SEGMENT> segments;
+	for (long unsigned int i = 0; i < fd->extents.size(); i++) {
+		const FAT_EXTENT &extent = fd->extents[i];
+		int64_t from = extent.file_block > first ? extent.file_block : first;
+		int64_t to = extent.file_block + extent.length < last ? extent.file_block + extent.length : last;
+		for (int64_t file_block = from; file_block < to; file_block++) {
+			zeros.resize(fs->block_size);
+			FAT_SEGMENT segment = { extent.start + (int)(file_block - extent.file_block), 0, fs->block_size, zeros.data() };
+			segments.push_back(segment);
+		}
+	}
+	return mini_fat_write_segments(fs, segments.data(), segments.size()) == (long)segments.size() * fs->block_size;
+}
+
+/**
+ * Record a change to the data of an inline file: its size follows the data,
+ * and the inode, which holds the data, is dirty and logged whole.
+ */
+static void mini_file_inline_changed(FAT_FILESYSTEM *fs, FAT_FILE *fd)
+{
+	fd->size = fd->inline_data.size();
+	fd->written_end = fd->size;
+	fd->generation++;
+	mini_file_mark_dirty(fs, fd);
+	mini_journal_log_inline(fs, fd);
+}
+
+/**
+ * Write size bytes at position into the data of an inline file, which must
+ * stay within INODE_INLINE_BYTES; a gap past the end reads as zeros.
+ * No block is written: the inode is, by the next mini_fat_sync. The
+ * caller holds the file lock exclusively and fs->lock.
+ */
+static void mini_file_inline_write(FAT_FILESYSTEM *fs, FAT_FILE *fd, const int64_t position, const int size, const char *buffer)
+{
+	if (size <= 0) return;
+	if (position + size > (int64_t)fd->inline_data.size()) {
+		fd->inline_data.resize(position + size);
+	}
+	memcpy(&fd->inline_data[position], buffer, size);
+	mini_file_inline_changed(fs, fd);
+}
+
+/**
+ * Move the data of an inline file about to outgrow its inode to file
+ * block 0 (zero past the data), after which it is a file like the others.
+ * The caller holds the file lock exclusively and fs->lock.
+ * @return false if the block cannot be allocated or written; the file is
+ *         still inline.
+ */
+static bool mini_file_promote(FAT_FILESYSTEM *fs, FAT_FILE *fd)
+{
+	if (fd->size > 0) {
+		if (!mini_fat_reclaim_freed(fs)) {
+			return false;
+		}
+		int block = mini_fat_allocate_block_near(fs, FILE_DATA_BLOCK, -1);
+		if (block == -1) {
+			fprintf(stderr, "Cannot create new block for the file '%s': filesystem is full.\n", fd->name.c_str());
+			return false;
+		}
+		std::vector<char> data(fs->block_size, 0);
+		memcpy(data.data(), fd->inline_data.data(), fd->size);
+		if (mini_fat_write_in_block(fs, block, 0, fs->block_size, data.data()) != fs->block_size) {
+			mini_fat_set_block_type(fs, block, EMPTY_BLOCK);
+			return false;
+		}
+		mini_file_add_block(fs, fd, 0, block);
+		mini_journal_log_blocks(fs, fd, 0, block);
+	}
+	fd->is_inline = false;
+	std::vector<char>().swap(fd->inline_data);
+	mini_file_mark_dirty(fs, fd);
+	return true;
+}
+
+/**
+ * Write size bytes from buffer to open_file, at current position.
+ * Writing past the end of the file leaves the blocks skipped unallocated
+ * (holes, read as zeros); only the blocks written to are allocated.
+ * A file that fits in the tail of its inode (INODE_INLINE_BYTES) keeps its data there
+ * and gets a data block only when a write makes it outgrow it.
+ * Whole blocks are written directly; parts of a block written through a
+ * write handle are buffered in the handle until the block fills, or until
+ * mini_file_seek, mini_file_close, mini_file_flush or a read of the file.
+ * Holds the file's lock exclusively; fs->lock only around block allocation,
+ * the handle buffer and the size update.
+ * @return           number of bytes written.
+ */
+int mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, const void * buffer)
+{
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_WRITE);
+	//The handle already points to the file
+	FAT_FILE * fd = open_file->file;
+	const char* write_buffer = (const char*)buffer;
+	bool buffered = open_file->is_write && fs->mapping == NULL;
+	std::unique_lock<std::shared_mutex> file_lock(fd->lock);
+	std::unique_lock<std::mutex> fs_lock(fs->lock);
+	mini_file_flush_file(fs, fd, open_file);
+	if(!mini_journal_reserve(fs, 0, JR_INLINE_HEADER + INODE_INLINE_BYTES + JR_FILE_SIZE)) {
+		return 0;
+	}
+	//Small files stay in their inode until they outgrow it
+	if(fd->is_inline) {
+		if(open_file->position + size <= INODE_INLINE_BYTES) {
+			mini_file_inline_write(fs, fd, open_file->position, size, write_buffer);
+			open_file->position += size;
+			return size;
+		}
+		if(!mini_file_promote(fs, fd)) {
+			return 0;
+		}
+	}
+	fs_lock.unlock();
+	if(open_file->position > fd->written_end && !mini_file_zero_reserved(fs, fd, open_file->position)) {
+		return 0;
+	}
+
+	//One segment per whole block touched, allocating blocks for the holes and past the last one
+	std::vector<FAT_SEGMENT> segments;
+	int planned_bytes = 0;
+	int written_bytes = 0;
+	int64_t position = open_file->position;
+	while(planned_bytes < size) {
+
+		int block_index = position_to_block_index(fs, position);
+		int block_offset = position_to_byte_index(fs, position);
+		int block_size_to_write = fs->block_size - block_offset;
+		if(size - planned_bytes < block_size_to_write) {
+			block_size_to_write = size - planned_bytes;
+		}
+
+		//Blocks past the written bytes hold no file data yet
+		int block = mini_file_block_at(fd, block_index);
+		bool fresh = block == -1 || (int64_t)block_index * fs->block_size >= fd->written_end;
+		if(block == -1) {
+			fs_lock.lock();
+			if(!mini_journal_room(fs, 0, JR_FILE_SIZE) || mini_fat_find_empty_block(fs) == -1) {
+				//A checkpoint must not make blocks part of the file before their data is written
+				fs_lock.unlock();
+				int planned_segments = planned_bytes - written_bytes;
+				if(mini_fat_write_segments(fs, segments.data(), segments.size()) != planned_segments) {
+					break;
+				}
+				segments.clear();
+				written_bytes = planned_bytes;
+				fs_lock.lock();
+				if(!mini_journal_reserve(fs, 0, JR_FILE_SIZE) || !mini_fat_reclaim_freed(fs)) {
+					fs_lock.unlock();
+					break;
+				}
+			}
+			block = mini_file_allocate_block(fs, fd, block_index);
+			fs_lock.unlock();
+			if (block == -1) {
+				fprintf(stderr, "Cannot create new block for the file '%s': filesystem is full.\n", fd->name.c_str());
+				break;
+			}
+		}
+
+		if(buffered && block_size_to_write < fs->block_size) {
+			//Write the whole blocks before it, then buffer the piece
+			int planned_segments = planned_bytes - written_bytes;
+			if(mini_fat_write_segments(fs, segments.data(), segments.size()) != planned_segments) {
+				break;
+			}
+			segments.clear();
+			written_bytes = planned_bytes;
+			fs_lock.lock();
+			bool kept = mini_file_buffer_write(fs, open_file, block, block_offset, block_size_to_write, write_buffer + planned_bytes, fresh);
+			fs_lock.unlock();
+			if(!kept) {
+				break;
+			}
+			written_bytes += block_size_to_write;
+		} else {
+			//The buffer must not later overwrite what is written now
+			fs_lock.lock();
+			bool flushed = open_file->write_block != block || mini_file_flush_handle(fs, open_file);
+			fs_lock.unlock();
+			if(!flushed) {
+				break;
+			}
+			if(fresh && block_size_to_write < fs->block_size && !mini_file_zero_around(fs, block, block_offset, block_size_to_write)) {
+				break;
+			}
+			FAT_SEGMENT segment = { block, block_offset, block_size_to_write, (void*)(write_buffer + planned_bytes) };
+			segments.push_back(segment);
+		}
+		planned_bytes += block_size_to_write;
+		position += block_size_to_write;
+	}
+
+	//Adjacent blocks are written together
+	written_bytes += mini_fat_write_segments(fs, segments.data(), segments.size());
+	open_file->position += written_bytes;
+	if(written_bytes > 0) {
+		fd->generation++;
+	}
+	if(open_file->position > fd->written_end) {
+		fd->written_end = open_file->position;
+	}
+
+	//Overwrites inside the file do not change its size
+	if(open_file->position > fd->size) {
+		fs_lock.lock();
+		fd->size = open_file->position;
+		mini_file_mark_dirty(fs, fd);
+		mini_journal_log_size(fs, fd);
+	}
+	return written_bytes;
+}
+
 /**
- * Find a file in loaded filesystem, or return NULL.
+ * Collect one segment per block of the file touched by a read of size bytes
+ * at position (within the file). The parts of buffer falling in holes are
+ * zeroed now and get no segment.
+ * @return size
  */
-FAT_FILE * mini_file_find(const FAT_FILESYSTEM *fs, const char *filename)
+static int mini_file_read_plan(FAT_FILESYSTEM *fs, const FAT_FILE * fd, int64_t position, int size, char * buffer,
+	std::vector<FAT_SEGMENT> &segments)
 {
-	for (long unsigned int i=0; i<fs->files.size(); ++i) { //Changed the template code to get rid of warning
-		if (strcmp(fs->files[i]->name, filename) == 0) // Match
-			return fs->files[i];
+	int planned_bytes = 0;
+	while(size > 0) {
+
+		int block_index = position_to_block_index(fs, position);
+		int block = mini_file_block_at(fd, block_index);
+		int block_offset = position_to_byte_index(fs, position);
+		int block_size_to_read = fs->block_size - block_offset;
+		if(size <= block_size_to_read) {
+			block_size_to_read = size;
+		}
+
+		if(block == -1) {
+			memset(buffer, 0, block_size_to_read);
+		} else {
+			FAT_SEGMENT segment = { block, block_offset, block_size_to_read, buffer };
+			segments.push_back(segment);
+		}
+		position += block_size_to_read;
+		size -= block_size_to_read;
+		buffer += block_size_to_read;
+		planned_bytes += block_size_to_read;
 	}
-	return NULL;
+	return planned_bytes;
 }
 
 /**
- * Create a FAT_FILE struct and set its name.
+ * Bytes covered by a list of segments.
  */
-FAT_FILE * mini_file_create(const char * filename)
+static long mini_file_segment_bytes(const std::vector<FAT_SEGMENT> &segments)
 {
-	FAT_FILE * file = new FAT_FILE;
-	file->size = 0;
-	strcpy(file->name, filename);
-	return file;
+	long bytes = 0;
+	for (long unsigned int i = 0; i < segments.size(); i++) {
+		bytes += segments[i].size;
+	}
+	return bytes;
 }
 
-
 /**
- * Create a file and attach it to filesystem.
- * @return FAT_OPEN_FILE pointer on success, NULL on failure
+ * Read size bytes (within the file) at the handle position straight from the
+ * blocks, with one preadv per run of adjacent blocks.
+ * @return number of bytes read.
  */
-FAT_FILE * mini_file_create_file(FAT_FILESYSTEM *fs, const char *filename)
+static int mini_file_read_blocks(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, int size_to_read, void * buffer)
 {
-	assert(strlen(filename)< MAX_FILENAME_LENGTH);
-	FAT_FILE *fd = mini_file_create(filename);
+	FAT_FILE * fd = open_file->file;
+	char* read_buffer = (char*)buffer;
 
-	int new_block_index = mini_fat_allocate_new_block(fs, FILE_ENTRY_BLOCK);
-	if (new_block_index == -1)
-	{
-		fprintf(stderr, "Cannot create new file '%s': filesystem is full.\n", filename);
-		return NULL;
+	//Small reads inside one block need no segment list
+	int first_offset = position_to_byte_index(fs, open_file->position);
+	if(size_to_read > 0 && first_offset + size_to_read <= fs->block_size) {
+		int block = mini_file_block_at(fd, position_to_block_index(fs, open_file->position));
+		if(block == -1) {
+			memset(read_buffer, 0, size_to_read);
+			open_file->position += size_to_read;
+			return size_to_read;
+		}
+		int read_bytes = mini_fat_read_in_block(fs, block, first_offset, size_to_read, read_buffer);
+		open_file->position += read_bytes;
+		return read_bytes;
 	}
-	fs->files.push_back(fd); // Add to filesystem.
-	fd->metadata_block_id = new_block_index;
-	return fd;
+
+	//One segment per block touched
+	std::vector<FAT_SEGMENT> segments;
+	mini_file_read_plan(fs, fd, open_file->position, size_to_read, read_buffer, segments);
+
+	//Adjacent blocks are read together, an I/O error reads nothing
+	if(mini_fat_read_segments(fs, segments.data(), segments.size()) != mini_file_segment_bytes(segments)) {
+		return 0;
+	}
+	open_file->position += size_to_read;
+	return size_to_read;
 }
 
 /**
- * Return filesize of a file.
- * @param  fs       filesystem
- * @param  filename name of file
- * @return          file size in bytes, or zero if file does not exist.
+ * Ask the kernel to start reading the given file blocks in the background
+ * (posix_fadvise WILLNEED, one call per run of adjacent blocks), so the next
+ * readahead refill finds them in the page cache.
  */
-int mini_file_size(FAT_FILESYSTEM *fs, const char *filename) {
-	FAT_FILE * fd = mini_file_find(fs, filename);
-	if (!fd) {
-		fprintf(stderr, "File '%s' does not exist.\n", filename);
-		return 0;
+static void mini_file_advise(FAT_FILESYSTEM *fs, const FAT_FILE * fd, const int first_block, const int count)
+{
+	int run_start = -1;
+	int run_length = 0;
+	for (int i = 0; i <= count; i++) {
+		int block = i < count ? mini_file_block_at(fd, first_block + i) : -1;
+		if (run_length > 0 && block == run_start + run_length) {
+			run_length++;
+			continue;
+		}
+		if (run_length > 0) {
+			posix_fadvise(fs->fd, (off_t)run_start * fs->block_size, (off_t)run_length * fs->block_size, POSIX_FADV_WILLNEED);
+			fs->host_io_calls++;
+		}
+		run_start = block;
+		run_length = block == -1 ? 0 : 1;
 	}
-	return fd->size;
 }
 
+/**
+ * Largest readahead window in blocks: MAX_READAHEAD_BLOCKS, fewer when the
+ * blocks are so large that it would exceed MAX_READAHEAD_BYTES.
+ */
+static int mini_file_readahead_limit(const FAT_FILESYSTEM *fs)
+{
+	int limit = MAX_READAHEAD_BYTES / fs->block_size;
+	if (limit > MAX_READAHEAD_BLOCKS) return MAX_READAHEAD_BLOCKS;
+	return limit > 1 ? limit : 1;
+}
 
 /**
- * Opens a file in filesystem.
- * If the file does not exist, returns NULL, unless it is write mode, where
- * the file is created.
- * Adds the opened file to file's open handles.
- * @param  is_write whether it is opened in write (append) mode or read.
- * @return FAT_OPEN_FILE pointer on success, NULL on failure
+ * Refill the readahead buffer of a sequential stream with the window of
+ * whole blocks starting at the handle position, doubling the window each
+ * time, and hint the window after it to the kernel.
+ * @return false at the end of the file or if nothing could be read.
  */
-FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const bool is_write)
+static bool mini_file_fill_readahead(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file)
 {
-	FAT_FILE * fd = mini_file_find(fs, filename);
-	if (!fd) {
-		//Check if it's write mode, and if so create it. Otherwise return NULL.
-		if(is_write) {
-			if((fd =mini_file_create_file(fs, filename)));
-			else return NULL;
-		}
-		else {
-			return NULL;
+	FAT_FILE * fd = open_file->file;
+	int first_block = position_to_block_index(fs, open_file->position);
+	int file_blocks = (fd->size + fs->block_size - 1) / fs->block_size;
+	if (first_block >= file_blocks) {
+		return false;
+	}
+	int limit = mini_file_readahead_limit(fs);
+	if (open_file->readahead_blocks == 0) {
+		open_file->readahead_blocks = MIN_READAHEAD_BLOCKS < limit ? MIN_READAHEAD_BLOCKS : limit;
+	} else if (open_file->readahead_blocks < limit) {
+		open_file->readahead_blocks *= 2;
+		if (open_file->readahead_blocks > limit) {
+			open_file->readahead_blocks = limit;
 		}
 	}
-	if (is_write) {
-		//Check if other write handles are open.
-		for(long unsigned int i = 0; i < fd->open_handles.size(); i++) {
-			if(fd->open_handles[i]->is_write) {
-				return NULL;
-			}
+	int count = file_blocks - first_block;
+	if (count > open_file->readahead_blocks) {
+		count = open_file->readahead_blocks;
+	}
+
+	std::vector<FAT_SEGMENT> segments;
+	open_file->readahead.resize((size_t)count * fs->block_size);
+	for (int i = 0; i < count; i++) {
+		int block = mini_file_block_at(fd, first_block + i);
+		char * window = &open_file->readahead[(size_t)i * fs->block_size];
+		if (block == -1) {
+			memset(window, 0, fs->block_size); // Hole.
+			continue;
 		}
+		FAT_SEGMENT segment = { block, 0, fs->block_size, window };
+		segments.push_back(segment);
+	}
+	long read_bytes = (long)count * fs->block_size;
+	if (mini_fat_read_segments(fs, segments.data(), segments.size()) != mini_file_segment_bytes(segments)) {
+		read_bytes = 0;
 	}
-	//Create new open handle
-	FAT_OPEN_FILE * open_file = new FAT_OPEN_FILE;
 
-	//Assign open_file fields.	
-	open_file->file = fd;
-	open_file->position = 0;
-	open_file->is_write = is_write;
-	
+	//Keep only file bytes
+	open_file->readahead_position = (int64_t)first_block * fs->block_size;
+	if (read_bytes > fd->size - open_file->readahead_position) {
+		read_bytes = fd->size - open_file->readahead_position;
+	}
+	open_file->readahead.resize(read_bytes);
+	open_file->readahead_generation = fd->generation;
 
-	//Add to list of open handles for fd:
-	fd->open_handles.push_back(open_file);
-	return open_file;
+	mini_file_advise(fs, fd, first_block + count, open_file->readahead_blocks);
+	return read_bytes > open_file->position - open_file->readahead_position;
 }
 
 /**
- * Close an existing open file handle.
- * @return false on failure (no open file handle), true on success.
+ * Read size bytes (within the file) of a sequential stream through the
+ * handle's readahead buffer.
+ * @return number of bytes read.
  */
-bool mini_file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file)
+static int mini_file_read_ahead(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, void * buffer)
 {
-	if (open_file == NULL) return false;
-	FAT_FILE * fd = open_file->file;
-	if (vector_delete_value(fd->open_handles, open_file)) {
-		return true;
+	//Bytes prefetched before a write to the file are stale
+	if (open_file->readahead_generation != open_file->file->generation) {
+		open_file->readahead.clear();
 	}
 
-	fprintf(stderr, "Attempting to close file that is not open.\n");
-	return false;
+	int read_bytes = 0;
+	char* read_buffer = (char*)buffer;
+	while (read_bytes < size) {
+		int64_t offset = open_file->position - open_file->readahead_position;
+		if (offset < 0 || offset >= (int64_t)open_file->readahead.size()) {
+			if (!mini_file_fill_readahead(fs, open_file)) {
+				break;
+			}
+			continue;
+		}
+		int available = open_file->readahead.size() - offset;
+		int length = size - read_bytes < available ? size - read_bytes : available;
+		memcpy(read_buffer + read_bytes, &open_file->readahead[offset], length);
+		read_bytes += length;
+		open_file->position += length;
+	}
+	return read_bytes;
 }
 
 /**
- * Write size bytes from buffer to open_file, at current position.
- * @return           number of bytes written.
+ * Read up to size bytes from open_file into buffer.
+ * Reads continuing where the previous one ended are served from a per-handle
+ * readahead buffer (pread mode only; a mapping needs none), other reads and
+ * reads larger than the window go to the blocks directly.
+ * Holds the file's lock shared, so reads through different handles run in
+ * parallel.
+ * @return           number of bytes read.
  */
-int mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, const void * buffer)
+int mini_file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, void * buffer)
 {
-	int written_bytes = 0;
-
-	//Find the file
-	FAT_FILE * fd = mini_file_find(fs, open_file->file->name);
-	if (!fd) {
-		fprintf(stderr, "File '%s' does not exist.\n", fd->name);
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_READ);
+	//The handle already points to the file
+	FAT_FILE * fd = open_file->file;
+	std::shared_lock<std::shared_mutex> file_lock(fd->lock);
+	
+	//Never read past the end of the file
+	int64_t remaining = fd->size - open_file->position;
+	int size_to_read = size < remaining ? size : (int)remaining;
+	if(size_to_read <= 0) {
 		return 0;
 	}
-	//If file has no block allocate one
-	if(open_file->file->block_ids.empty()) {
 
-		int new_block_index = mini_fat_allocate_new_block(fs, FILE_DATA_BLOCK);
-		if (new_block_index == -1)
-		{
-			fprintf(stderr, "Cannot create new block for the file '%s': filesystem is full.\n", fd->name);
-			return written_bytes;
-		}
-		fd->block_ids.push_back(new_block_index); // Add to filesystem.
+	//An inline file was read with its inode
+	if(fd->is_inline) {
+		memcpy(buffer, &fd->inline_data[open_file->position], size_to_read);
+		open_file->position += size_to_read;
+		open_file->next_position = open_file->position;
+		return size_to_read;
 	}
-	
-	int over_write = 0;
-	int size_before_over_write = fd->size;
-	if(open_file->position < fd->size) {
-		over_write = 1;	
+
+	//Data buffered by write handles must be on the disk first
+	if(fd->buffered_count > 0) {
+		std::lock_guard<std::mutex> guard(fs->lock);
+		mini_file_flush_file(fs, fd, NULL);
 	}
 
-	int free_block_size = fs->block_size - position_to_byte_index(fs,open_file->position);	
-	int size_needed = size;
-	char* write_buffer = (char*)buffer;
+	//A seek breaks the stream: drop the window
+	bool sequential = open_file->position == open_file->next_position;
+	if(!sequential) {
+		open_file->readahead_blocks = 0;
+		open_file->readahead.clear();
+	}
+
+	int read_bytes;
+	if(fs->mapping == NULL && sequential && size_to_read < mini_file_readahead_limit(fs) * fs->block_size) {
+		read_bytes = mini_file_read_ahead(fs, open_file, size_to_read, buffer);
+	} else {
+		read_bytes = mini_file_read_blocks(fs, open_file, size_to_read, buffer);
+	}
+	open_file->next_position = open_file->position;
+	return read_bytes;
+}
+
+/**
+ * Return up to size bytes of open_file at the current position without
+ * copying them, and move the position past them like mini_file_read. A view
+ * covers at most the rest of an extent in FAT_IO_MMAP mode, the rest of a
+ * block through the block cache, or the inline data; a hole or a block read
+ * with the cache off and the inline data are copied into view->copy. Call
+ * again for the rest, after releasing the view or with another one. The file
+ * is not locked while the view is held: a pinned block or the mapping stay
+ * valid until mini_file_release_view, but like a shared mmap they show later
+ * writes to the file, and a truncate or delete may hand the block to another
+ * file. Release every view before unmounting.
+ * @return false on I/O failure (the view is released); view->size is 0 at
+ *         the end of the file.
+ */
+bool mini_file_view(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, FAT_FILE_VIEW *view)
+{
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_VIEW);
+	FAT_FILE * fd = open_file->file;
+	std::shared_lock<std::shared_mutex> file_lock(fd->lock);
+	view->pinned_block = -1;
+	view->data = NULL;
+	view->size = 0;
 
-	//If file has enough space directly write
-	if(size <= free_block_size) {
+	//Never past the end of the file
+	int64_t remaining = fd->size - open_file->position;
+	int size_to_view = size < remaining ? size : (int)remaining;
+	if(size_to_view <= 0) {
+		return true;
+	}
 
+	if(fd->is_inline) {
+		//The inline data moves when the file grows
+		view->copy.assign(&fd->inline_data[open_file->position], &fd->inline_data[open_file->position] + size_to_view);
+		view->data = view->copy.data();
+	} else {
+		//Data buffered by write handles must be on the disk first
+		if(fd->buffered_count > 0) {
+			std::lock_guard<std::mutex> guard(fs->lock);
+			mini_file_flush_file(fs, fd, NULL);
+		}
 		int block_index = position_to_block_index(fs, open_file->position);
-		int block = open_file->file->block_ids[block_index];
 		int block_offset = position_to_byte_index(fs, open_file->position);
-			
-		written_bytes += mini_fat_write_in_block(fs, block, block_offset, size, buffer);
-		fd->size += written_bytes;	
-		open_file->position += written_bytes;
-		
+		int block = mini_file_block_at(fd, block_index);
+		int64_t available = fs->block_size - block_offset;
+		if(block != -1 && fs->mapping != NULL) {
+			//The rest of the extent is contiguous in the mapping
+			const FAT_EXTENT &extent = fd->extents[mini_file_extent_before(fd, block_index)];
+			available += (int64_t)(extent.file_block + extent.length - block_index - 1) * fs->block_size;
+			view->data = (const char*)fs->mapping + (size_t)block * fs->block_size + block_offset;
+		} else if(block != -1) {
+			//NULL with the cache off: the bytes are copied below
+			const unsigned char * data = mini_cache_pin(fs, block);
+			if(data != NULL) {
+				view->pinned_block = block;
+				view->data = (const char*)data + block_offset;
+			}
+		}
+		if(size_to_view > available) {
+			size_to_view = (int)available;
+		}
+		if(view->data == NULL) {
+			view->copy.resize(size_to_view);
+			if(block == -1) {
+				memset(view->copy.data(), 0, size_to_view);
+			} else if(mini_fat_read_in_block(fs, block, block_offset, size_to_view, view->copy.data()) != size_to_view) {
+				mini_file_release_view(fs, view);
+				return false;
+			}
+			view->data = view->copy.data();
+		} else if(fs->mapping != NULL) {
+			mini_stats_count(&fs->stats, STAT_BYTES_READ, size_to_view);
+		}
 	}
+	view->size = size_to_view;
+	open_file->position += size_to_view;
+	open_file->next_position = open_file->position;
+	return true;
+}
 
-	//Else create new block as needed and write to them
-	else {
-		
-		int block_index = position_to_block_index(fs, open_file->position);
-		int block = open_file->file->block_ids[block_index];
-		int block_offset = position_to_byte_index(fs, open_file->position);	
-		int written_in_one_iteration = 0;
-	
+/**
+ * Release a view taken by mini_file_view: unpin its block. Does nothing if
+ * it is already released.
+ */
+void mini_file_release_view(FAT_FILESYSTEM *fs, FAT_FILE_VIEW *view)
+{
+	if(view->pinned_block != -1) {
+		mini_cache_unpin(fs, view->pinned_block);
+		view->pinned_block = -1;
+	}
+	view->data = NULL;
+	view->size = 0;
+}
 
-		written_in_one_iteration = mini_fat_write_in_block(fs, block, block_offset, free_block_size, write_buffer);
-		written_bytes += written_in_one_iteration;
-		fd->size += written_in_one_iteration;
-		open_file->position += written_in_one_iteration;
-		size_needed -= written_in_one_iteration;
-	       	write_buffer += written_in_one_iteration;	
-
-
-		while(size_needed > 0) {
-
-			int new_block_index = mini_fat_allocate_new_block(fs, FILE_DATA_BLOCK);
-			if (new_block_index == -1) {
-				fprintf(stderr, "Cannot create new block for the file '%s': filesystem is full.\n", fd->name);
-				return written_bytes;
-			}	
-				fd->block_ids.push_back(new_block_index); // Add new block to filesystem.
-		
-
-			block_index = position_to_block_index(fs, open_file->position);
-			block = open_file->file->block_ids[block_index];
-			block_offset = position_to_byte_index(fs, open_file->position);
-			free_block_size = fs->block_size - block_offset;
-				
-			
-			if(size_needed <= free_block_size) {
-				free_block_size = size_needed;
-			}
+/**
+ * Start reading size bytes from open_file at the current position without
+ * waiting for the disk; the position moves past them at once. The bytes are
+ * in buffer when mini_async_poll / mini_async_wait returns the result.
+ * Readahead is not used.
+ * @return           token of the request, see fat_async.h.
+ */
+int mini_file_read_async(FAT_ASYNC *async, FAT_OPEN_FILE * open_file, const int size, void * buffer)
+{
+	FAT_FILESYSTEM * fs = async->fs;
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_READ_ASYNC);
+	FAT_FILE * fd = open_file->file;
+	std::shared_lock<std::shared_mutex> file_lock(fd->lock);
 
-	
-			written_in_one_iteration = mini_fat_write_in_block(fs, block, block_offset, free_block_size, write_buffer);
-			written_bytes += written_in_one_iteration;	
-			fd->size += written_in_one_iteration;
-			open_file->position += written_in_one_iteration;
-			size_needed -= written_in_one_iteration;
-			write_buffer += written_in_one_iteration;	
+	//Never read past the end of the file
+	int64_t remaining = fd->size - open_file->position;
+	int size_to_read = size < remaining ? size : (int)remaining;
 
+	//Inline data is copied now, the request completes without I/O
+	if(fd->is_inline) {
+		if(size_to_read <= 0) {
+			size_to_read = 0;
+		} else {
+			memcpy(buffer, &fd->inline_data[open_file->position], size_to_read);
+			open_file->position += size_to_read;
 		}
+		return mini_async_submit(async, NULL, 0, false, NULL, 0, size_to_read);
 	}
-	//Overwrite
-	if(over_write) {
-		//Ignore the written bytes
-		fd->size -= written_bytes;
-		//When over write increase the size	
-		if(open_file->position > size_before_over_write) {
-			fd->size += (size_before_over_write - open_file->position); 
-		}
+
+	//Data buffered by write handles must be on the disk first
+	if(fd->buffered_count > 0) {
+		std::lock_guard<std::mutex> guard(fs->lock);
+		mini_file_flush_file(fs, fd, NULL);
 	}
-	return written_bytes;
+
+	std::vector<FAT_SEGMENT> segments;
+	int hole_bytes = 0;
+	if(size_to_read > 0) {
+		open_file->position += mini_file_read_plan(fs, fd, open_file->position, size_to_read, (char*)buffer, segments);
+		hole_bytes = size_to_read - mini_file_segment_bytes(segments);
+	}
+	return mini_async_submit(async, segments.data(), segments.size(), false, NULL, 0, hole_bytes);
 }
+
 /**
- * Read up to size bytes from open_file into buffer.
- * @return           number of bytes read.
+ * Start writing size bytes from buffer to open_file at the current position
+ * without waiting for the disk; the position moves past them at once and
+ * buffer must stay valid until the result is collected. Blocks are
+ * allocated now, the file size grows when mini_async_poll / mini_async_wait
+ * returns the result. Reading the range before that is undefined.
+ * @return           token of the request, see fat_async.h.
  */
-int mini_file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, void * buffer)
+int mini_file_write_async(FAT_ASYNC *async, FAT_OPEN_FILE * open_file, const int size, const void * buffer)
 {
-	int read_bytes = 0;
+	FAT_FILESYSTEM * fs = async->fs;
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_WRITE_ASYNC);
+	FAT_FILE * fd = open_file->file;
+	const char* write_buffer = (const char*)buffer;
+	std::unique_lock<std::shared_mutex> file_lock(fd->lock);
+	std::unique_lock<std::mutex> fs_lock(fs->lock);
+	//Buffered bytes, this handle's included, must not overwrite the new data later
+	mini_file_flush_file(fs, fd, NULL);
+	//The blocks are allocated before their data is written: no checkpoint may run meanwhile
+	int blocks = size / fs->block_size + 2;
+	if(!mini_journal_reserve(fs, mini_file_allocate_cost(fs, blocks), (long)blocks * JR_FILE_SIZE + JR_INLINE_HEADER + INODE_INLINE_BYTES)
+		|| !mini_fat_reclaim_freed(fs)) {
+		return mini_async_submit(async, NULL, 0, true, NULL, 0);
+	}
+	//Writing inline data is a copy: done now, the file grows at once
+	if(fd->is_inline) {
+		if(open_file->position + size <= INODE_INLINE_BYTES) {
+			mini_file_inline_write(fs, fd, open_file->position, size, write_buffer);
+			open_file->position += size;
+			return mini_async_submit(async, NULL, 0, true, NULL, 0, size);
+		}
+		if(!mini_file_promote(fs, fd)) {
+			return mini_async_submit(async, NULL, 0, true, open_file, open_file->position);
+		}
+	}
+	if(open_file->position > fd->written_end && !mini_file_zero_reserved(fs, fd, open_file->position)) {
+		return mini_async_submit(async, NULL, 0, true, open_file, open_file->position);
+	}
 
-	//Find the file
-	FAT_FILE * fd = mini_file_find(fs, open_file->file->name);
-	if (!fd) {
-		fprintf(stderr, "File '%s' does not exist.\n", fd->name);
-		return 0;
+	std::vector<FAT_SEGMENT> segments;
+	int planned_bytes = 0;
+	int64_t position = open_file->position;
+	int first_block = mini_file_end_block(fd);
+	int64_t written_end = fd->written_end;
+	while(planned_bytes < size) {
+		int block_index = position_to_block_index(fs, position);
+		int block_offset = position_to_byte_index(fs, position);
+		int block_size_to_write = fs->block_size - block_offset;
+		if(size - planned_bytes < block_size_to_write) {
+			block_size_to_write = size - planned_bytes;
+		}
+		int block = mini_file_block_at(fd, block_index);
+		bool fresh = block == -1 || (int64_t)block_index * fs->block_size >= fd->written_end;
+		if(block == -1) {
+			block = mini_file_allocate_block(fs, fd, block_index);
+			if (block == -1) {
+				fprintf(stderr, "Cannot create new block for the file '%s': filesystem is full.\n", fd->name.c_str());
+				break;
+			}
+		}
+		if (fresh && block_size_to_write < fs->block_size && !mini_file_zero_around(fs, block, block_offset, block_size_to_write)) {
+			break;
+		}
+		FAT_SEGMENT segment = { block, block_offset, block_size_to_write, (void*)(write_buffer + planned_bytes) };
+		segments.push_back(segment);
+		planned_bytes += block_size_to_write;
+		position += block_size_to_write;
 	}
-	
-	if(open_file->file->block_ids.empty()) {
-		return 0;		
+	fs_lock.unlock();
+
+	int64_t start = open_file->position;
+	open_file->position += planned_bytes;
+	if(open_file->position > fd->written_end) {
+		fd->written_end = open_file->position;
 	}
-		
+	fd->generation++;
+	int token = mini_async_submit(async, segments.data(), segments.size(), true, open_file, start);
+	FAT_ASYNC_REQUEST &request = async->requests[token];
+	request.first_block = first_block;
+	request.end_block = mini_file_end_block(fd);
+	request.written_end = written_end;
+	request.generation = fd->generation;
+	return token;
+}
 
-	int block_size_to_read = fs->block_size - position_to_byte_index(fs,open_file->position);	
-	int size_to_read = open_file->file->size - position_to_byte_index(fs,open_file->position);
-	char* read_buffer = (char*)buffer;
+/**
+ * Apply a finished asynchronous write: grow the file if it ends past the end
+ * and drop the readahead of the other handles. If it failed, the blocks it
+ * appended are freed, unless the file was written or grown since; blocks it
+ * allocated in holes inside the file stay.
+ */
+void mini_file_write_done(FAT_FILESYSTEM *fs, const FAT_ASYNC_REQUEST *request)
+{
+	FAT_FILE * fd = request->open_file->file;
+	std::unique_lock<std::shared_mutex> file_lock(fd->lock);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	if(request->failed) {
+		if(request->end_block > request->first_block && fd->generation == request->generation
+			&& mini_file_end_block(fd) == request->end_block
+			&& mini_journal_reserve(fs, mini_file_remove_cost(fs, fd, request->first_block))) {
+			mini_file_remove_blocks(fs, fd, request->first_block);
+			fd->written_end = request->written_end;
+			mini_journal_log_truncate(fs, fd);
+		}
+		fd->generation++;
+		return;
+	}
+	fd->generation++;
+	if(request->position + request->bytes > fd->size) {
+		fd->size = request->position + request->bytes;
+		mini_file_mark_dirty(fs, fd);
+		mini_journal_log_size(fs, fd);
+	}
+}
 
-	//If size fits in one block than read
-	if(size <= block_size_to_read) {
 
-		int block_index = position_to_block_index(fs, open_file->position);
-		int block = open_file->file->block_ids[block_index];
-		int block_offset = position_to_byte_index(fs, open_file->position);
-				
-		read_bytes += mini_fat_read_in_block(fs, block, block_offset, size, buffer);
-		open_file->position += read_bytes;	
+/**
+ * Set the size of the file open_file points to. Shrinking frees the blocks
+ * past the new end, reserved ones included; growing leaves a hole (read as
+ * zeros) past the old end. Handle positions are left as they are.
+ * @param  size  new size in bytes
+ * @return       false if size is negative or the blocks cannot be zeroed.
+ */
+bool mini_file_truncate(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t size)
+{
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_TRUNCATE);
+	FAT_FILE * fd = open_file->file;
+	int64_t blocks = (size + fs->block_size - 1) / fs->block_size;
+	if(size < 0 || blocks > INT32_MAX) {
+		fprintf(stderr, "Cannot truncate the file '%s' to %lld bytes.\n", fd->name.c_str(), (long long)size);
+		return false;
+	}
+	if(!open_file->is_write) {
+		fprintf(stderr, "Cannot truncate the file '%s': it is open for reading.\n", fd->name.c_str());
+		return false;
+	}
+	std::unique_lock<std::shared_mutex> file_lock(fd->lock);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	//Buffered bytes past the new end must not be written back later
+	mini_file_flush_file(fs, fd, NULL);
+	if(!mini_journal_reserve(fs, mini_file_remove_cost(fs, fd, blocks), JR_INLINE_HEADER + INODE_INLINE_BYTES + JR_FILE_SIZE)) {
+		return false;
+	}
+	if(fd->is_inline) {
+		if(size <= INODE_INLINE_BYTES) {
+			fd->inline_data.resize(size);
+			mini_file_inline_changed(fs, fd);
+			return true;
+		}
+		if(!mini_file_promote(fs, fd)) {
+			return false;
+		}
 	}
-	//Read all file blocks
-	else {
-		
-		int block_index = position_to_block_index(fs, open_file->position);
-		int block = open_file->file->block_ids[block_index];
-		int block_offset = position_to_byte_index(fs, open_file->position);	
-		int read_in_one_iteration = 0;
-
-		read_in_one_iteration = mini_fat_read_in_block(fs, block, block_offset, block_size_to_read, read_buffer);
-		read_bytes += read_in_one_iteration;
-		open_file->position += read_in_one_iteration;
-		size_to_read -= read_in_one_iteration; 
-		read_buffer += read_in_one_iteration;
-
-		while(size_to_read > 0) {
-
-		
-			block_index = position_to_block_index(fs, open_file->position);
-			block = open_file->file->block_ids[block_index];
-			block_offset = position_to_byte_index(fs, open_file->position);
-			block_size_to_read = fs->block_size - block_offset;
-			
-			
-			if(size_to_read <= block_size_to_read) {
-				block_size_to_read = size_to_read;
-			}
 
-			read_in_one_iteration = mini_fat_read_in_block(fs, block, block_offset, block_size_to_read, read_buffer);
-			read_bytes += read_in_one_iteration;
-			open_file->position += read_in_one_iteration;
-			size_to_read -= read_in_one_iteration;
-			read_buffer += read_in_one_iteration;	
-			
+	if(size > fd->written_end) {
+		if(!mini_file_zero_reserved(fs, fd, size)) {
+			return false;
+		}
+	} else {
+		//The bytes cut from the last block read as zeros if the file grows again
+		int offset = position_to_byte_index(fs, size);
+		int block = mini_file_block_at(fd, blocks - 1);
+		if(offset > 0 && block != -1) {
+			std::vector<char> zeros(fs->block_size - offset, 0);
+			if(mini_fat_write_in_block(fs, block, offset, zeros.size(), zeros.data()) != (int)zeros.size()) {
+				return false;
+			}
 		}
 	}
-	return read_bytes;
+
+	mini_file_remove_blocks(fs, fd, blocks);
+	fd->size = size;
+	fd->written_end = size;
+	fd->generation++;
+	mini_journal_log_truncate(fs, fd);
+	return true;
 }
 
+/**
+ * Reserve blocks so the file open_file points to can grow to size bytes
+ * without allocating: the missing blocks past the written bytes are taken
+ * as one run of adjacent disk blocks when there is one (continuing the last
+ * extent if possible), block by block otherwise. The file size does not
+ * change, see mini_file_truncate; holes inside the written bytes stay holes.
+ * @param  size  bytes to reserve, from the start of the file
+ * @return       false if the filesystem is full; the blocks reserved so far
+ *               are kept.
+ */
+bool mini_file_fallocate(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t size)
+{
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_FALLOCATE);
+	FAT_FILE * fd = open_file->file;
+	int64_t blocks = (size + fs->block_size - 1) / fs->block_size;
+	if(size < 0 || blocks > INT32_MAX) {
+		fprintf(stderr, "Cannot reserve %lld bytes for the file '%s'.\n", (long long)size, fd->name.c_str());
+		return false;
+	}
+	if(!open_file->is_write) {
+		fprintf(stderr, "Cannot reserve blocks for the file '%s': it is open for reading.\n", fd->name.c_str());
+		return false;
+	}
+	std::unique_lock<std::shared_mutex> file_lock(fd->lock);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	if(!mini_journal_reserve(fs, 0, JR_FILE_SIZE)) {
+		return false;
+	}
+	//The inode of an inline file already holds that much
+	if(fd->is_inline) {
+		if(size <= INODE_INLINE_BYTES) {
+			return true;
+		}
+		if(!mini_file_promote(fs, fd)) {
+			return false;
+		}
+	}
+	if(!mini_fat_reclaim_freed(fs)) {
+		return false;
+	}
+
+	int file_block = (fd->written_end + fs->block_size - 1) / fs->block_size;
+	while(file_block < blocks) {
+		if(mini_file_block_at(fd, file_block) != -1) {
+			file_block++;
+			continue;
+		}
+		//The hole up to the next reserved block, in one run if possible
+		int count = 1;
+		while(file_block + count < blocks && mini_file_block_at(fd, file_block + count) == -1) {
+			count++;
+		}
+		//Reserved blocks hold no file data: a checkpoint between two runs or blocks is safe
+		if(!mini_journal_reserve(fs, mini_file_allocate_cost(fs, count), JR_FILE_SIZE)) {
+			return false;
+		}
+		int start = mini_fat_allocate_run(fs, FILE_DATA_BLOCK, mini_file_preferred_block(fd, file_block), count);
+		for(int i = 0; i < count; i++) {
+			if(start == -1 && !mini_journal_reserve(fs, 0, JR_FILE_SIZE)) {
+				return false;
+			}
+			int block = start == -1 ? mini_file_allocate_block(fs, fd, file_block + i) : start + i;
+			if(block == -1) {
+				return false;
+			}
+			if(start != -1) {
+				mini_file_add_block(fs, fd, file_block + i, block);
+				mini_journal_log_blocks(fs, fd, file_block + i, block);
+			}
+		}
+		file_block += count;
+	}
+	return true;
+}
 
 /**
- * Change the cursor position of an open file.
+ * Change the cursor position of an open file. Read handles stay within the
+ * file; write handles may go past its end, see mini_file_write (sparse files).
  * @param  offset     how much to change
  * @param  from_start whether to start from beginning of file (or current position)
  * @return            false if the new position is not available, true otherwise.
  */
-bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int offset, const bool from_start)
+bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t offset, const bool from_start)
 {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_SEEK);
+	std::lock_guard<std::mutex> guard(fs->lock);
+	if(!mini_file_flush_handle(fs, open_file)) {
+		return false;
+	}
+
 	//Check if seek position is valid then seek and return true otherwise return false
 	if(offset < 0) {
 		if(from_start){
@@ -376,16 +1771,17 @@ bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int off
 		open_file->position += offset;
 		return true;
 	}
+	//A write handle may go past the end: the next write leaves a hole
 	if(from_start){
 
-		if(offset <= mini_file_size(fs, open_file->file->name)) {
+		if(offset <= open_file->file->size || open_file->is_write) {
 			open_file->position = offset;
 			return true;
 		}
 		return false;
 	}
 	else {
-		if(offset + open_file->position <= mini_file_size(fs, open_file->file->name)) {
+		if(offset + open_file->position <= open_file->file->size || open_file->is_write) {
 			open_file->position += offset;
 			return true;
 		}
@@ -401,6 +1797,8 @@ bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int off
  */
 bool mini_file_delete(FAT_FILESYSTEM *fs, const char *filename)
 {
+	FAT_STATS_TIMER timer(&fs->stats, STAT_FILE_DELETE);
+	std::lock_guard<std::mutex> guard(fs->lock);
 	//Delete file after checks
 	FAT_FILE * fd = mini_file_find(fs, filename);
 	
@@ -408,19 +1806,69 @@ bool mini_file_delete(FAT_FILESYSTEM *fs, const char *filename)
 		printf("There is no file named %s\n", filename);
 		return false;
 	}
+	if (fd->is_directory) {
+		fprintf(stderr, "Cannot delete '%s': it is a directory.\n", filename);
+		return false;
+	}
 	if(!(fd->open_handles.empty())) {
 		printf("File is open. Cannot be deleted!\n");
 		return false;
 	}
+	return mini_file_delete_entry(fs, fd);
+}
 
-	fs->block_map[fd->metadata_block_id] = EMPTY_BLOCK;	
-	for(long unsigned int i = 0; i < fd->block_ids.size(); i++ ) {
-		fs->block_map[fd->block_ids[i]] = EMPTY_BLOCK;	
-	
+/**
+ * Remove a file, or an empty directory, from the filesystem and free its
+ * blocks. The caller holds fs->lock and checked nothing has it open.
+ * @return true on success
+ */
+bool mini_file_delete_entry(FAT_FILESYSTEM *fs, FAT_FILE *fd)
+{
+	if (!mini_file_load_entry(fs, fd)) {
+		return false;
+	}
+	//Blocks of the metadata the delete dirties: block map, name index, superblock
+	int metadata_blocks = 4 + fd->indirect_blocks.size();
+	for(long unsigned int i = 0; i < fd->extents.size() && metadata_blocks < fs->metadata_blocks; i++) {
+		metadata_blocks += fd->extents[i].length / (2 * fs->block_size) + 2;
+	}
+	if (!mini_journal_reserve(fs, metadata_blocks)) {
+		return false;
 	}
-	if(!(vector_delete_value(fs->files, fd))) {
 
+	int inode = fd->inode;
+	mini_inode_release(fs, inode);
+	for(long unsigned int i = 0; i < fd->indirect_blocks.size(); i++) {
+		mini_fat_set_block_type(fs, fd->indirect_blocks[i], EMPTY_BLOCK);
+	}
+	for(long unsigned int i = 0; i < fd->extents.size(); i++ ) {
+		for(int j = 0; j < fd->extents[i].length; j++) {
+			mini_fat_set_block_type(fs, fd->extents[i].start + j, EMPTY_BLOCK);
+		}
+	}
+	mini_file_index_remove(fs, fd);
+	mini_names_remove(fs, fd);
+	fd->parent->child_count--;
+	if (fs->directories_listed) {
+		fd->parent->children.erase(fd);
+	}
+	//Swap-remove from fs->files and fs->dirty_files: the last file takes its slot
+	if (fd->files_index >= fs->files.size() || fs->files[fd->files_index] != fd) {
 		return false;
 	}
+	FAT_FILE * last = fs->files.back();
+	fs->files[fd->files_index] = last;
+	last->files_index = fd->files_index;
+	fs->files.pop_back();
+	if (fd->dirty) {
+		last = fs->dirty_files.back();
+		fs->dirty_files[fd->dirty_index] = last;
+		last->dirty_index = fd->dirty_index;
+		fs->dirty_files.pop_back();
+		fs->dirty_indirect_blocks -= fd->dirty_indirect_blocks;
+	}
+	mini_fat_mark_metadata_dirty(fs, 0); // File count in the superblock.
+	delete fd;
+	mini_journal_log_delete(fs, inode);
 	return true;
 }
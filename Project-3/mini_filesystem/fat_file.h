@@ -2,27 +2,107 @@
 #define FAT_FILE_H
 
 
+#include <atomic>
+#include <set>
+#include <shared_mutex>
+#include <string>
 #include <vector>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct t_FAT_NAME_BLOCK FAT_NAME_BLOCK; // Forward definition.
+typedef struct t_FAT_ASYNC FAT_ASYNC; // Forward definition.
+typedef struct t_FAT_ASYNC_REQUEST FAT_ASYNC_REQUEST; // Forward definition.
 
 const int MAX_FILENAME_LENGTH = 256;
+const int MIN_READAHEAD_BLOCKS = 4; // Readahead window of a stream that just became sequential.
+const int MAX_READAHEAD_BLOCKS = 64; // The window doubles on each refill up to this.
+const int MAX_READAHEAD_BYTES = 4 << 20; // And up to this, for large blocks.
 
 // Feel free to modify the following structure.
 typedef struct t_FAT_OPEN_FILE {
 	FAT_FILE * file; // Pointers to FAT_FILE structure (the actual file).
-	int position; // Seek position.
+	int64_t position; // Seek position.
 	bool is_write;
+
+	int64_t next_position; // Where the last read ended, a read starting here is sequential.
+	int readahead_blocks; // Current readahead window, 0 after a non-sequential read.
+	int64_t readahead_position; // File position of readahead[0].
+	std::vector<char> readahead; // File bytes prefetched by mini_file_read.
+	unsigned long readahead_generation; // file->generation when readahead was filled.
+
+	int write_block; // Disk block of the buffered bytes, -1 when write_data holds none.
+	int write_start; // Buffered byte range [write_start, write_end) inside write_block.
+	int write_end;
+	bool write_fresh; // write_block was allocated for these bytes: flushed whole, zeros around them.
+	std::vector<char> write_data; // block_size bytes, written out by mini_file_flush.
 } FAT_OPEN_FILE;
 
+// A run of consecutive blocks on disk holding consecutive blocks of a file.
+typedef struct t_FAT_EXTENT {
+	int file_block; // Index of the first block inside the file.
+	int start; // First block on disk.
+	int length; // Number of blocks.
+} FAT_EXTENT;
+
+// Orders the entries of a directory by name; a bare name compares too.
+typedef struct t_FAT_NAME_ORDER {
+	typedef void is_transparent;
+	bool operator()(const FAT_FILE *a, const FAT_FILE *b) const;
+	bool operator()(const FAT_FILE *a, const char *b) const;
+	bool operator()(const char *a, const FAT_FILE *b) const;
+} FAT_NAME_ORDER;
+
 // Feel free to modify the following structure.
 typedef struct t_FAT_FILE {
-	char name[MAX_FILENAME_LENGTH];
-	int size;
-	int metadata_block_id; // The block index that holds the metadata of this file (entry block).
-	std::vector<int> block_ids; // Data blocks.
+	FAT_FILE * parent; // Directory holding this file, NULL for the root. Next to name, both are read by lookups.
+	std::string name; // Last component of the path. Short names are stored inline: no allocation per file at mount.
+	bool is_directory;
+	int child_count; // Entries of a directory.
+	std::set<FAT_FILE*, FAT_NAME_ORDER> children; // The entries sorted by name, once fs->directories_listed, see fat_dir.h.
+	int open_dirs; // FAT_DIR handles on this directory.
+	int64_t size;
+	int64_t written_end; // End of the bytes written, pending asynchronous writes included. Blocks past it are reserved (mini_file_fallocate) and hold old data.
+	int inode; // Number of the inode holding the metadata of this file, see fat_inode.h.
+	std::vector<FAT_EXTENT> extents; // Data blocks, sorted by file_block; missing file blocks are holes.
+	std::vector<int> indirect_blocks; // INDIRECT_BLOCKs holding the extents past INODE_EXTENTS, sized by mini_fat_sync.
+	int block_count; // Number of data blocks in extents.
+	bool is_inline; // The data lives in the inode (IN_INLINE_DATA) until the file outgrows it.
+	std::vector<char> inline_data; // The size bytes of an inline file.
+	bool dirty; // Inode changed since it was last written by mini_fat_sync.
+	long unsigned int dirty_index; // Position in fs->dirty_files while dirty.
+	int dirty_indirect_blocks; // Its share of fs->dirty_indirect_blocks while dirty.
+	bool loaded; // Size and extents read from the inode, see mini_file_load_entry.
+	FAT_NAME_BLOCK * name_block; // Name index segment holding this file's record.
+	long unsigned int files_index; // Position in fs->files, so a delete removes it without a search.
+	unsigned long generation; // Bumped by every write, invalidates readahead buffers.
+	std::shared_mutex lock; // Shared by reads, exclusive for writes; size and extents also change under fs->lock.
+	std::atomic<int> buffered_count; // Handles on this file with buffered bytes.
 
 	std::vector<const FAT_OPEN_FILE*> open_handles; // One entry each time this file is opened.
 } FAT_FILE;
 
+// Bytes of a file returned by mini_file_view without copying them: data
+// points into the mapping or a pinned block of the block cache. Valid until
+// mini_file_release_view; the file itself is not locked meanwhile.
+typedef struct t_FAT_FILE_VIEW {
+	const char * data; // size bytes, read-only.
+	int size; // 0 at the end of the file.
+
+	int pinned_block; // Cached block kept from eviction, -1 if none.
+	std::vector<char> copy; // The bytes of a hole, inline data or a block read with the cache off. Kept for the next view.
+} FAT_FILE_VIEW;
+
+inline bool FAT_NAME_ORDER::operator()(const FAT_FILE *a, const FAT_FILE *b) const {
+	return strcmp(a->name.c_str(), b->name.c_str()) < 0;
+}
+inline bool FAT_NAME_ORDER::operator()(const FAT_FILE *a, const char *b) const {
+	return strcmp(a->name.c_str(), b) < 0;
+}
+inline bool FAT_NAME_ORDER::operator()(const char *a, const FAT_FILE *b) const {
+	return strcmp(a, b->name.c_str()) < 0;
+}
+
 typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
 
 
@@ -32,24 +112,54 @@ void mini_file_dump(const FAT_FILESYSTEM *fs, const FAT_FILE *file);
 FAT_OPEN_FILE * mini_file_open(FAT_FILESYSTEM *fs, const char *filename, const bool is_write);
 bool mini_file_close(FAT_FILESYSTEM *fs, const FAT_OPEN_FILE * open_file);
 
-bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int offset, const bool from_start);
+bool mini_file_seek(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t offset, const bool from_start);
 bool mini_file_delete(FAT_FILESYSTEM *fs, const char *filename);
-int mini_file_size(FAT_FILESYSTEM *fs, const char *filename);
+int64_t mini_file_size(FAT_FILESYSTEM *fs, const char *filename);
 
 int mini_file_read(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, void * buffer);
 int mini_file_write(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, const void * buffer);
+bool mini_file_flush(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file);
+int mini_file_read_async(FAT_ASYNC *async, FAT_OPEN_FILE * open_file, const int size, void * buffer);
+int mini_file_write_async(FAT_ASYNC *async, FAT_OPEN_FILE * open_file, const int size, const void * buffer);
+bool mini_file_truncate(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t size);
+bool mini_file_fallocate(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int64_t size);
+bool mini_file_view(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file, const int size, FAT_FILE_VIEW *view);
+void mini_file_release_view(FAT_FILESYSTEM *fs, FAT_FILE_VIEW *view);
 
 
 // Helpers (not mandatory):
-FAT_FILE * mini_file_create_file(FAT_FILESYSTEM *fs, const char *filename);
+FAT_FILE * mini_file_create_file(FAT_FILESYSTEM *fs, const char *filename, const bool is_directory = false);
 FAT_FILE * mini_file_create(const char * filename);
+FAT_FILE * mini_file_create_entry(FAT_FILESYSTEM *fs, FAT_FILE *parent, const char *name, const bool is_directory,
+	const int inode, const int name_block);
+bool mini_file_delete_entry(FAT_FILESYSTEM *fs, FAT_FILE *file);
 FAT_FILE * mini_file_find(const FAT_FILESYSTEM *fs, const char *filename);
+FAT_FILE * mini_file_find_parent(const FAT_FILESYSTEM *fs, const char *filename, char *name);
+FAT_FILE * mini_file_lookup(const FAT_FILESYSTEM *fs, const FAT_FILE *directory, const char *name);
+void mini_file_link(FAT_FILESYSTEM *fs, FAT_FILE *parent, FAT_FILE *file);
+void mini_file_mark_dirty(FAT_FILESYSTEM *fs, FAT_FILE *file);
+void mini_file_index_insert(FAT_FILESYSTEM *fs, FAT_FILE *file);
+void mini_file_index_rebuild(FAT_FILESYSTEM *fs);
+void mini_file_index_remove(FAT_FILESYSTEM *fs, const FAT_FILE *file);
+bool mini_file_pack_entry(const FAT_FILESYSTEM *fs, const FAT_FILE *file, unsigned char *inode);
+void mini_file_pack_indirect(const FAT_FILESYSTEM *fs, const FAT_FILE *file, const int index, unsigned char *block);
+bool mini_file_unpack_entry(FAT_FILESYSTEM *fs, FAT_FILE *file, const unsigned char *inode);
+int mini_file_indirect_count(const FAT_FILESYSTEM *fs, const FAT_FILE *file);
+bool mini_file_fit_indirect(FAT_FILESYSTEM *fs, FAT_FILE *file);
+bool mini_file_load_entry(FAT_FILESYSTEM *fs, FAT_FILE *file);
+int mini_file_block_at(const FAT_FILE *file, const int file_block);
+void mini_file_add_block(FAT_FILESYSTEM *fs, FAT_FILE *file, const int file_block, const int block);
+int mini_file_allocate_block(FAT_FILESYSTEM *fs, FAT_FILE *file, const int file_block);
+void mini_file_remove_blocks(FAT_FILESYSTEM *fs, FAT_FILE *file, const int first);
+bool mini_file_flush_handle(FAT_FILESYSTEM *fs, FAT_OPEN_FILE * open_file);
+bool mini_file_flush_buffers(FAT_FILESYSTEM *fs);
+void mini_file_write_done(FAT_FILESYSTEM *fs, const FAT_ASYNC_REQUEST *request);
 
-inline int position_to_block_index(const FAT_FILESYSTEM * fs, const int position)  {
-	return position / fs->block_size;
+inline int position_to_block_index(const FAT_FILESYSTEM * fs, const int64_t position)  {
+	return (int)(position / fs->block_size);
 }
-inline int position_to_byte_index(const FAT_FILESYSTEM * fs, const int position) {
-	return position % fs->block_size;
+inline int position_to_byte_index(const FAT_FILESYSTEM * fs, const int64_t position) {
+	return (int)(position % fs->block_size);
 }
 
 #endif // FAT_FILE_H
\ No newline at end of file
@@ -0,0 +1,124 @@
+#ifndef FAT_FORMAT_H
+#define FAT_FORMAT_H
+
+#include <stdint.h>
+
+/// On-disk metadata layout. All integers are little-endian.
+
+const uint32_t FAT_MAGIC = 0x5441464D; // "MFAT"
+const uint32_t FAT_INODE_MAGIC = 0x4F4E494D; // "MINO"
+const uint32_t FAT_FORMAT_VERSION = 10;
+const uint32_t FAT_JOURNAL_MAGIC = 0x4C4E4A4D; // "MJNL"
+
+// Superblock, at the start of block 0:
+const int SB_MAGIC = 0; // u32 FAT_MAGIC
+const int SB_VERSION = 4; // u32 FAT_FORMAT_VERSION
+const int SB_BLOCK_SIZE = 8; // u32
+const int SB_BLOCK_COUNT = 12; // u32
+const int SB_FILE_COUNT = 16; // u32
+const int SB_METADATA_BLOCKS = 20; // u32 blocks holding the superblock and block map
+const int SB_JOURNAL_BLOCKS = 24; // u32 JOURNAL_BLOCKs after the metadata region, 0 without a journal
+const int SB_JOURNAL_EPOCH = 28; // u32 epoch of the journal transactions still to replay
+const int SUPERBLOCK_SIZE = 64; // Rest is reserved (zero).
+// The block map follows the superblock, two blocks per byte (low nibble first),
+// and continues over the next metadata blocks when it does not fit in block 0.
+// The first name index segment takes the rest of the last metadata block.
+
+// Name index, so mount knows every file's name, directory and inode without
+// reading the inode table. A chain of segments, each with a header and
+// records; the others are whole NAME_INDEX_BLOCKs.
+const int NS_NEXT = 0; // u32 block of the next segment, 0 for the last one
+const int NS_RECORD_COUNT = 4; // u32
+const int NAME_SEGMENT_HEADER = 8;
+// Record: u32 inode, u32 inode of the parent directory (0 for the root),
+// u8 NAME_TYPE_*, u8 name length, name bytes (one path component).
+const int NAME_RECORD_HEADER = 10;
+const unsigned char NAME_TYPE_FILE = 0;
+const unsigned char NAME_TYPE_DIRECTORY = 1;
+
+// Journal: a log of transactions written one after the other from the
+// start of the journal region. A transaction is valid if its magic, epoch
+// (the superblock's) and checksum match; replay stops at the first invalid one.
+const int JT_MAGIC = 0; // u32 FAT_JOURNAL_MAGIC
+const int JT_EPOCH = 4; // u32
+const int JT_LENGTH = 8; // u32 payload bytes
+const int JT_CHECKSUM = 12; // u32 FNV-1a of the payload, seeded with the epoch
+const int JOURNAL_TX_HEADER = 16;
+// Payload records, each a u8 type then:
+const unsigned char JR_CREATE = 1; // u32 inode, u32 name segment block, u32 parent inode, u8 NAME_TYPE_*, u8 name length, name
+const unsigned char JR_FILE = 2; // u32 inode, u64 size, u32 file block, u32 start, u32 length (blocks added)
+const unsigned char JR_DELETE = 3; // u32 inode
+const unsigned char JR_IMAGE = 4; // u32 block, block_size bytes (checkpoint)
+const unsigned char JR_TRUNCATE = 5; // u32 inode, u64 size (blocks past it freed)
+const unsigned char JR_INLINE = 6; // u32 inode, u32 length, data (whole file, IN_INLINE_DATA)
+const int JR_CREATE_HEADER = 15;
+const int JR_FILE_SIZE = 25;
+const int JR_DELETE_SIZE = 5;
+const int JR_TRUNCATE_SIZE = 13;
+const int JR_IMAGE_HEADER = 5;
+const int JR_INLINE_HEADER = 9;
+
+// Inode table: each INODE_TABLE_BLOCK holds block_size / INODE_SIZE inodes.
+// Inode n is slot n % inodes_per_block of block n / inodes_per_block, so
+// inode 0 (in the superblock's block) is never used and names the root
+// directory, which has no inode. Which slots are used is known from the name
+// index. An inode:
+const int INODE_SIZE = 128;
+const int IN_MAGIC = 0; // u32 FAT_INODE_MAGIC
+const int IN_SIZE = 4; // u64 file size in bytes
+const int IN_EXTENT_COUNT = 12; // u32 extents in the inode and its indirect blocks
+const int IN_FLAGS = 16; // u16 IN_*
+const int IN_INDIRECT = 20; // u32 first INDIRECT_BLOCK, 0 when the extents fit in the inode
+const int IN_DATA = 24;
+// Then up to INODE_EXTENTS extents of FILE_EXTENT_SIZE bytes, sorted by file
+// block: u32 file block, u32 start, u32 length. File blocks between extents
+// are holes, read as zeros. The following extents are in a chain of
+// INDIRECT_BLOCKs: u32 next block (0 for the last), u32 extent count, extents.
+const int FILE_EXTENT_SIZE = 12;
+const int INODE_EXTENTS = (INODE_SIZE - IN_DATA) / FILE_EXTENT_SIZE;
+const int IB_NEXT = 0;
+const int IB_EXTENT_COUNT = 4;
+const int INDIRECT_HEADER = 8;
+// With IN_INLINE_DATA the size bytes of the file are at IN_DATA instead, and
+// extent_count is 0: small files need no data block.
+const uint16_t IN_INLINE_DATA = 1;
+const int INODE_INLINE_BYTES = INODE_SIZE - IN_DATA;
+
+inline void put_u16(unsigned char *p, const uint16_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+}
+inline void put_u32(unsigned char *p, const uint32_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+inline void put_u64(unsigned char *p, const uint64_t value) {
+	put_u32(p, (uint32_t)value);
+	put_u32(p + 4, (uint32_t)(value >> 32));
+}
+inline uint16_t get_u16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+inline uint32_t get_u32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+inline uint64_t get_u64(const unsigned char *p) {
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+// Block map entries are 4 bits each.
+inline void put_nibble(unsigned char *p, const int index, const unsigned char value) {
+	unsigned char &byte = p[index / 2];
+	if (index % 2 == 0) {
+		byte = (byte & 0xF0) | (value & 0x0F);
+	} else {
+		byte = (byte & 0x0F) | (value << 4);
+	}
+}
+inline unsigned char get_nibble(const unsigned char *p, const int index) {
+	return index % 2 == 0 ? p[index / 2] & 0x0F : p[index / 2] >> 4;
+}
+
+#endif // FAT_FORMAT_H
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <cstdio>
+#include <stdint.h>
+#include "fat.h"
+#include "fat_format.h"
+#include "fat_inode.h"
+
+/**
+ * Block holding an inode, see fat_format.h.
+ */
+int mini_inode_block(const FAT_FILESYSTEM *fs, const int inode) {
+	return inode / fs->inodes_per_block;
+}
+
+/**
+ * Offset of an inode inside its block.
+ */
+int mini_inode_offset(const FAT_FILESYSTEM *fs, const int inode) {
+	return inode % fs->inodes_per_block * INODE_SIZE;
+}
+
+/**
+ * The table holding an inode, NULL if its block is not an inode table.
+ */
+FAT_INODE_TABLE * mini_inode_table(const FAT_FILESYSTEM *fs, const int inode) {
+	std::unordered_map<int, FAT_INODE_TABLE*>::const_iterator it = fs->inode_tables.find(mini_inode_block(fs, inode));
+	return it == fs->inode_tables.end() ? NULL : it->second;
+}
+
+static FAT_INODE_TABLE * mini_inode_add_table(FAT_FILESYSTEM *fs, const int block, const bool fresh) {
+	FAT_INODE_TABLE * table = new FAT_INODE_TABLE;
+	table->block_id = block;
+	table->used = 0;
+	table->slots.assign((fs->inodes_per_block + 63) / 64, 0);
+	table->fresh = fresh;
+	table->dirty = false;
+	fs->inode_tables[block] = table;
+	fs->inode_tables_free.insert(block);
+	return table;
+}
+
+void mini_inode_free_tables(FAT_FILESYSTEM *fs) {
+	for (std::unordered_map<int, FAT_INODE_TABLE*>::iterator it = fs->inode_tables.begin(); it != fs->inode_tables.end(); ++it) {
+		delete it->second;
+	}
+	fs->inode_tables.clear();
+	fs->inode_tables_free.clear();
+	fs->dirty_inode_tables.clear();
+}
+
+/**
+ * Register the INODE_TABLE_BLOCKs of the block map just read, with every
+ * slot free until mini_names_load claims the inodes of the files.
+ */
+void mini_inode_load_tables(FAT_FILESYSTEM *fs) {
+	for (int i = 0; i < fs->block_count; i++) {
+		if (fs->block_map[i] == INODE_TABLE_BLOCK) {
+			mini_inode_add_table(fs, i, false);
+		}
+	}
+}
+
+static void mini_inode_take(FAT_FILESYSTEM *fs, FAT_INODE_TABLE *table, const int slot) {
+	table->slots[slot / 64] |= 1ULL << (slot % 64);
+	table->used++;
+	if (table->used == fs->inodes_per_block) {
+		fs->inode_tables_free.erase(table->block_id);
+	}
+}
+
+/**
+ * Allocate an inode: the first free slot of the lowest table that has one,
+ * or the first slot of a new INODE_TABLE_BLOCK.
+ * @return the inode, -1 if the filesystem is full.
+ */
+int mini_inode_allocate(FAT_FILESYSTEM *fs) {
+	FAT_INODE_TABLE * table;
+	if (fs->inode_tables_free.empty()) {
+		int block = mini_fat_allocate_new_block(fs, INODE_TABLE_BLOCK);
+		if (block == -1) {
+			return -1;
+		}
+		if (block >= INT32_MAX / fs->inodes_per_block) {
+			fprintf(stderr, "Cannot use block %d as an inode table: inode numbers are 32-bit.\n", block);
+			mini_fat_set_block_type(fs, block, EMPTY_BLOCK);
+			return -1;
+		}
+		table = mini_inode_add_table(fs, block, true);
+	} else {
+		table = fs->inode_tables[*fs->inode_tables_free.begin()];
+	}
+	//Bits past the last slot are clear, but a real slot is free before them
+	int slot = 0;
+	for (long unsigned int i = 0; i < table->slots.size(); i++) {
+		if (~table->slots[i] != 0) {
+			slot = i * 64 + __builtin_ctzll(~table->slots[i]);
+			break;
+		}
+	}
+	mini_inode_take(fs, table, slot);
+	return table->block_id * fs->inodes_per_block + slot;
+}
+
+/**
+ * Mark an inode recorded on disk as used (mount, journal replay). An empty
+ * block becomes a new INODE_TABLE_BLOCK, as when the inode was allocated.
+ * @return false if the inode cannot be in an inode table or is already used.
+ */
+bool mini_inode_claim(FAT_FILESYSTEM *fs, const int inode) {
+	int block = mini_inode_block(fs, inode);
+	if (inode <= 0 || block >= fs->block_count) {
+		return false;
+	}
+	FAT_INODE_TABLE * table = mini_inode_table(fs, inode);
+	if (table == NULL) {
+		if (fs->block_map[block] != EMPTY_BLOCK) {
+			return false;
+		}
+		mini_fat_set_block_type(fs, block, INODE_TABLE_BLOCK);
+		table = mini_inode_add_table(fs, block, true);
+	}
+	int slot = inode % fs->inodes_per_block;
+	if (table->slots[slot / 64] >> (slot % 64) & 1) {
+		return false;
+	}
+	mini_inode_take(fs, table, slot);
+	return true;
+}
+
+/**
+ * Free an inode. A table left empty is freed; with a journal its block is
+ * reused only after the next checkpoint, like the other metadata blocks.
+ */
+void mini_inode_release(FAT_FILESYSTEM *fs, const int inode) {
+	FAT_INODE_TABLE * table = mini_inode_table(fs, inode);
+	if (table == NULL) return;
+	int slot = inode % fs->inodes_per_block;
+	table->slots[slot / 64] &= ~(1ULL << (slot % 64));
+	table->used--;
+	if (table->used > 0) {
+		fs->inode_tables_free.insert(table->block_id);
+		return;
+	}
+	fs->inode_tables.erase(table->block_id);
+	fs->inode_tables_free.erase(table->block_id);
+	if (table->dirty) {
+		fs->dirty_inode_tables.erase(std::find(fs->dirty_inode_tables.begin(), fs->dirty_inode_tables.end(), table->block_id));
+	}
+	mini_fat_set_block_type(fs, table->block_id, EMPTY_BLOCK);
+	delete table;
+}
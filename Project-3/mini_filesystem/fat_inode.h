@@ -0,0 +1,31 @@
+#ifndef FAT_INODE_H
+#define FAT_INODE_H
+
+#include <vector>
+#include <stdint.h>
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// One INODE_TABLE_BLOCK (see fat_format.h). Which of its slots hold an inode
+// is kept in memory only: mount rebuilds it from the name index, which lists
+// every file's inode, so the table itself is read one inode at a time by
+// mini_file_load_entry.
+typedef struct t_FAT_INODE_TABLE {
+	int block_id;
+	int used; // Slots holding an inode.
+	std::vector<uint64_t> slots; // One bit per slot, set when it holds an inode.
+	bool fresh; // Allocated since the last checkpoint: nothing on disk to keep.
+	bool dirty; // Holds a dirty file, listed in fs->dirty_inode_tables.
+} FAT_INODE_TABLE;
+
+
+void mini_inode_free_tables(FAT_FILESYSTEM *fs);
+void mini_inode_load_tables(FAT_FILESYSTEM *fs);
+int mini_inode_allocate(FAT_FILESYSTEM *fs);
+bool mini_inode_claim(FAT_FILESYSTEM *fs, const int inode);
+void mini_inode_release(FAT_FILESYSTEM *fs, const int inode);
+FAT_INODE_TABLE * mini_inode_table(const FAT_FILESYSTEM *fs, const int inode);
+int mini_inode_block(const FAT_FILESYSTEM *fs, const int inode);
+int mini_inode_offset(const FAT_FILESYSTEM *fs, const int inode);
+
+#endif // FAT_INODE_H
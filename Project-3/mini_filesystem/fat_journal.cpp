@@ -0,0 +1,531 @@
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_format.h"
+#include "fat_journal.h"
+
+/**
+ * Journal blocks reserved for a filesystem: room for images of the whole
+ * metadata region and of the INDIRECT_BLOCKs of a file fragmented across the
+ * whole disk, twice, plus 1/64 of the disk. A single operation never dirties
+ * more, so the checkpoint mini_journal_fits asks for always fits.
+ * @return 0 for filesystems too small to have a journal.
+ */
+int mini_journal_size(const int block_size, const int block_count, const int metadata_blocks) {
+	if (block_count < JOURNAL_MIN_DISK_BLOCKS) {
+		return 0;
+	}
+	int indirect = block_count / 2 / ((block_size - INDIRECT_HEADER) / FILE_EXTENT_SIZE) + 1;
+	return 2 * (metadata_blocks + indirect) + block_count / 64 + 16;
+}
+
+/**
+ * Set up an empty journal right after the metadata region.
+ */
+void mini_journal_init(FAT_FILESYSTEM *fs) {
+	fs->journal_start = fs->metadata_blocks;
+	fs->journal_blocks = mini_journal_size(fs->block_size, fs->block_count, fs->metadata_blocks);
+	fs->journal_epoch = 1;
+	fs->journal_head = 0;
+	fs->journal_last_record = -1;
+	fs->journal_suspended = true; // Until the filesystem is created or loaded.
+	fs->journal_commits = 0;
+	fs->journal_checkpoints = 0;
+	for (int i = 0; i < fs->journal_blocks; i++) {
+		mini_fat_set_block_type(fs, fs->journal_start + i, JOURNAL_BLOCK);
+	}
+}
+
+static bool mini_journal_logging(const FAT_FILESYSTEM *fs) {
+	return fs->journal_blocks > 0 && !fs->journal_suspended;
+}
+
+static off_t mini_journal_position(const FAT_FILESYSTEM *fs, const long offset) {
+	return (off_t)fs->journal_start * fs->block_size + offset;
+}
+
+static uint32_t mini_journal_checksum(const uint32_t epoch, const unsigned char *payload, const long length) {
+	uint32_t hash = (2166136261u ^ epoch) * 16777619u;
+	for (long i = 0; i < length; i++) {
+		hash = (hash ^ payload[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * Whether the pending transaction plus extra_bytes of records still leaves
+ * room for a checkpoint of every dirty metadata block plus extra_blocks: the
+ * inode tables of the dirty files and their INDIRECT_BLOCKs (see
+ * mini_file_mark_dirty), the name index segments and the block map.
+ */
+static bool mini_journal_fits(const FAT_FILESYSTEM *fs, const long extra_bytes, const int extra_blocks) {
+	long capacity = (long)fs->journal_blocks * fs->block_size;
+	long pending = JOURNAL_TX_HEADER + fs->journal_pending.size() + extra_bytes;
+	long dirty = fs->dirty_inode_tables.size() + fs->dirty_indirect_blocks + fs->dirty_name_blocks.size()
+		+ fs->dirty_metadata.size() + extra_blocks;
+	long images = JOURNAL_TX_HEADER + dirty * (JR_IMAGE_HEADER + fs->block_size);
+	return fs->journal_head + pending + images <= capacity;
+}
+
+/**
+ * Whether an operation that dirties up to blocks more metadata blocks and
+ * logs up to bytes of records fits in the journal without a checkpoint.
+ */
+bool mini_journal_room(const FAT_FILESYSTEM *fs, const int blocks, const long bytes) {
+	return !mini_journal_logging(fs) || mini_journal_fits(fs, bytes, blocks + JOURNAL_MARGIN_BLOCKS);
+}
+
+/**
+ * Checkpoint before an operation that may dirty up to blocks metadata blocks
+ * (e.g. deleting a large file) and log up to bytes of records, if the
+ * journal could not hold it otherwise. Operations call it before they change
+ * anything, as a checkpoint in their middle would make metadata pointing to
+ * blocks not written yet durable.
+ * @return false if the checkpoint failed or the operation cannot fit even in
+ *         an empty journal; the operation must then fail.
+ */
+bool mini_journal_reserve(FAT_FILESYSTEM *fs, const int blocks, const long bytes) {
+	if (mini_journal_room(fs, blocks, bytes)) {
+		return true;
+	}
+	if (!mini_fat_checkpoint(fs)) {
+		return false;
+	}
+	if (!mini_journal_room(fs, blocks, bytes)) {
+		fprintf(stderr, "Journal too small for an operation dirtying %d blocks.\n", blocks);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Add a record of size bytes at the end of journal_pending. The operation
+ * logging it reserved the room with mini_journal_reserve.
+ * @return the record.
+ */
+static unsigned char * mini_journal_append(FAT_FILESYSTEM *fs, const int size) {
+	fs->journal_last_record = fs->journal_pending.size();
+	fs->journal_pending.resize(fs->journal_pending.size() + size);
+	return &fs->journal_pending[fs->journal_last_record];
+}
+
+/**
+ * The last pending record if it is a JR_FILE record of the file, so appends
+ * to one file between commits update a single record.
+ */
+static unsigned char * mini_journal_last_file_record(FAT_FILESYSTEM *fs, const FAT_FILE *file) {
+	if (fs->journal_last_record < 0) return NULL;
+	unsigned char * record = &fs->journal_pending[fs->journal_last_record];
+	if (record[0] != JR_FILE || (int)get_u32(record + 1) != file->inode) return NULL;
+	return record;
+}
+
+void mini_journal_log_create(FAT_FILESYSTEM *fs, const FAT_FILE *file) {
+	if (!mini_journal_logging(fs)) return;
+	int name_length = file->name.size();
+	unsigned char * record = mini_journal_append(fs, JR_CREATE_HEADER + name_length);
+	record[0] = JR_CREATE;
+	put_u32(record + 1, file->inode);
+	put_u32(record + 5, file->name_block->block_id);
+	put_u32(record + 9, file->parent->inode);
+	record[13] = file->is_directory ? NAME_TYPE_DIRECTORY : NAME_TYPE_FILE;
+	record[14] = name_length;
+	memcpy(record + JR_CREATE_HEADER, file->name.data(), name_length);
+}
+
+/**
+ * Log that block became block file_block of the file.
+ */
+void mini_journal_log_blocks(FAT_FILESYSTEM *fs, const FAT_FILE *file, const int file_block, const int block) {
+	if (!mini_journal_logging(fs)) return;
+	unsigned char * record = mini_journal_last_file_record(fs, file);
+	if (record != NULL) {
+		int length = get_u32(record + 21);
+		if (length == 0) {
+			put_u32(record + 13, file_block);
+			put_u32(record + 17, block);
+			put_u32(record + 21, 1);
+			return;
+		}
+		if ((int)get_u32(record + 13) + length == file_block && (int)get_u32(record + 17) + length == block) {
+			put_u32(record + 21, length + 1);
+			return;
+		}
+	}
+	record = mini_journal_append(fs, JR_FILE_SIZE);
+	record[0] = JR_FILE;
+	put_u32(record + 1, file->inode);
+	put_u64(record + 5, file->size);
+	put_u32(record + 13, file_block);
+	put_u32(record + 17, block);
+	put_u32(record + 21, 1);
+}
+
+void mini_journal_log_size(FAT_FILESYSTEM *fs, const FAT_FILE *file) {
+	if (!mini_journal_logging(fs)) return;
+	unsigned char * record = mini_journal_last_file_record(fs, file);
+	if (record == NULL) {
+		record = mini_journal_append(fs, JR_FILE_SIZE);
+			memset(record, 0, JR_FILE_SIZE);
+		record[0] = JR_FILE;
+		put_u32(record + 1, file->inode);
+	}
+	put_u64(record + 5, file->size);
+}
+
+void mini_journal_log_delete(FAT_FILESYSTEM *fs, const int inode) {
+	if (!mini_journal_logging(fs)) return;
+	unsigned char * record = mini_journal_append(fs, JR_DELETE_SIZE);
+	record[0] = JR_DELETE;
+	put_u32(record + 1, inode);
+}
+
+void mini_journal_log_truncate(FAT_FILESYSTEM *fs, const FAT_FILE *file) {
+	if (!mini_journal_logging(fs)) return;
+	unsigned char * record = mini_journal_append(fs, JR_TRUNCATE_SIZE);
+	record[0] = JR_TRUNCATE;
+	put_u32(record + 1, file->inode);
+	put_u64(record + 5, file->size);
+}
+
+/**
+ * Log the whole data of an inline file. A pending record of the same file
+ * is replaced, so small writes to one file between commits log it once.
+ */
+void mini_journal_log_inline(FAT_FILESYSTEM *fs, const FAT_FILE *file) {
+	if (!mini_journal_logging(fs)) return;
+	if (fs->journal_last_record >= 0) {
+		unsigned char * last = &fs->journal_pending[fs->journal_last_record];
+		if (last[0] == JR_INLINE && (int)get_u32(last + 1) == file->inode) {
+			fs->journal_pending.resize(fs->journal_last_record);
+			fs->journal_last_record = -1;
+		}
+	}
+	int length = file->inline_data.size();
+	unsigned char * record = mini_journal_append(fs, JR_INLINE_HEADER + length);
+	record[0] = JR_INLINE;
+	put_u32(record + 1, file->inode);
+	put_u32(record + 5, length);
+	if (length > 0) {
+		memcpy(record + JR_INLINE_HEADER, file->inline_data.data(), length);
+	}
+}
+
+/**
+ * Write payload as one transaction at the journal head, then fdatasync.
+ * The file data written so far is synced before: with a single fdatasync
+ * the disk could keep the transaction and lose the data its records point to.
+ * @return false if it could not be written.
+ */
+static bool mini_journal_write(FAT_FILESYSTEM *fs, const std::vector<unsigned char> &payload) {
+	if (!mini_fat_disk_sync(fs)) {
+		return false;
+	}
+	std::vector<unsigned char> transaction(JOURNAL_TX_HEADER + payload.size());
+	put_u32(&transaction[JT_MAGIC], FAT_JOURNAL_MAGIC);
+	put_u32(&transaction[JT_EPOCH], fs->journal_epoch);
+	put_u32(&transaction[JT_LENGTH], payload.size());
+	put_u32(&transaction[JT_CHECKSUM], mini_journal_checksum(fs->journal_epoch, payload.data(), payload.size()));
+	memcpy(&transaction[JOURNAL_TX_HEADER], payload.data(), payload.size());
+	int size = transaction.size();
+	if (mini_fat_disk_write(fs, mini_journal_position(fs, fs->journal_head), size, transaction.data()) != size) {
+		return false;
+	}
+	if (!mini_fat_disk_sync(fs)) {
+		return false;
+	}
+	fs->journal_head += size;
+	return true;
+}
+
+/**
+ * Blocks freed by records that are now durable can be allocated again.
+ * Entry and name index blocks wait for the checkpoint: until then, replay
+ * may read them.
+ */
+static void mini_journal_release(FAT_FILESYSTEM *fs, std::vector<int> &freed) {
+	for (long unsigned int i = 0; i < freed.size(); i++) {
+		int block = freed[i];
+		if (fs->block_map[block] == EMPTY_BLOCK) {
+			fs->free_bitmap[block / 64] |= 1ULL << (block % 64);
+		}
+	}
+	freed.clear();
+}
+
+void mini_journal_release_freed(FAT_FILESYSTEM *fs, const bool checkpoint) {
+	mini_journal_release(fs, fs->journal_freed);
+	if (checkpoint) {
+		mini_journal_release(fs, fs->journal_freed_metadata);
+	}
+}
+
+/**
+ * Group commit: make every operation logged since the last commit, and the
+ * file data written so far, durable with one journal write and two
+ * fdatasyncs. File data is written and synced first so committed records
+ * never point to blocks that were not written.
+ * @return true on success
+ */
+bool mini_journal_commit(FAT_FILESYSTEM *fs) {
+	if (!mini_file_flush_buffers(fs) || !mini_cache_flush(fs)) {
+		return false;
+	}
+	if (fs->journal_pending.empty()) {
+		return mini_fat_disk_sync(fs); // Only overwrites of file data.
+	}
+	//Operations reserve their room; should one have logged more, the
+	//checkpoint covers the records instead
+	if (!mini_journal_fits(fs, 0, 0)) {
+		return mini_fat_checkpoint(fs);
+	}
+	if (!mini_journal_write(fs, fs->journal_pending)) {
+		perror("Cannot commit the journal");
+		return false;
+	}
+	fs->journal_pending.clear();
+	fs->journal_last_record = -1;
+	fs->journal_commits++;
+	mini_journal_release_freed(fs, false);
+	return true;
+}
+
+/**
+ * First step of a checkpoint (mini_fat_sync): log the images of the dirty
+ * metadata blocks, so a crash while they are written in place is redone at
+ * mount. The pending records are dropped, the checkpoint covers them.
+ * @param images count whole-block segments
+ * @return false if the images could not be logged, nothing is written then.
+ */
+bool mini_journal_checkpoint_begin(FAT_FILESYSTEM *fs, const FAT_SEGMENT *images, const int count) {
+	long capacity = (long)fs->journal_blocks * fs->block_size;
+	long size = JOURNAL_TX_HEADER + (long)count * (JR_IMAGE_HEADER + fs->block_size);
+	//A transaction is read back with one int-sized read. Never happens as
+	//mini_journal_fits reserves room; the pending records are kept for a retry
+	if (mini_journal_logging(fs) && count > 0 && (fs->journal_head + size > capacity || size > INT32_MAX)) {
+		fprintf(stderr, "Journal too small for a checkpoint of %d blocks.\n", count);
+		return false;
+	}
+	fs->journal_pending.clear();
+	fs->journal_last_record = -1;
+	if (!mini_journal_logging(fs) || count == 0) {
+		return true;
+	}
+	std::vector<unsigned char> payload((size_t)count * (JR_IMAGE_HEADER + fs->block_size));
+	unsigned char * record = payload.data();
+	for (int i = 0; i < count; i++) {
+		record[0] = JR_IMAGE;
+		put_u32(record + 1, images[i].block_id);
+		memcpy(record + JR_IMAGE_HEADER, images[i].buffer, fs->block_size);
+		record += JR_IMAGE_HEADER + fs->block_size;
+	}
+	if (!mini_journal_write(fs, payload)) {
+		perror("Cannot log the checkpoint");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Last step of a checkpoint, once the images are written in place: make them
+ * durable, then start a new epoch, which empties the journal.
+ * @return true on success
+ */
+bool mini_journal_checkpoint_end(FAT_FILESYSTEM *fs) {
+	if (fs->journal_blocks == 0) {
+		return true;
+	}
+	if (!mini_fat_disk_sync(fs)) {
+		return false;
+	}
+	unsigned char epoch[4];
+	put_u32(epoch, fs->journal_epoch + 1);
+	if (mini_fat_write_in_block(fs, 0, SB_JOURNAL_EPOCH, 4, epoch) != 4 || !mini_cache_flush(fs) || !mini_fat_disk_sync(fs)) {
+		return false;
+	}
+	fs->journal_epoch++;
+	fs->journal_head = 0;
+	fs->journal_checkpoints++;
+	mini_journal_release_freed(fs, true);
+	return true;
+}
+
+/**
+ * Redo a checkpoint whose images were logged: write them in place again and
+ * start the next epoch.
+ */
+static bool mini_journal_redo_checkpoint(FAT_FILESYSTEM *fs, std::vector<unsigned char> &payload) {
+	std::vector<FAT_SEGMENT> images;
+	long record_size = JR_IMAGE_HEADER + fs->block_size;
+	for (long offset = 0; offset + record_size <= (long)payload.size(); offset += record_size) {
+		unsigned char * record = &payload[offset];
+		int block = get_u32(record + 1);
+		if (record[0] != JR_IMAGE || block < 0 || block >= fs->block_count) {
+			return false;
+		}
+		FAT_SEGMENT image = { block, 0, fs->block_size, record + JR_IMAGE_HEADER };
+		images.push_back(image);
+	}
+	long size = (long)images.size() * fs->block_size;
+	if (mini_fat_write_segments(fs, images.data(), images.size()) != size || !mini_cache_flush(fs)) {
+		return false;
+	}
+	return mini_journal_checkpoint_end(fs);
+}
+
+/**
+ * First step of mount, before the metadata region is read: read the
+ * transactions of the current epoch. If one of them is a checkpoint, it is
+ * redone and nothing is left to replay; otherwise the committed records are
+ * kept in journal_replay for mini_journal_replay.
+ * @return false if the journal cannot be read or a checkpoint cannot be redone.
+ */
+bool mini_journal_recover(FAT_FILESYSTEM *fs) {
+	fs->journal_replay.clear();
+	fs->journal_head = 0;
+	if (fs->journal_blocks == 0) {
+		return true;
+	}
+	long capacity = (long)fs->journal_blocks * fs->block_size;
+	unsigned char header[JOURNAL_TX_HEADER];
+	std::vector<unsigned char> payload;
+	long position = 0;
+	while (position + JOURNAL_TX_HEADER <= capacity) {
+		if (mini_fat_disk_read(fs, mini_journal_position(fs, position), JOURNAL_TX_HEADER, header) != JOURNAL_TX_HEADER) {
+			return false;
+		}
+		long length = get_u32(header + JT_LENGTH);
+		if (get_u32(header + JT_MAGIC) != FAT_JOURNAL_MAGIC || get_u32(header + JT_EPOCH) != fs->journal_epoch
+			|| length == 0 || position + JOURNAL_TX_HEADER + length > capacity) {
+			break;
+		}
+		payload.resize(length);
+		if (mini_fat_disk_read(fs, mini_journal_position(fs, position + JOURNAL_TX_HEADER), length, payload.data()) != length) {
+			return false;
+		}
+		if (get_u32(header + JT_CHECKSUM) != mini_journal_checksum(fs->journal_epoch, payload.data(), length)) {
+			break; // Torn transaction, never committed.
+		}
+		if (payload[0] == JR_IMAGE) {
+			//The checkpoint covers every record before it
+			fs->journal_replay.clear();
+			return mini_journal_redo_checkpoint(fs, payload);
+		}
+		fs->journal_replay.insert(fs->journal_replay.end(), payload.begin(), payload.end());
+		position += JOURNAL_TX_HEADER + length;
+	}
+	fs->journal_head = position;
+	return true;
+}
+
+/**
+ * Apply the records kept by mini_journal_recover, once the block map and
+ * the name index of the last checkpoint are loaded. The changes are dirty in
+ * memory (and still in the journal) until the next checkpoint.
+ * @return false if a record does not match the filesystem.
+ */
+bool mini_journal_replay(FAT_FILESYSTEM *fs) {
+	if (fs->journal_replay.empty()) {
+		return true; // Clean unmount: no map of every file to build.
+	}
+	std::unordered_map<int, FAT_FILE*> files; // Inode -> file or directory.
+	files[0] = fs->root;
+	for (long unsigned int i = 0; i < fs->files.size(); i++) {
+		files[fs->files[i]->inode] = fs->files[i];
+	}
+	const unsigned char * record = fs->journal_replay.data();
+	const unsigned char * end = record + fs->journal_replay.size();
+	while (record < end) {
+		int inode = record + 5 <= end ? (int)get_u32(record + 1) : -1;
+		if (inode <= 0 || mini_inode_block(fs, inode) >= fs->block_count) {
+			return false;
+		}
+		if (record[0] == JR_CREATE) {
+			if (record + JR_CREATE_HEADER > end || record + JR_CREATE_HEADER + record[14] > end
+				|| !mini_inode_claim(fs, inode)) {
+				return false;
+			}
+			FAT_FILE * parent = files.count(get_u32(record + 9)) ? files[get_u32(record + 9)] : NULL;
+			if (parent == NULL || !parent->is_directory) {
+				return false;
+			}
+			char name[MAX_FILENAME_LENGTH];
+			memcpy(name, record + JR_CREATE_HEADER, record[14]);
+			name[record[14]] = 0;
+			FAT_FILE * file = mini_file_create_entry(fs, parent, name, record[13] == NAME_TYPE_DIRECTORY, inode, get_u32(record + 5));
+			if (file == NULL) {
+				return false;
+			}
+			files[inode] = file;
+			record += JR_CREATE_HEADER + record[14];
+		} else if (record[0] == JR_FILE) {
+			FAT_FILE * file = files.count(inode) ? files[inode] : NULL;
+			if (record + JR_FILE_SIZE > end || file == NULL || !mini_file_load_entry(fs, file)) {
+				return false;
+			}
+			int file_block = get_u32(record + 13);
+			int start = get_u32(record + 17);
+			int length = get_u32(record + 21);
+			//Only files with data blocks log these: an inline file was promoted
+			file->is_inline = false;
+			file->inline_data.clear();
+			for (int i = 0; i < length; i++) {
+				int mapped = mini_file_block_at(file, file_block + i);
+				if (file_block < 0 || start < 0 || start + i >= fs->block_count || (mapped != -1 && mapped != start + i)) {
+					return false;
+				}
+				if (mapped == -1) {
+					mini_fat_set_block_type(fs, start + i, FILE_DATA_BLOCK);
+					mini_file_add_block(fs, file, file_block + i, start + i);
+				}
+			}
+			file->size = get_u64(record + 5);
+			file->written_end = file->size;
+			mini_file_mark_dirty(fs, file);
+			record += JR_FILE_SIZE;
+		} else if (record[0] == JR_TRUNCATE) {
+			FAT_FILE * file = files.count(inode) ? files[inode] : NULL;
+			if (record + JR_TRUNCATE_SIZE > end || file == NULL || !mini_file_load_entry(fs, file)) {
+				return false;
+			}
+			file->is_inline = false;
+			file->inline_data.clear();
+			file->size = get_u64(record + 5);
+			file->written_end = file->size;
+			mini_file_remove_blocks(fs, file, (file->size + fs->block_size - 1) / fs->block_size);
+			record += JR_TRUNCATE_SIZE;
+		} else if (record[0] == JR_INLINE) {
+			FAT_FILE * file = files.count(inode) ? files[inode] : NULL;
+			if (record + JR_INLINE_HEADER > end || file == NULL || !mini_file_load_entry(fs, file)) {
+				return false;
+			}
+			long length = get_u32(record + 5);
+			if (record + JR_INLINE_HEADER + length > end || length > INODE_INLINE_BYTES || !file->extents.empty()) {
+				return false;
+			}
+			file->is_inline = true;
+			file->inline_data.assign(record + JR_INLINE_HEADER, record + JR_INLINE_HEADER + length);
+			file->size = length;
+			file->written_end = length;
+			mini_file_mark_dirty(fs, file);
+			record += JR_INLINE_HEADER + length;
+		} else if (record[0] == JR_DELETE) {
+			FAT_FILE * file = files.count(inode) ? files[inode] : NULL;
+			if (file == NULL || file->child_count > 0) {
+				return false;
+			}
+			files.erase(inode);
+			if (!mini_file_delete_entry(fs, file)) {
+				return false;
+			}
+			record += JR_DELETE_SIZE;
+		} else {
+			return false;
+		}
+	}
+	fs->journal_replay.clear();
+	fs->journal_replay.shrink_to_fit();
+	return true;
+}
@@ -0,0 +1,41 @@
+#ifndef FAT_JOURNAL_H
+#define FAT_JOURNAL_H
+
+// Redo journal for the metadata (see fat_format.h for the layout).
+// mini_file_create_file (files and directories), mini_file_write,
+// mini_file_truncate, mini_file_fallocate and mini_file_delete_entry reserve
+// room with mini_journal_reserve before changing anything, then append small
+// logical records to journal_pending; mini_fat_commit syncs the file data,
+// then writes the records as one transaction with a second fdatasync.
+// mini_fat_sync is the checkpoint: it logs images of the dirty metadata
+// blocks, writes them in place and starts a new epoch, which empties the
+// journal. Mount redoes an interrupted checkpoint, or replays the committed
+// records on top of the last checkpoint.
+
+typedef struct t_FAT_FILE FAT_FILE; // Forward definition.
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+typedef struct t_FAT_SEGMENT FAT_SEGMENT; // Forward definition.
+
+const int JOURNAL_MIN_DISK_BLOCKS = 1024; // Smaller filesystems have no journal.
+const int JOURNAL_MARGIN_BLOCKS = 8; // Metadata blocks an operation may dirty before its record.
+const int JOURNAL_RESERVE_BYTES = 64; // Records of an operation logging a few small ones.
+
+
+int mini_journal_size(const int block_size, const int block_count, const int metadata_blocks);
+void mini_journal_init(FAT_FILESYSTEM *fs);
+bool mini_journal_room(const FAT_FILESYSTEM *fs, const int blocks, const long bytes);
+bool mini_journal_reserve(FAT_FILESYSTEM *fs, const int blocks, const long bytes = JOURNAL_RESERVE_BYTES);
+void mini_journal_log_create(FAT_FILESYSTEM *fs, const FAT_FILE *file);
+void mini_journal_log_blocks(FAT_FILESYSTEM *fs, const FAT_FILE *file, const int file_block, const int block);
+void mini_journal_log_size(FAT_FILESYSTEM *fs, const FAT_FILE *file);
+void mini_journal_log_delete(FAT_FILESYSTEM *fs, const int inode);
+void mini_journal_log_truncate(FAT_FILESYSTEM *fs, const FAT_FILE *file);
+void mini_journal_log_inline(FAT_FILESYSTEM *fs, const FAT_FILE *file);
+bool mini_journal_commit(FAT_FILESYSTEM *fs);
+bool mini_journal_checkpoint_begin(FAT_FILESYSTEM *fs, const FAT_SEGMENT *images, const int count);
+bool mini_journal_checkpoint_end(FAT_FILESYSTEM *fs);
+void mini_journal_release_freed(FAT_FILESYSTEM *fs, const bool checkpoint);
+bool mini_journal_recover(FAT_FILESYSTEM *fs);
+bool mini_journal_replay(FAT_FILESYSTEM *fs);
+
+#endif // FAT_JOURNAL_H
@@ -0,0 +1,250 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include "fat.h"
+#include "fat_file.h"
+#include "fat_format.h"
+#include "fat_inode.h"
+#include "fat_names.h"
+
+static int record_size(const FAT_FILE *file) {
+	return NAME_RECORD_HEADER + file->name.size();
+}
+
+/**
+ * Queue a segment to be written by the next mini_fat_sync. The first segment
+ * lives in the last metadata block and is written with it.
+ */
+static void mark_dirty(FAT_FILESYSTEM *fs, FAT_NAME_BLOCK *names) {
+	if (names == fs->name_blocks[0]) {
+		mini_fat_mark_metadata_dirty(fs, fs->metadata_blocks - 1);
+		return;
+	}
+	if (names->dirty) return;
+	names->dirty = true;
+	fs->dirty_name_blocks.push_back(names);
+}
+
+/**
+ * Set up the first, empty, segment in the unused tail of the metadata region.
+ */
+void mini_names_init(FAT_FILESYSTEM *fs) {
+	FAT_NAME_BLOCK * names = new FAT_NAME_BLOCK;
+	names->block_id = fs->metadata_blocks - 1;
+	names->offset = (SUPERBLOCK_SIZE + (fs->block_count + 1) / 2) % fs->block_size;
+	names->used = NAME_SEGMENT_HEADER;
+	names->dirty = false;
+	fs->name_blocks.push_back(names);
+}
+
+void mini_names_free(FAT_FILESYSTEM *fs) {
+	for (long unsigned int i = 0; i < fs->name_blocks.size(); i++) {
+		delete fs->name_blocks[i];
+	}
+	fs->name_blocks.clear();
+	fs->dirty_name_blocks.clear();
+}
+
+/**
+ * Add a record for the file to the last segment, starting a new
+ * NAME_INDEX_BLOCK segment when it is full.
+ * @return false if the name cannot be stored (filesystem full).
+ */
+bool mini_names_add(FAT_FILESYSTEM *fs, FAT_FILE *file) {
+	FAT_NAME_BLOCK * last = fs->name_blocks.back();
+	int size = record_size(file);
+	if (last->offset + last->used + size > fs->block_size) {
+		if (NAME_SEGMENT_HEADER + size > fs->block_size) {
+			fprintf(stderr, "Cannot index file '%s': name is too long for %d byte blocks.\n", file->name.c_str(), fs->block_size);
+			return false;
+		}
+		int block = mini_fat_allocate_block_near(fs, NAME_INDEX_BLOCK, last->offset == 0 ? last->block_id + 1 : -1);
+		if (block == -1) {
+			return false;
+		}
+		FAT_NAME_BLOCK * names = new FAT_NAME_BLOCK;
+		names->block_id = block;
+		names->offset = 0;
+		names->used = NAME_SEGMENT_HEADER;
+		names->dirty = false;
+		fs->name_blocks.push_back(names);
+		mark_dirty(fs, last); // Its next pointer changed.
+		last = names;
+	}
+	last->files.push_back(file);
+	last->used += size;
+	file->name_block = last;
+	mark_dirty(fs, last);
+	return true;
+}
+
+/**
+ * Add a record for the file to the segment at block, as mini_names_add did
+ * when the change was logged (journal replay): the last segment, or a new
+ * NAME_INDEX_BLOCK segment at block.
+ * @return false if block cannot hold the segment.
+ */
+bool mini_names_add_at(FAT_FILESYSTEM *fs, FAT_FILE *file, const int block) {
+	FAT_NAME_BLOCK * last = fs->name_blocks.back();
+	int size = record_size(file);
+	if (last->block_id != block) {
+		if (block <= 0 || block >= fs->block_count || fs->block_map[block] != EMPTY_BLOCK) {
+			return false;
+		}
+		mini_fat_set_block_type(fs, block, NAME_INDEX_BLOCK);
+		FAT_NAME_BLOCK * names = new FAT_NAME_BLOCK;
+		names->block_id = block;
+		names->offset = 0;
+		names->used = NAME_SEGMENT_HEADER;
+		names->dirty = false;
+		fs->name_blocks.push_back(names);
+		mark_dirty(fs, last); // Its next pointer changed.
+		last = names;
+	}
+	if (last->offset + last->used + size > fs->block_size) {
+		return false;
+	}
+	last->files.push_back(file);
+	last->used += size;
+	file->name_block = last;
+	mark_dirty(fs, last);
+	return true;
+}
+
+/**
+ * Remove the file's record. A NAME_INDEX_BLOCK left empty is unlinked and freed.
+ */
+void mini_names_remove(FAT_FILESYSTEM *fs, FAT_FILE *file) {
+	FAT_NAME_BLOCK * names = file->name_block;
+	if (names == NULL) return;
+	names->files.erase(std::find(names->files.begin(), names->files.end(), file));
+	names->used -= record_size(file);
+	file->name_block = NULL;
+	if (!names->files.empty() || names == fs->name_blocks[0]) {
+		mark_dirty(fs, names);
+		return;
+	}
+	//Unlink the empty segment: the previous one gets a new next pointer
+	std::vector<FAT_NAME_BLOCK*>::iterator position = std::find(fs->name_blocks.begin(), fs->name_blocks.end(), names);
+	mark_dirty(fs, *(position - 1));
+	fs->name_blocks.erase(position);
+	if (names->dirty) {
+		fs->dirty_name_blocks.erase(std::find(fs->dirty_name_blocks.begin(), fs->dirty_name_blocks.end(), names));
+	}
+	mini_fat_set_block_type(fs, names->block_id, EMPTY_BLOCK);
+	delete names;
+}
+
+/**
+ * Serialize a segment: header (next segment, record count) then records.
+ * @param segment where the segment starts, block_size - names->offset bytes
+ */
+void mini_names_pack(const FAT_FILESYSTEM *fs, const FAT_NAME_BLOCK *names, unsigned char *segment) {
+	std::vector<FAT_NAME_BLOCK*>::const_iterator position = std::find(fs->name_blocks.begin(), fs->name_blocks.end(), names);
+	int next = position + 1 == fs->name_blocks.end() ? 0 : (*(position + 1))->block_id;
+	put_u32(segment + NS_NEXT, next);
+	put_u32(segment + NS_RECORD_COUNT, names->files.size());
+	unsigned char * record = segment + NAME_SEGMENT_HEADER;
+	for (long unsigned int i = 0; i < names->files.size(); i++) {
+		const FAT_FILE * file = names->files[i];
+		int name_length = file->name.size();
+		put_u32(record, file->inode);
+		put_u32(record + 4, file->parent->inode);
+		record[8] = file->is_directory ? NAME_TYPE_DIRECTORY : NAME_TYPE_FILE;
+		record[9] = name_length;
+		memcpy(record + NAME_RECORD_HEADER, file->name.data(), name_length);
+		record += NAME_RECORD_HEADER + name_length;
+	}
+}
+
+/**
+ * Parse one segment, creating a not yet loaded FAT_FILE for each record.
+ * @param  parents receives the parent inode of each file, in fs->files order
+ * @return next segment block, 0 for the last one, -1 if the segment is corrupt.
+ */
+static int load_segment(FAT_FILESYSTEM *fs, FAT_NAME_BLOCK *names, const unsigned char *segment, std::vector<int> &parents) {
+	int capacity = fs->block_size - names->offset;
+	int record_count = get_u32(segment + NS_RECORD_COUNT);
+	const unsigned char * record = segment + NAME_SEGMENT_HEADER;
+	for (int i = 0; i < record_count; i++) {
+		if (record + NAME_RECORD_HEADER > segment + capacity) {
+			return -1;
+		}
+		int name_length = record[9];
+		if (record + NAME_RECORD_HEADER + name_length > segment + capacity || record[8] > NAME_TYPE_DIRECTORY) {
+			return -1;
+		}
+		//Every inode is in an inode table of the block map, once
+		int inode = get_u32(record);
+		if (inode <= 0 || mini_inode_block(fs, inode) >= fs->block_count
+			|| fs->block_map[mini_inode_block(fs, inode)] != INODE_TABLE_BLOCK || !mini_inode_claim(fs, inode)) {
+			return -1;
+		}
+		FAT_FILE * file = mini_file_create("");
+		file->name.assign((const char*)record + NAME_RECORD_HEADER, name_length);
+		file->inode = inode;
+		file->is_directory = record[8] == NAME_TYPE_DIRECTORY;
+		file->loaded = false; // Inode is read by mini_file_load_entry.
+		file->name_block = names;
+		names->files.push_back(file);
+		names->used += NAME_RECORD_HEADER + name_length;
+		file->files_index = fs->files.size();
+		fs->files.push_back(file);
+		parents.push_back(get_u32(record + 4));
+		record += NAME_RECORD_HEADER + name_length;
+	}
+	int next = get_u32(segment + NS_NEXT);
+	if (next != 0 && (next >= fs->block_count || fs->block_map[next] != NAME_INDEX_BLOCK)) {
+		return -1;
+	}
+	return next;
+}
+
+/**
+ * Rebuild the name index and the (not yet loaded) files and directories from
+ * disk: the first segment from the already read last metadata block, then
+ * the chain.
+ * @return false if the index is corrupt.
+ */
+bool mini_names_load(FAT_FILESYSTEM *fs, const unsigned char *last_metadata_block) {
+	std::vector<int> parents;
+	FAT_NAME_BLOCK * names = fs->name_blocks[0];
+	int next = load_segment(fs, names, last_metadata_block + names->offset, parents);
+	std::vector<unsigned char> block(fs->block_size);
+	while (next > 0) {
+		if ((int)fs->name_blocks.size() > fs->block_count) {
+			return false; // The chain loops.
+		}
+		names = new FAT_NAME_BLOCK;
+		names->block_id = next;
+		names->offset = 0;
+		names->used = NAME_SEGMENT_HEADER;
+		names->dirty = false;
+		fs->name_blocks.push_back(names);
+		if (mini_fat_read_in_block(fs, next, 0, fs->block_size, block.data()) != fs->block_size) {
+			return false;
+		}
+		next = load_segment(fs, names, block.data(), parents);
+	}
+	if (next != 0) {
+		return false;
+	}
+	//Link every file to its directory, then index it by directory and name
+	std::unordered_map<int, FAT_FILE*> directories; // Inode -> directory.
+	directories[0] = fs->root;
+	for (long unsigned int i = 0; i < fs->files.size(); i++) {
+		if (fs->files[i]->is_directory) {
+			directories[fs->files[i]->inode] = fs->files[i];
+		}
+	}
+	for (long unsigned int i = 0; i < fs->files.size(); i++) {
+		std::unordered_map<int, FAT_FILE*>::iterator parent = directories.find(parents[i]);
+		if (parent == directories.end() || parent->second == fs->files[i]) {
+			return false;
+		}
+		mini_file_link(fs, parent->second, fs->files[i]);
+	}
+	mini_file_index_rebuild(fs);
+	return true;
+}
@@ -0,0 +1,27 @@
+#ifndef FAT_NAMES_H
+#define FAT_NAMES_H
+
+#include <vector>
+
+typedef struct t_FAT_FILE FAT_FILE; // Forward definition.
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+// One segment of the on-disk name index (see fat_format.h).
+typedef struct t_FAT_NAME_BLOCK {
+	int block_id; // Block holding the segment.
+	int offset; // Start of the segment inside the block, only the first segment (in the metadata region) has one.
+	int used; // Bytes used, header included.
+	std::vector<FAT_FILE*> files; // Files with a record in this segment, in record order.
+	bool dirty; // Changed since the last mini_fat_sync.
+} FAT_NAME_BLOCK;
+
+
+void mini_names_init(FAT_FILESYSTEM *fs);
+void mini_names_free(FAT_FILESYSTEM *fs);
+bool mini_names_add(FAT_FILESYSTEM *fs, FAT_FILE *file);
+bool mini_names_add_at(FAT_FILESYSTEM *fs, FAT_FILE *file, const int block);
+void mini_names_remove(FAT_FILESYSTEM *fs, FAT_FILE *file);
+void mini_names_pack(const FAT_FILESYSTEM *fs, const FAT_NAME_BLOCK *names, unsigned char *segment);
+bool mini_names_load(FAT_FILESYSTEM *fs, const unsigned char *last_metadata_block);
+
+#endif // FAT_NAMES_H
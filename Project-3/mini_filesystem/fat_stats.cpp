@@ -0,0 +1,185 @@
+#include <cstdio>
+#include <stdint.h>
+#include "fat.h"
+#include "fat_stats.h"
+
+static const char * STAT_API_NAMES[STAT_API_COUNT] = {
+	"mini_file_open", "mini_file_close", "mini_file_read", "mini_file_write", "mini_file_seek",
+	"mini_file_delete", "mini_file_size", "mini_file_flush", "mini_file_read_async", "mini_file_write_async",
+	"mini_fat_save", "mini_fat_load", "mini_fat_sync", "mini_fat_commit", "mini_fat_flush",
+	"mini_fat_read_in_block", "mini_fat_write_in_block", "mini_fat_read_segments", "mini_fat_write_segments",
+	"mini_file_truncate", "mini_file_fallocate",
+	"mini_dir_create", "mini_dir_delete", "mini_dir_open", "mini_dir_read", "mini_dir_close",
+	"mini_file_view",
+};
+
+static std::atomic<unsigned long> next_stats_id(1);
+
+// Shards of the calling thread, by filesystem id. Ids are never reused, so an
+// entry left by an unmounted filesystem is never matched again.
+typedef struct t_FAT_STATS_SHARD_REF {
+	unsigned long id;
+	FAT_STATS_SHARD * shard;
+} FAT_STATS_SHARD_REF;
+static thread_local std::vector<FAT_STATS_SHARD_REF> thread_shards;
+
+void mini_stats_init(FAT_STATS *stats) {
+	stats->id = next_stats_id.fetch_add(1, std::memory_order_relaxed);
+	stats->shards.clear();
+}
+
+void mini_stats_free(FAT_STATS *stats) {
+	std::lock_guard<std::mutex> guard(stats->lock);
+	for (long unsigned int i = 0; i < stats->shards.size(); i++) {
+		delete stats->shards[i];
+	}
+	stats->shards.clear();
+}
+
+thread_local unsigned long stats_shard_id = 0;
+thread_local FAT_STATS_SHARD * stats_shard = NULL;
+static thread_local uint32_t stats_random = 0;
+
+/**
+ * mini_stats_shard when the thread last used another filesystem: look the
+ * shard up in the thread's list, or create it.
+ */
+FAT_STATS_SHARD * mini_stats_shard_slow(FAT_STATS *stats) {
+	FAT_STATS_SHARD * shard = NULL;
+	for (long unsigned int i = 0; i < thread_shards.size(); i++) {
+		if (thread_shards[i].id == stats->id) {
+			shard = thread_shards[i].shard;
+		}
+	}
+	if (shard == NULL) {
+		shard = new FAT_STATS_SHARD;
+		for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+			shard->counters[i] = 0;
+		}
+		for (int i = 0; i < STAT_API_COUNT; i++) {
+			shard->api[i].calls = 0;
+			shard->api[i].samples = 0;
+			shard->api[i].total_ns = 0;
+			for (int j = 0; j < STAT_HISTOGRAM_BUCKETS; j++) {
+				shard->api[i].histogram[j] = 0;
+			}
+		}
+		{
+			std::lock_guard<std::mutex> guard(stats->lock);
+			stats->shards.push_back(shard);
+		}
+		FAT_STATS_SHARD_REF ref = { stats->id, shard };
+		thread_shards.push_back(ref);
+	}
+	stats_shard_id = stats->id;
+	stats_shard = shard;
+	return shard;
+}
+
+/**
+ * Whether to time this call of api, see STAT_SAMPLE_PERIOD.
+ */
+bool mini_stats_sample(const int api) {
+	if ((api >= STAT_FAT_SAVE && api <= STAT_FAT_FLUSH) || api == STAT_FILE_DELETE) {
+		return true;
+	}
+	//xorshift32, seeded per thread
+	uint32_t x = stats_random;
+	if (x == 0) {
+		x = (uint32_t)(uintptr_t)&stats_random | 1;
+	}
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	stats_random = x;
+	return (x & (STAT_SAMPLE_PERIOD - 1)) == 0;
+}
+
+/**
+ * Count one timed call taking elapsed_ns, in the bucket of its log2.
+ */
+void mini_stats_record(FAT_STATS_API *counters, const uint64_t elapsed_ns) {
+	int bucket = 63 - __builtin_clzll(elapsed_ns | 1);
+	if (bucket >= STAT_HISTOGRAM_BUCKETS) {
+		bucket = STAT_HISTOGRAM_BUCKETS - 1;
+	}
+	mini_stats_bump(counters->samples, 1);
+	mini_stats_bump(counters->total_ns, elapsed_ns);
+	mini_stats_bump(counters->histogram[bucket], 1);
+}
+
+/**
+ * Sum of a counter (STAT_BYTES_READ, ...) over every thread.
+ */
+unsigned long mini_stats_counter(const FAT_FILESYSTEM *fs, const int counter) {
+	FAT_STATS * stats = (FAT_STATS*)&fs->stats;
+	std::lock_guard<std::mutex> guard(stats->lock);
+	unsigned long sum = 0;
+	for (long unsigned int i = 0; i < stats->shards.size(); i++) {
+		sum += stats->shards[i]->counters[counter].load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+// Print a duration in ns with the largest unit keeping it >= 1.
+static void mini_stats_print_ns(const double ns) {
+	if (ns >= 1e9) {
+		printf("%6.1fs ", ns / 1e9);
+	} else if (ns >= 1e6) {
+		printf("%6.1fms", ns / 1e6);
+	} else if (ns >= 1e3) {
+		printf("%6.1fus", ns / 1e3);
+	} else {
+		printf("%6.0fns", ns);
+	}
+}
+
+/**
+ * Print the counters, then for each API called so far its call count, and
+ * the mean latency and non-empty histogram buckets of its timed calls,
+ * summed over the threads.
+ */
+void mini_stats_dump(const FAT_FILESYSTEM *fs) {
+	printf("I/O statistics:\n");
+	printf("\tHost syscalls: %lu\tBytes read: %lu\tBytes written: %lu\n", fs->host_io_calls.load(),
+		mini_stats_counter(fs, STAT_BYTES_READ), mini_stats_counter(fs, STAT_BYTES_WRITTEN));
+	printf("\tBlocks allocated: %lu\tBlocks freed: %lu\n",
+		mini_stats_counter(fs, STAT_BLOCKS_ALLOCATED), mini_stats_counter(fs, STAT_BLOCKS_FREED));
+
+	FAT_STATS * stats = (FAT_STATS*)&fs->stats;
+	std::lock_guard<std::mutex> guard(stats->lock);
+	for (int i = 0; i < STAT_API_COUNT; i++) {
+		unsigned long calls = 0;
+		unsigned long samples = 0;
+		unsigned long total_ns = 0;
+		unsigned long histogram[STAT_HISTOGRAM_BUCKETS] = { 0 };
+		for (long unsigned int s = 0; s < stats->shards.size(); s++) {
+			const FAT_STATS_API &counters = stats->shards[s]->api[i];
+			calls += counters.calls.load(std::memory_order_relaxed);
+			samples += counters.samples.load(std::memory_order_relaxed);
+			total_ns += counters.total_ns.load(std::memory_order_relaxed);
+			for (int j = 0; j < STAT_HISTOGRAM_BUCKETS; j++) {
+				histogram[j] += counters.histogram[j].load(std::memory_order_relaxed);
+			}
+		}
+		if (calls == 0) continue;
+		printf("\t%s: %lu calls, %lu timed", STAT_API_NAMES[i], calls, samples);
+		if (samples > 0) {
+			printf(", mean ");
+			mini_stats_print_ns((double)total_ns / samples);
+		}
+		printf("\n");
+		for (int j = 0; j < STAT_HISTOGRAM_BUCKETS; j++) {
+			if (histogram[j] == 0) continue;
+			printf("\t\t[");
+			mini_stats_print_ns((double)(1ULL << j));
+			printf(", ");
+			if (j == STAT_HISTOGRAM_BUCKETS - 1) {
+				printf("     ...");
+			} else {
+				mini_stats_print_ns((double)(1ULL << (j + 1)));
+			}
+			printf(") %lu\n", histogram[j]);
+		}
+	}
+}
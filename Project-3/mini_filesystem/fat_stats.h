@@ -0,0 +1,135 @@
+#ifndef FAT_STATS_H
+#define FAT_STATS_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+// Counters, index into FAT_STATS_SHARD::counters.
+const int STAT_BYTES_READ = 0; // From the virtual disk (pread/preadv/io_uring, or the mapping).
+const int STAT_BYTES_WRITTEN = 1; // To the virtual disk.
+const int STAT_BLOCKS_ALLOCATED = 2;
+const int STAT_BLOCKS_FREED = 3;
+const int STAT_COUNTER_COUNT = 4;
+
+// APIs timed by the statistics, index into FAT_STATS_SHARD::api.
+const int STAT_FILE_OPEN = 0;
+const int STAT_FILE_CLOSE = 1;
+const int STAT_FILE_READ = 2;
+const int STAT_FILE_WRITE = 3;
+const int STAT_FILE_SEEK = 4;
+const int STAT_FILE_DELETE = 5;
+const int STAT_FILE_SIZE = 6;
+const int STAT_FILE_FLUSH = 7;
+const int STAT_FILE_READ_ASYNC = 8;
+const int STAT_FILE_WRITE_ASYNC = 9;
+const int STAT_FAT_SAVE = 10;
+const int STAT_FAT_LOAD = 11;
+const int STAT_FAT_SYNC = 12;
+const int STAT_FAT_COMMIT = 13;
+const int STAT_FAT_FLUSH = 14;
+const int STAT_READ_IN_BLOCK = 15; // Block helpers.
+const int STAT_WRITE_IN_BLOCK = 16;
+const int STAT_READ_SEGMENTS = 17;
+const int STAT_WRITE_SEGMENTS = 18;
+const int STAT_FILE_TRUNCATE = 19;
+const int STAT_FILE_FALLOCATE = 20;
+const int STAT_DIR_CREATE = 21;
+const int STAT_DIR_DELETE = 22;
+const int STAT_DIR_OPEN = 23;
+const int STAT_DIR_READ = 24;
+const int STAT_DIR_CLOSE = 25;
+const int STAT_FILE_VIEW = 26;
+const int STAT_API_COUNT = 27;
+
+// Latency histogram bucket i counts calls taking [2^i, 2^(i+1)) ns; the
+// last bucket also holds everything slower.
+const int STAT_HISTOGRAM_BUCKETS = 32;
+// Calls are always counted, but reading the clock costs about as much as a
+// cached block read: the APIs called per block or per record are timed on
+// one call in STAT_SAMPLE_PERIOD, picked at random. Save, load, sync, commit,
+// flush and delete are timed on every call.
+const int STAT_SAMPLE_PERIOD = 16; // Power of two.
+
+typedef struct t_FAT_STATS_API {
+	std::atomic<unsigned long> calls;
+	std::atomic<unsigned long> samples; // Timed calls.
+	std::atomic<unsigned long> total_ns; // Of the timed calls.
+	std::atomic<unsigned long> histogram[STAT_HISTOGRAM_BUCKETS]; // Of the timed calls.
+} FAT_STATS_API;
+
+// The counters of one thread. Only that thread writes them, with a relaxed
+// load and store (no locked instruction); mini_stats_dump reads them.
+typedef struct t_FAT_STATS_SHARD {
+	std::atomic<unsigned long> counters[STAT_COUNTER_COUNT];
+	FAT_STATS_API api[STAT_API_COUNT];
+} FAT_STATS_SHARD;
+
+// Statistics kept by the filesystem, cheap enough to stay on: every thread
+// updates its own shard, and the shards are summed when dumped. A dump taken
+// while calls are in progress need not add up exactly.
+typedef struct t_FAT_STATS {
+	unsigned long id; // Unique per filesystem, keys the per-thread shard lookup.
+	std::mutex lock; // Guards shards.
+	std::vector<FAT_STATS_SHARD*> shards; // One per thread that used the filesystem.
+} FAT_STATS;
+
+typedef struct t_FAT_FILESYSTEM FAT_FILESYSTEM; // Forward definition.
+
+
+void mini_stats_init(FAT_STATS *stats);
+void mini_stats_free(FAT_STATS *stats);
+void mini_stats_dump(const FAT_FILESYSTEM *fs);
+unsigned long mini_stats_counter(const FAT_FILESYSTEM *fs, const int counter);
+
+// Helpers:
+FAT_STATS_SHARD * mini_stats_shard_slow(FAT_STATS *stats);
+bool mini_stats_sample(const int api);
+void mini_stats_record(FAT_STATS_API *counters, const uint64_t elapsed_ns);
+
+// The calling thread's last shard, checked before the list of its shards.
+extern thread_local unsigned long stats_shard_id;
+extern thread_local FAT_STATS_SHARD * stats_shard;
+
+/**
+ * The calling thread's shard of stats, created on its first use.
+ */
+inline FAT_STATS_SHARD * mini_stats_shard(FAT_STATS *stats) {
+	if (stats_shard_id == stats->id) {
+		return stats_shard;
+	}
+	return mini_stats_shard_slow(stats);
+}
+
+inline uint64_t mini_stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Add to a counter only the calling thread writes.
+inline void mini_stats_bump(std::atomic<unsigned long> &counter, const unsigned long value) {
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+inline void mini_stats_count(FAT_STATS *stats, const int counter, const unsigned long value) {
+	mini_stats_bump(mini_stats_shard(stats)->counters[counter], value);
+}
+
+// Counts the enclosing scope as one call of api, and times it if sampled.
+typedef struct t_FAT_STATS_TIMER {
+	FAT_STATS_API * counters;
+	uint64_t start; // 0 when this call is not timed.
+
+	t_FAT_STATS_TIMER(FAT_STATS *stats, const int api) : counters(&mini_stats_shard(stats)->api[api]) {
+		mini_stats_bump(counters->calls, 1);
+		start = mini_stats_sample(api) ? mini_stats_now() : 0;
+	}
+	~t_FAT_STATS_TIMER() {
+		if (start != 0) mini_stats_record(counters, mini_stats_now() - start);
+	}
+} FAT_STATS_TIMER;
+
+#endif // FAT_STATS_H
@@ -1,5 +1,16 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include "fat.h"
+#include "fat_async.h"
+#include "fat_dir.h"
 #include "fat_file.h"
+#include "fat_format.h"
 
 const char * fox = "The quick brown fox jumps over the lazy dog.\n";
 
@@ -152,13 +163,13 @@ void test_write_to_file1(FAT_FILESYSTEM * fs) {
 
 	printf("Writing 1 chunk of %d bytes, should fit in multiple block (new blocks).\n", (int)strlen(buffer));
 	written = mini_file_write(fs, fd1, strlen(buffer), buffer);
-	score(written == strlen(buffer), 3);
-	score(mini_file_size(fs, "file1.txt") == 45*3+strlen(buffer), 2);
+	score(written == (int)strlen(buffer), 3);
+	score(mini_file_size(fs, "file1.txt") == 45*3+(int)strlen(buffer), 2);
 
 	printf("Writing another chunk of 45 bytes, should fit in the last block.\n");
 	written = mini_file_write(fs, fd1, strlen(fox), fox);
 	score(written == 45);
-	score(mini_file_size(fs, "file1.txt") == 45*4+strlen(buffer));
+	score(mini_file_size(fs, "file1.txt") == 45*4+(int)strlen(buffer));
 
 	score(mini_file_close(fs, fd1));
 }
@@ -192,7 +203,7 @@ void test_read_from_file1(FAT_FILESYSTEM * fs) {
 	printf("Reading the rest of the file.\n");
 	memset(buffer, 0, sizeof(buffer));
 	read = mini_file_read(fs, fd2, 4096, buffer);
-	score(read == 2981); // There's nothing more to read.
+	score(read == 2539); // There's nothing more to read.
 	score(strcmp(buffer+strlen(buffer)-5, "dog.\n") == 0);
 
 
@@ -267,7 +278,7 @@ void test_seek(FAT_FILESYSTEM * fs) {
 	res = mini_file_seek(fs, fd1, 45 + 4, true);
 	score(res);
 	int written = mini_file_write(fs ,fd1, 5, "slowy");
-	score(written = 5);
+	score(written == 5);
 
 	res = mini_file_seek(fs, fd1, -5, false);
 	memset(buffer, 0, sizeof(buffer));
@@ -284,6 +295,418 @@ void test_seek(FAT_FILESYSTEM * fs) {
 	mini_file_close(fs, fd2);
 }
 
+bool is_zero(const char * buffer, const int size) {
+	for (int i = 0; i < size; i++) {
+		if (buffer[i] != 0) return false;
+	}
+	return true;
+}
+
+void test_sparse_file() {
+	FAT_FILESYSTEM * fs = mini_fat_create("sparse.fat", 512, 256);
+	char buffer[8192];
+
+	printf("Seeking past the end and writing leaves a hole.\n");
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "sparse.txt", true);
+	mini_file_write(fs, fd, strlen(fox), fox);
+	score(mini_file_seek(fs, fd, 5000, true));
+	mini_file_write(fs, fd, strlen(fox), fox);
+	mini_file_flush(fs, fd);
+	score(mini_file_size(fs, "sparse.txt") == 5000 + (int64_t)strlen(fox) && fd->file->block_count == 2);
+	mini_file_close(fs, fd);
+
+	printf("The hole reads as zeros.\n");
+	fd = mini_file_open(fs, "sparse.txt", false);
+	int read = mini_file_read(fs, fd, sizeof(buffer), buffer);
+	score(read == 5000 + (int)strlen(fox) && memcmp(buffer, fox, strlen(fox)) == 0
+		&& is_zero(buffer + strlen(fox), 5000 - strlen(fox)) && memcmp(buffer + 5000, fox, strlen(fox)) == 0);
+	mini_file_close(fs, fd);
+	mini_fat_unmount(fs);
+	remove("sparse.fat");
+}
+
+void test_truncate_fallocate() {
+	FAT_FILESYSTEM * fs = mini_fat_create("truncate.fat", 512, 128);
+	char buffer[4096];
+	int read;
+
+	FAT_OPEN_FILE * fd = mini_file_open(fs, "grow.txt", true);
+	for (int i = 0; i < 20; i++) {
+		mini_file_write(fs, fd, strlen(fox), fox);
+	}
+	printf("Truncating a 900-byte file to 10 bytes.\n");
+	score(mini_file_truncate(fs, fd, 10) && mini_file_size(fs, "grow.txt") == 10);
+	mini_file_seek(fs, fd, 0, true);
+	read = mini_file_read(fs, fd, sizeof(buffer), buffer);
+	score(read == 10 && memcmp(buffer, fox, 10) == 0);
+
+	printf("Growing it to 2000 bytes leaves an unallocated hole reading as zeros.\n");
+	score(mini_file_truncate(fs, fd, 2000) && mini_file_size(fs, "grow.txt") == 2000 && fd->file->block_count == 1);
+	mini_file_seek(fs, fd, 0, true);
+	read = mini_file_read(fs, fd, sizeof(buffer), buffer);
+	score(read == 2000 && memcmp(buffer, fox, 10) == 0 && is_zero(buffer + 10, 1990));
+	mini_file_close(fs, fd);
+
+	printf("Reserving 100 blocks keeps the size and takes one run of blocks.\n");
+	FAT_OPEN_FILE * reserved = mini_file_open(fs, "reserved.bin", true);
+	score(mini_file_fallocate(fs, reserved, 100 * 512) && mini_file_size(fs, "reserved.bin") == 0
+		&& reserved->file->block_count == 100 && reserved->file->extents.size() == 1);
+
+	printf("Reserving 100 more blocks should not work:\n");
+	FAT_OPEN_FILE * other = mini_file_open(fs, "other.bin", true);
+	score(!mini_file_fallocate(fs, other, 100 * 512));
+
+	printf("Until the first file is truncated to 0 bytes.\n");
+	score(mini_file_truncate(fs, reserved, 0) && reserved->file->block_count == 0);
+	score(mini_file_fallocate(fs, other, 100 * 512) && other->file->block_count == 100);
+	mini_file_write(fs, other, strlen(fox), fox);
+	mini_file_close(fs, reserved);
+	mini_file_close(fs, other);
+
+	printf("Truncated and reserved files survive save/load.\n");
+	score(mini_fat_save(fs));
+	mini_fat_unmount(fs);
+	fs = mini_fat_load("truncate.fat");
+	fd = fs == NULL ? NULL : mini_file_open(fs, "grow.txt", false);
+	read = fd == NULL ? 0 : mini_file_read(fs, fd, sizeof(buffer), buffer);
+	score(read == 2000 && memcmp(buffer, fox, 10) == 0 && is_zero(buffer + 10, 1990));
+	other = fs == NULL ? NULL : mini_file_open(fs, "other.bin", false);
+	read = other == NULL ? 0 : mini_file_read(fs, other, sizeof(buffer), buffer);
+	score(read == (int)strlen(fox) && memcmp(buffer, fox, read) == 0 && other->file->block_count == 100
+		&& mini_file_size(fs, "reserved.bin") == 0);
+
+	printf("Read handles can neither truncate nor reserve.\n");
+	score(fd != NULL && !mini_file_truncate(fs, fd, 0) && !mini_file_fallocate(fs, fd, 4000)
+		&& mini_file_size(fs, "grow.txt") == 2000 && fd->file->block_count == 1);
+	mini_file_close(fs, fd);
+	mini_file_close(fs, other);
+	mini_fat_unmount(fs);
+	remove("truncate.fat");
+}
+
+// Entries of a directory as "name name/ ...", directories with a slash.
+std::string list_directory(FAT_FILESYSTEM * fs, const char * dirname) {
+	FAT_DIR * dir = mini_dir_open(fs, dirname);
+	if (dir == NULL) return "none";
+	std::string names;
+	FAT_DIR_ENTRY entry;
+	while (mini_dir_read(fs, dir, &entry)) {
+		names += names.empty() ? "" : " ";
+		names += entry.name;
+		names += entry.is_directory ? "/" : "";
+	}
+	mini_dir_close(fs, dir);
+	return names;
+}
+
+void test_directories() {
+	FAT_FILESYSTEM * fs = mini_fat_create("dirs.fat", 512, 2048);
+
+	printf("Creating nested directories.\n");
+	score(mini_dir_create(fs, "docs") && mini_dir_create(fs, "docs/notes") && mini_dir_create(fs, "docs/notes/old"));
+	printf("Creating a directory under a missing one should not work:\n");
+	score(!mini_dir_create(fs, "missing/child"));
+
+	printf("Listing a directory returns its entries in name order.\n");
+	const char * names[] = { "docs/b.txt", "docs/a.txt", "docs/notes/old/c.txt" };
+	for (int i = 0; i < 3; i++) {
+		FAT_OPEN_FILE * fd = mini_file_open(fs, names[i], true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+	}
+	score(list_directory(fs, "docs") == "a.txt b.txt notes/" && list_directory(fs, "/") == "docs/");
+
+	printf("Deleting a directory that is not empty should not work:\n");
+	score(!mini_dir_delete(fs, "docs/notes"));
+	printf("Deleting an open directory should not work:\n");
+	mini_file_delete(fs, "docs/notes/old/c.txt");
+	FAT_DIR * dir = mini_dir_open(fs, "docs/notes/old");
+	score(dir != NULL && !mini_dir_delete(fs, "docs/notes/old"));
+	mini_dir_close(fs, dir);
+	printf("Deleting it once closed.\n");
+	score(mini_dir_delete(fs, "docs/notes/old") && list_directory(fs, "docs/notes") == "");
+
+	printf("The tree survives save/load.\n");
+	score(mini_fat_save(fs));
+	mini_fat_unmount(fs);
+	fs = mini_fat_load("dirs.fat");
+	char buffer[64] = { 0 };
+	FAT_OPEN_FILE * fd = fs == NULL ? NULL : mini_file_open(fs, "docs/a.txt", false);
+	int read = fd == NULL ? 0 : mini_file_read(fs, fd, sizeof(buffer), buffer);
+	score(fs != NULL && list_directory(fs, "docs") == "a.txt b.txt notes/" && list_directory(fs, "docs/notes") == ""
+		&& read == (int)strlen(fox) && strcmp(buffer, fox) == 0);
+	mini_file_close(fs, fd);
+	mini_fat_unmount(fs);
+	remove("dirs.fat");
+}
+
+void test_file_views() {
+	const char * modes[] = { "pread, cache of 2 blocks", "mmap", "cache off" };
+	std::vector<char> expected(4000, 0);
+	for (int i = 0; i < 4000; i++) {
+		if (i < 1000 || i >= 3000) expected[i] = 'a' + i % 26;
+	}
+	for (int mode = 0; mode < 3; mode++) {
+		printf("Viewing a file with a hole in place (%s).\n", modes[mode]);
+		FAT_FILESYSTEM * fs = mini_fat_create("views.fat", 512, 2048, mode == 1 ? FAT_IO_MMAP : FAT_IO_PREAD);
+		if (mode != 1) {
+			mini_cache_set_capacity(fs, mode == 0 ? 2 : 0);
+		}
+		FAT_OPEN_FILE * fd = mini_file_open(fs, "hole.bin", true);
+		mini_file_write(fs, fd, 1000, expected.data());
+		mini_file_seek(fs, fd, 3000, true);
+		mini_file_write(fs, fd, 1000, expected.data() + 3000);
+		mini_file_close(fs, fd);
+		fd = mini_file_open(fs, "small.txt", true);
+		mini_file_write(fs, fd, strlen(fox), fox);
+		mini_file_close(fs, fd);
+		fd = mini_file_open(fs, "other.bin", true);
+		mini_file_write(fs, fd, expected.size(), expected.data());
+		mini_file_close(fs, fd);
+
+		//Each view moves the position past its bytes, like mini_file_read
+		fd = mini_file_open(fs, "hole.bin", false);
+		std::string seen;
+		bool advances = true;
+		FAT_FILE_VIEW view;
+		while (mini_file_view(fs, fd, 700, &view) && view.size > 0) {
+			seen.append(view.data, view.size);
+			advances = advances && view.size <= 700 && fd->position == (int64_t)seen.size();
+			mini_file_release_view(fs, &view);
+		}
+		mini_file_release_view(fs, &view);
+		score(seen.size() == expected.size() && memcmp(seen.data(), expected.data(), seen.size()) == 0);
+		score(advances);
+
+		printf("Viewing an inline file.\n");
+		FAT_OPEN_FILE * small = mini_file_open(fs, "small.txt", false);
+		bool whole = mini_file_view(fs, small, 100, &view) && view.size == (int)strlen(fox) && memcmp(view.data, fox, view.size) == 0;
+		mini_file_release_view(fs, &view);
+		score(whole && mini_file_view(fs, small, 100, &view) && view.size == 0);
+		mini_file_release_view(fs, &view);
+		mini_file_close(fs, small);
+
+		if (mode == 0) {
+			printf("A viewed block stays cached while another file goes through a cache of 2 blocks.\n");
+			mini_file_seek(fs, fd, 0, true);
+			bool pinned = mini_file_view(fs, fd, 512, &view) && view.size == 512 && view.pinned_block != -1;
+			FAT_OPEN_FILE * reader = mini_file_open(fs, "other.bin", false);
+			FAT_FILE_VIEW other;
+			while (mini_file_view(fs, reader, 512, &other) && other.size > 0) {
+				mini_file_release_view(fs, &other);
+			}
+			mini_file_release_view(fs, &other);
+			mini_file_close(fs, reader);
+			score(pinned && mini_cache_contains(fs, view.pinned_block) && memcmp(view.data, expected.data(), 512) == 0);
+
+			printf("The cache cannot be turned off while a view pins a block.\n");
+			bool refused = !mini_cache_set_capacity(fs, 0) && fs->cache.capacity == 2;
+			mini_file_release_view(fs, &view);
+			score(refused && mini_cache_set_capacity(fs, 0) && fs->cache.lru.empty());
+			mini_cache_set_capacity(fs, 2);
+		}
+
+		printf("Holding two views of a file while writing it.\n");
+		mini_file_seek(fs, fd, 0, true);
+		FAT_FILE_VIEW second;
+		bool both = mini_file_view(fs, fd, 512, &view) && mini_file_view(fs, fd, 512, &second);
+		FAT_OPEN_FILE * writer = mini_file_open(fs, "hole.bin", true);
+		mini_file_seek(fs, writer, 4096, true);
+		bool written = mini_file_write(fs, writer, 4, "abcd") == 4 && mini_file_flush(fs, writer);
+		mini_file_close(fs, writer);
+		score(both && written && view.size == 512 && second.size == 512
+			&& memcmp(view.data, expected.data(), 512) == 0 && memcmp(second.data, expected.data() + 512, 512) == 0);
+		mini_file_release_view(fs, &second);
+		mini_file_release_view(fs, &view);
+		mini_file_close(fs, fd);
+		mini_fat_unmount(fs);
+		remove("views.fat");
+	}
+}
+
+void test_async_io() {
+	const int engines[] = { FAT_ASYNC_URING, FAT_ASYNC_THREADS };
+	std::vector<char> data(64 << 10);
+	for (long unsigned int i = 0; i < data.size(); i++) data[i] = 'a' + i % 26;
+	for (int round = 0; round < 2; round++) {
+		FAT_FILESYSTEM * fs = mini_fat_create("async.fat", 4096, 2048);
+		FAT_ASYNC * async = mini_async_open(fs, 8, engines[round]);
+		printf("Writing and reading 64 KiB asynchronously (%s).\n",
+			async->engine == FAT_ASYNC_URING ? "io_uring" : engines[round] == FAT_ASYNC_URING ? "io_uring unavailable, threads" : "threads");
+		FAT_OPEN_FILE * fd = mini_file_open(fs, "async.bin", true);
+		int token = mini_file_write_async(async, fd, data.size(), data.data());
+		score(token >= 0 && mini_async_wait(async, token) == (int)data.size() && mini_file_size(fs, "async.bin") == (int64_t)data.size());
+
+		std::vector<char> buffer(data.size());
+		mini_file_seek(fs, fd, 0, true);
+		token = mini_file_read_async(async, fd, buffer.size(), buffer.data());
+		score(token >= 0 && mini_async_wait(async, token) == (int)buffer.size() && buffer == data);
+
+		printf("A failed asynchronous append frees its blocks.\n");
+		int blocks = fd->file->block_count;
+		int disk_fd = dup(fs->fd);
+		int read_only = open("async.fat", O_RDONLY);
+		dup2(read_only, fs->fd);
+		mini_file_seek(fs, fd, data.size(), true);
+		token = mini_file_write_async(async, fd, data.size(), data.data());
+		bool failed = token >= 0 && mini_async_wait(async, token) == -1;
+		dup2(disk_fd, fs->fd);
+		close(disk_fd);
+		close(read_only);
+		score(failed && fd->file->block_count == blocks && mini_file_size(fs, "async.bin") == (int64_t)data.size());
+		mini_file_close(fs, fd);
+		mini_async_close(async);
+		mini_fat_unmount(fs);
+		remove("async.fat");
+	}
+}
+
+// Crash workload: op i appends a line to one of CRASH_FILES files, every
+// 100th op deletes one instead. Each op is committed before it is acknowledged.
+const int CRASH_FILES = 64;
+
+void crash_op(FAT_FILESYSTEM * fs, const int i) {
+	char name[32];
+	if (i % 100 == 99) {
+		sprintf(name, "crash%d.txt", (i / 100) % CRASH_FILES);
+		mini_file_delete(fs, name);
+		return;
+	}
+	sprintf(name, "crash%d.txt", i % CRASH_FILES);
+	FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+	mini_file_seek(fs, fd, fd->file->size, true);
+	mini_file_write(fs, fd, strlen(fox), fox);
+	mini_file_close(fs, fd);
+}
+
+// Whether fs holds exactly the files the first ops ops leave.
+bool crash_state_matches(FAT_FILESYSTEM * fs, const int ops) {
+	int lines[CRASH_FILES];
+	for (int j = 0; j < CRASH_FILES; j++) lines[j] = -1; // No file.
+	for (int i = 0; i < ops; i++) {
+		if (i % 100 == 99) {
+			lines[(i / 100) % CRASH_FILES] = -1;
+		} else {
+			lines[i % CRASH_FILES] = lines[i % CRASH_FILES] < 0 ? 1 : lines[i % CRASH_FILES] + 1;
+		}
+	}
+	char name[32];
+	std::string expected;
+	std::vector<char> buffer;
+	for (int j = 0; j < CRASH_FILES; j++) {
+		sprintf(name, "crash%d.txt", j);
+		if (lines[j] < 0) {
+			if (mini_file_find(fs, name) != NULL) return false;
+			continue;
+		}
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, false);
+		if (fd == NULL) return false;
+		expected.clear();
+		for (int k = 0; k < lines[j]; k++) expected += fox;
+		buffer.assign(expected.size() + 1, 0);
+		int read = mini_file_read(fs, fd, buffer.size(), buffer.data());
+		mini_file_close(fs, fd);
+		if (read != (int)expected.size() || memcmp(buffer.data(), expected.data(), read) != 0) return false;
+	}
+	return true;
+}
+
+// Fragmented workload: op i appends a block to one of two files in turn, so
+// every block of a file is an extent and most extents are in indirect blocks.
+const int FRAGMENT_BLOCK = 512;
+
+void fragment_op(FAT_FILESYSTEM * fs, const int i) {
+	char name[32];
+	char block[FRAGMENT_BLOCK];
+	sprintf(name, "fragment%d.bin", i % 2);
+	memset(block, 'a' + i % 26, sizeof(block));
+	FAT_OPEN_FILE * fd = mini_file_open(fs, name, true);
+	mini_file_seek(fs, fd, fd->file->size, true);
+	mini_file_write(fs, fd, sizeof(block), block);
+	mini_file_close(fs, fd);
+}
+
+bool fragment_state_matches(FAT_FILESYSTEM * fs, const int ops) {
+	char name[32];
+	char block[FRAGMENT_BLOCK];
+	for (int j = 0; j < 2; j++) {
+		sprintf(name, "fragment%d.bin", j);
+		FAT_OPEN_FILE * fd = mini_file_open(fs, name, false);
+		if (fd == NULL) return false;
+		bool matches = fd->file->size == (int64_t)(ops - j + 1) / 2 * FRAGMENT_BLOCK;
+		for (int i = j; matches && i < ops; i += 2) {
+			matches = mini_file_read(fs, fd, sizeof(block), block) == FRAGMENT_BLOCK
+				&& block[0] == 'a' + i % 26 && block[FRAGMENT_BLOCK - 1] == 'a' + i % 26;
+		}
+		mini_file_close(fs, fd);
+		if (!matches) return false;
+	}
+	return true;
+}
+
+// Runs op 0, 1, ... each followed by mini_fat_commit in a child process,
+// kills it after kill_after acknowledged ops and mounts what it left.
+// Every acknowledged op must survive; the one in flight may have been committed too.
+FAT_FILESYSTEM * crash_and_recover(void (*op)(FAT_FILESYSTEM*, const int), bool (*matches)(FAT_FILESYSTEM*, const int),
+	const int kill_after, const int io_mode, bool * recovered) {
+	*recovered = false;
+	int acks[2];
+	if (pipe(acks) != 0) {
+		perror("pipe");
+		return NULL;
+	}
+	fflush(stdout);
+	pid_t child = fork();
+	if (child == 0) {
+		close(acks[0]);
+		FAT_FILESYSTEM * fs = mini_fat_create("crash.fat", 512, 4096, io_mode);
+		for (int i = 0; ; i++) {
+			op(fs, i);
+			if (!mini_fat_commit(fs) || write(acks[1], &i, sizeof(i)) != sizeof(i)) {
+				_exit(1);
+			}
+		}
+	}
+	close(acks[1]);
+	int acknowledged = 0;
+	int done;
+	while (acknowledged < kill_after && read(acks[0], &done, sizeof(done)) == sizeof(done)) {
+		acknowledged++;
+	}
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+	close(acks[0]);
+
+	FAT_FILESYSTEM * fs = mini_fat_load("crash.fat", io_mode);
+	*recovered = fs != NULL && acknowledged == kill_after
+		&& (matches(fs, acknowledged) || matches(fs, acknowledged + 1));
+	if (fs != NULL) {
+		printf("Mounted at journal epoch %u.\n", fs->journal_epoch);
+	}
+	return fs;
+}
+
+void test_crash_recovery() {
+	const int kill_after[] = { 150, 333, 517 };
+	for (int round = 0; round < 3; round++) {
+		int io_mode = round == 1 ? FAT_IO_MMAP : FAT_IO_PREAD;
+		printf("Killing a committing process after %d acknowledged operations (%s).\n",
+			kill_after[round], io_mode == FAT_IO_MMAP ? "mmap" : "pread");
+		bool recovered;
+		FAT_FILESYSTEM * fs = crash_and_recover(crash_op, crash_state_matches, kill_after[round], io_mode, &recovered);
+		score(recovered, 5);
+		mini_fat_unmount(fs);
+	}
+
+	printf("Killing a process appending to fragmented files after 300 acknowledged operations.\n");
+	bool recovered;
+	FAT_FILESYSTEM * fs = crash_and_recover(fragment_op, fragment_state_matches, 300, FAT_IO_PREAD, &recovered);
+	FAT_FILE * file = fs == NULL ? NULL : mini_file_find(fs, "fragment0.bin");
+	score(recovered && file != NULL && mini_file_load_entry(fs, file) && file->extents.size() > (size_t)INODE_EXTENTS, 5);
+	mini_fat_unmount(fs);
+	remove("crash.fat");
+}
+
 void test_suite(FAT_FILESYSTEM * fs) {
 	test_open_3_files(fs);
 	test_delete_file2(fs);
@@ -322,7 +745,15 @@ int main()
 	}
 
 
-	printf("Final score: %d/%d\n", current_score/3*2, 100);
+	test_sparse_file();
+	test_truncate_fallocate();
+	test_directories();
+	test_file_views();
+	test_async_io();
+
+	test_crash_recovery();
+
+	printf("Final score: %d/%d\n", current_score * 100 / total_score, 100);
 	return 0;
 }
 